@@ -17,6 +17,10 @@
 #include <stdbool.h>
 #include <wchar.h>
 
+#if defined(__SSE2__)
+#   include <immintrin.h>
+#endif
+
 #if defined(__unix__)
 #   include <fcntl.h>
 #   include <sys/stat.h>
@@ -25,6 +29,8 @@
 #   include <limits.h>
 #   include <sys/utsname.h> 
 #   include <dirent.h>
+#   include <time.h>
+#   include <dlfcn.h>
 #endif
 
 #if defined(_WIN32) || defined(_WIN64)
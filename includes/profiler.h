@@ -28,6 +28,7 @@ void profiler_init(void);
 #define LINKING "linking"
 #define INTERN "interning"
 #define IO "io"
+#define BYTECODE "bytecode"
 
 // Arguments
 #define INT(key, value) SPDR_INT(key, value)
@@ -15,6 +15,7 @@ void arena_grow(Arena *arena, size_t min_size) {
 }
 
 void *arena_alloc(Arena *arena, size_t size) {
+    count_allocation(size);
     if (size > (size_t)(arena->end - arena->ptr)) {
         arena_grow(arena, size);
         ASSERT(size <= (size_t)(arena->end - arena->ptr));
@@ -0,0 +1,328 @@
+/*
+ Benchmarks the bytecode interpreter on hand assembled programs, each stressing one kind of work:
+ integer arithmetic, floating point, memory streams, branches and calls. Run by make bench-vm.
+
+ Every program first runs once profiled to count the instructions it executes, then is timed over
+ BENCH_RUNS runs of verified code taking the fastest. The nop program does nothing but dispatch so
+ its time per instruction is taken as the cost of dispatch, every other program reports the share of
+ its time that leaves. Results are printed and written as JSON to the path given, bench-vm.json when
+ none is.
+*/
+#define BENCH 1
+#include "../../unity.c"
+
+#define BENCH_RUNS 5
+
+typedef struct VMBenchmark VMBenchmark;
+struct VMBenchmark {
+    const char *name;
+    void (*emit)(BCBuilder *b, VMBenchmark *bench);
+    u32 highest_register;
+    Reg result;     // register holding the result checked against expected once run, none when 0
+    u64 expected;
+    u8 *data;       // memory the program accesses, allocated by emit
+    u64 data_size;
+
+    u64 instructions;
+    u64 nanoseconds; // of the fastest run
+    u64 code_bytes;
+    u64 decoded_bytes;
+    u64 stack_bytes;
+};
+
+#define BENCH_LOOP_COUNT 20000000
+#define BENCH_STREAM_SIZE (4 * 1024 * 1024)
+#define BENCH_STREAM_PASSES 8
+#define BENCH_VECTOR_SIZE (64 * 1024)
+#define BENCH_VECTOR_PASSES 2000
+#define BENCH_FIB 30
+
+// Emits a jump back to top when the last compare found less, negative displacements are 8 bytes
+void bench_loop(BCBuilder *b, i64 top) {
+    e_jl(b, imm(top - (arrlen(b->block->code) + 10)));
+}
+
+// Emits jump over an add of z to register x
+void bench_skip_add(BCBuilder *b, void (*jump)(BCBuilder *, BCOperand), Reg x, BCOperand z) {
+    BCBlock skipped = {0};
+    BCBuilder s = {&skipped};
+    e_add(&s, x, reg(x), z);
+    jump(b, imm(arrlen(skipped.code)));
+    e_add(b, x, reg(x), z);
+    arrfree(skipped.code);
+}
+
+void bench_emit_nop(BCBuilder *b, VMBenchmark *bench) {
+    e_mov(b, 4, imm(0));
+    i64 top = arrlen(b->block->code);
+    for (int i = 0; i < 16; i++) e_nop(b);
+    e_add(b, 4, reg(4), imm(1));
+    e_cmp(b, reg(4), imm(BENCH_LOOP_COUNT / 4));
+    bench_loop(b, top);
+    e_hlt(b);
+}
+
+void bench_emit_integer(BCBuilder *b, VMBenchmark *bench) {
+    e_mov(b, 4, imm(0));
+    e_mov(b, 5, imm(0));
+    e_mov(b, 6, imm(1));
+    i64 top = arrlen(b->block->code);
+    e_add(b, 4, reg(4), imm(1));
+    e_mul(b, 6, reg(6), imm(6364136223846793005));
+    e_add(b, 6, reg(6), imm(1442695040888963407));
+    e_shr(b, 7, reg(6), imm(33));
+    e_xor(b, 5, reg(5), reg(7));
+    e_add(b, 5, reg(5), reg(4));
+    e_cmp(b, reg(4), imm(BENCH_LOOP_COUNT));
+    bench_loop(b, top);
+    e_hlt(b);
+
+    u64 sum = 0, state = 1;
+    for (u64 i = 1; i <= BENCH_LOOP_COUNT; i++) {
+        state = state * 6364136223846793005 + 1442695040888963407;
+        sum = (sum ^ (state >> 33)) + i;
+    }
+    bench->result = 5;
+    bench->expected = sum;
+}
+
+void bench_emit_float(BCBuilder *b, VMBenchmark *bench) {
+    e_mov(b, 4, imm(0));
+    e_mov(b, 7, imf(0.0));
+    e_mov(b, 8, imf(1.0));
+    i64 top = arrlen(b->block->code);
+    e_itof(b, 6, reg(4));
+    e_mulf(b, 6, reg(6), imf(0.5));
+    e_addf(b, 7, reg(7), reg(6));
+    e_mulf(b, 8, reg(8), imf(0.999999));
+    e_addf(b, 8, reg(8), imf(1.0));
+    e_divf(b, 9, reg(7), reg(8));
+    e_subf(b, 9, reg(9), imf(0.25));
+    e_add(b, 4, reg(4), imm(1));
+    e_cmp(b, reg(4), imm(BENCH_LOOP_COUNT));
+    bench_loop(b, top);
+    e_hlt(b);
+}
+
+// y = a * x + y over 8 f32 lanes at a time
+void bench_emit_vector(BCBuilder *b, VMBenchmark *bench) {
+    bench->data_size = 2 * BENCH_VECTOR_SIZE + sizeof(VMVec);
+    bench->data = xcalloc(bench->data_size);
+    f32 *lanes = (f32 *) bench->data;
+    for (u64 i = 0; i < bench->data_size / sizeof *lanes; i++) lanes[i] = 1.f;
+    for (u64 i = 0; i < 8; i++) lanes[i] = 0.5f;
+
+    u64 a = (u64) bench->data;
+    u64 x = a + sizeof(VMVec);
+    u64 y = x + BENCH_VECTOR_SIZE;
+    e_vld32(b, 0, imm(a), RZ0);
+    e_mov(b, 5, imm(0));
+    i64 outer = arrlen(b->block->code);
+    e_mov(b, 4, imm(0));
+    i64 inner = arrlen(b->block->code);
+    e_vld32(b, 1, imm(x), reg(4));
+    e_vmulf32(b, 1, 1, 0);
+    e_vld32(b, 2, imm(y), reg(4));
+    e_vaddf32(b, 2, 2, 1);
+    e_vst32(b, 2, imm(y), reg(4));
+    e_add(b, 4, reg(4), imm(sizeof(VMVec)));
+    e_cmp(b, reg(4), imm(BENCH_VECTOR_SIZE));
+    bench_loop(b, inner);
+    e_add(b, 5, reg(5), imm(1));
+    e_cmp(b, reg(5), imm(BENCH_VECTOR_PASSES));
+    bench_loop(b, outer);
+    e_hlt(b);
+}
+
+// dst[i] = src[i] + 1 over buffers larger than the caches
+void bench_emit_memory(BCBuilder *b, VMBenchmark *bench) {
+    bench->data_size = 2 * BENCH_STREAM_SIZE;
+    bench->data = xcalloc(bench->data_size);
+
+    u64 src = (u64) bench->data;
+    u64 dst = src + BENCH_STREAM_SIZE;
+    e_mov(b, 10, imm(src));
+    e_mov(b, 11, imm(dst));
+    e_mov(b, 5, imm(0));
+    i64 outer = arrlen(b->block->code);
+    e_mov(b, 4, imm(0));
+    i64 inner = arrlen(b->block->code);
+    e_ld8(b, 6, reg(10), reg(4));
+    e_add(b, 6, reg(6), imm(1));
+    e_st8(b, 11, reg(4), reg(6));
+    e_add(b, 4, reg(4), imm(8));
+    e_cmp(b, reg(4), imm(BENCH_STREAM_SIZE));
+    bench_loop(b, inner);
+    e_add(b, 5, reg(5), imm(1));
+    e_cmp(b, reg(5), imm(BENCH_STREAM_PASSES));
+    bench_loop(b, outer);
+    e_ld8(b, 6, reg(11), RZ0);
+    e_hlt(b);
+
+    bench->result = 6;
+    bench->expected = 1;
+}
+
+// Takes data dependent branches on the bits of a xorshift generator
+void bench_emit_branch(BCBuilder *b, VMBenchmark *bench) {
+    e_mov(b, 4, imm(0));
+    e_mov(b, 6, imm(88172645463325252));
+    e_mov(b, 8, imm(0));
+    e_mov(b, 9, imm(0));
+    i64 top = arrlen(b->block->code);
+    e_shl(b, 7, reg(6), imm(13));
+    e_xor(b, 6, reg(6), reg(7));
+    e_shr(b, 7, reg(6), imm(7));
+    e_xor(b, 6, reg(6), reg(7));
+    e_shl(b, 7, reg(6), imm(17));
+    e_xor(b, 6, reg(6), reg(7));
+    e_and(b, 7, reg(6), imm(1));
+    e_cmp(b, reg(7), imm(0));
+    bench_skip_add(b, e_je, 8, imm(1));
+    e_and(b, 7, reg(6), imm(2));
+    e_cmp(b, reg(7), imm(0));
+    bench_skip_add(b, e_jne, 9, imm(1));
+    e_and(b, 7, reg(6), imm(12));
+    e_cmp(b, reg(7), imm(8));
+    bench_skip_add(b, e_jl, 8, imm(3));
+    e_add(b, 4, reg(4), imm(1));
+    e_cmp(b, reg(4), imm(BENCH_LOOP_COUNT / 2));
+    bench_loop(b, top);
+    e_hlt(b);
+
+    u64 state = 88172645463325252, odd = 0, even = 0;
+    for (u64 i = 0; i < BENCH_LOOP_COUNT / 2; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        if (state & 1) odd++;
+        if (!(state & 2)) even++;
+        if ((state & 12) >= 8) odd += 3;
+    }
+    bench->result = 8;
+    bench->expected = odd;
+}
+
+// Recursive fib(BENCH_FIB), taking n in r4 and returning in r4
+void bench_emit_call(BCBuilder *b, VMBenchmark *bench) {
+    BCBlock body = {0};
+    BCBuilder f = {&body};
+    i64 base = arrlen(body.code);
+    e_ret(&f);
+    i64 fib = arrlen(body.code);
+    e_cmp(&f, reg(4), imm(2));
+    bench_loop(&f, base);
+    e_mov(&f, 5, reg(4));
+    e_sub(&f, 12, reg(4), imm(1));
+    e_call(&f, 8, imm(fib - (arrlen(body.code) + 11)));
+    e_mov(&f, 6, reg(12));
+    e_sub(&f, 12, reg(5), imm(2));
+    e_call(&f, 8, imm(fib - (arrlen(body.code) + 11)));
+    e_add(&f, 4, reg(6), reg(12));
+    e_ret(&f);
+    i64 main = arrlen(body.code);
+    e_mov(&f, 12, imm(BENCH_FIB));
+    e_call(&f, 8, imm(fib - (arrlen(body.code) + 11)));
+    e_mov(&f, 4, reg(12));
+    e_hlt(&f);
+
+    e_jmp(b, imm(main));
+    arraddn(b->block->code, arrlen(body.code));
+    memcpy(b->block->code + arrlen(b->block->code) - arrlen(body.code), body.code, arrlen(body.code));
+    arrfree(body.code);
+
+    bench->result = 4;
+    bench->expected = 832040;
+}
+
+VMBenchmark benchmarks[] = {
+    { "nop",     bench_emit_nop,     9 },
+    { "integer", bench_emit_integer, 9 },
+    { "float",   bench_emit_float,   9 },
+    { "vector",  bench_emit_vector,  9 },
+    { "memory",  bench_emit_memory,  11 },
+    { "branch",  bench_emit_branch,  9 },
+    { "call",    bench_emit_call,    12 },
+};
+
+void bench_init(VM *vm, VMBenchmark *bench, u8 *code) {
+    vm_init(vm, code, bench->highest_register);
+    if (!vm_verify(vm)) fatal("Benchmark %s failed verification", bench->name);
+}
+
+void bench_run(VMBenchmark *bench) {
+    BCBlock block = {0};
+    BCBuilder builder = {&block};
+    bench->emit(&builder, bench);
+
+    VM vm = {0};
+    if (bench->data) vm_add_region(&vm, bench->data, bench->data_size, true);
+
+    VMProfile profile = {0};
+    vm.profile = &profile;
+    bench_init(&vm, bench, block.code);
+    if (!vm_interp(&vm)) fatal("Benchmark %s faulted", bench->name);
+    bench->instructions = profile.total;
+    vm.profile = NULL;
+    vm_free_profile(&profile);
+
+    bench->nanoseconds = UINT64_MAX;
+    for (int i = 0; i < BENCH_RUNS; i++) {
+        bench_init(&vm, bench, block.code);
+        u64 start = time_nanoseconds();
+        bool ok = vm_interp(&vm);
+        u64 elapsed = time_nanoseconds() - start;
+        if (!ok) fatal("Benchmark %s faulted", bench->name);
+        bench->nanoseconds = MIN(bench->nanoseconds, MAX(elapsed, 1));
+    }
+    if (bench->result && vm.registers[bench->result].u != bench->expected) {
+        fatal("Benchmark %s computed %llu instead of %llu", bench->name,
+              vm.registers[bench->result].u, bench->expected);
+    }
+
+    bench->code_bytes = vm.code_size;
+    bench->decoded_bytes = arrlen(vm.insts) * sizeof *vm.insts + arrlen(vm.offsets) * sizeof *vm.offsets;
+    bench->stack_bytes = VM_STACK_SIZE * sizeof *vm.stack;
+
+    free(vm.stack);
+    arrfree(vm.insts);
+    arrfree(vm.offsets);
+    arrfree(vm.regions);
+    arrfree(block.code);
+}
+
+int main(int argc, const char **argv) {
+    const char *path = argc > 1 ? argv[1] : "bench-vm.json";
+    u64 num_benchmarks = sizeof benchmarks / sizeof *benchmarks;
+    for (u64 i = 0; i < num_benchmarks; i++) bench_run(&benchmarks[i]);
+
+    f64 dispatch = (f64) benchmarks[0].nanoseconds / benchmarks[0].instructions;
+    printf("%-8s %12s %10s %8s %9s %10s %10s\n", "", "insts", "Minst/s", "ns/inst", "dispatch",
+           "code", "memory");
+    for (u64 i = 0; i < num_benchmarks; i++) {
+        VMBenchmark *bench = &benchmarks[i];
+        f64 per_inst = (f64) bench->nanoseconds / bench->instructions;
+        u64 memory = bench->decoded_bytes + bench->stack_bytes + bench->data_size;
+        printf("%-8s %12llu %10.1f %8.2f %8.0f%% %9.1fK %9.1fK\n", bench->name, bench->instructions,
+               1e3 / per_inst, per_inst, MIN(dispatch / per_inst, 1) * 100,
+               bench->code_bytes / 1024.0, memory / 1024.0);
+    }
+
+    FILE *file = fopen(path, "w");
+    if (!file) fatal("Failed to open %s", path);
+    fprintf(file, "{\n  \"runs\": %d,\n  \"dispatch_ns\": %.4f,\n  \"benchmarks\": [\n", BENCH_RUNS, dispatch);
+    for (u64 i = 0; i < num_benchmarks; i++) {
+        VMBenchmark *bench = &benchmarks[i];
+        f64 per_inst = (f64) bench->nanoseconds / bench->instructions;
+        fprintf(file, "    {\"name\": \"%s\", \"instructions\": %llu, \"nanoseconds\": %llu, "
+                "\"instructions_per_second\": %.0f, \"ns_per_instruction\": %.4f, \"dispatch_share\": %.4f, "
+                "\"code_bytes\": %llu, \"decoded_bytes\": %llu, \"stack_bytes\": %llu, \"data_bytes\": %llu}%s\n",
+                bench->name, bench->instructions, bench->nanoseconds, 1e9 / per_inst, per_inst,
+                MIN(dispatch / per_inst, 1), bench->code_bytes, bench->decoded_bytes, bench->stack_bytes,
+                bench->data_size, i + 1 < num_benchmarks ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+    printf("Results written to %s\n", path);
+    return 0;
+}
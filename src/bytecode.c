@@ -1,17 +1,14 @@
 
 #include "all.h"
+#include "os.h"
 #include "checker.h"
+#include "ast.h"
+#include "types.h"
 #include "bytecode.h"
 #include "arena.h"
 #include "package.h"
-
-typedef struct BytecodeProgram BytecodeProgram;
-struct BytecodeProgram {
-    Package *package;
-    u8 *code;
-    u8 *data;
-    u8 *rodata;
-};
+#include "queue.h"
+#include "compiler.h"
 
 /*
  ┌──────────────────────────────────────────────────┐
@@ -30,54 +27,29 @@ struct BytecodeProgram {
  └───┴────────────┴─────────────────────────────────┘
  */
 
-typedef enum Opcode Opcode;
-enum Opcode {
-//| Name | Opcode | Description                          |
-//+------+--------+--------------------------------------+
-    HLT  = 0x00,
-    NOP  = 0x01,
-    ADD  = 0x02, // X = Y + Z
-    ADDF = 0x03,
-    SUB  = 0x04, // X = Y - Z
-    SUBF = 0x05,
-    MUL  = 0x06, // X = Y * Z
-    MULF = 0x07,
-    DIV  = 0x08, // X = Y / Z
-    DIVF = 0x09,
-    MOD  = 0x0A, // X = Y % Z
-    XOR  = 0x0B, // X = Y ^ Z
-    AND  = 0x0C, // X = Y & Z
-    OR   = 0x0D, // X = Y | Z
-    SHL  = 0x0E, // X = Y << Z
-    SHR  = 0x0F, // X = Y >> Z
-
-    LD1  = 0x10, // X = *(Y + Z)
-    ST1  = 0x11, // *(X + Y) = Z
-    LD2  = 0x12,
-    ST2  = 0x13,
-    LD4  = 0x14,
-    ST4  = 0x15,
-    LD8  = 0x16,
-    ST8  = 0x17,
-
-    MOV  = 0x20, // Y = Z
-    FTOI = 0x21, // Y = ftoi(Z)
-    ITOF = 0x22, // Y = itof(Z)
-    PUSH = 0x23, // *(rsp) = Z; rsp += 1
-    POP  = 0x24, // Z = *(rsp); rsp -= 1
-    CALL = 0x25, // *(rsp) = rip; rsp += 1; rip += Z
-    RET  = 0x26, // rsp += 1; rip = *(rsp)
-    CMP  = 0x27, // flgs = Y - Z
-
-    JMP  = 0x30, // rip += Z
-    JE   = 0x31, // if(flgs == 0) rip += Z
-    JNE  = 0x32, // if(flgs != 0) rip += Z
-    JL   = 0x33, // if(flgs <  0) rip += Z
-    JLE  = 0x34, // if(flgs <= 0) rip += Z
-    JG   = 0x35, // if(flgs >  0) rip += Z
-    JGE  = 0x36, // if(flgs >= 0) rip += Z
-
-    AST  = 0xA5,
+const char *bc_opcode_names[256] = {
+    [HLT]  = "hlt",  [NOP]  = "nop",
+    [ADD]  = "add",  [ADDF] = "addf", [SUB]  = "sub",  [SUBF] = "subf",
+    [MUL]  = "mul",  [MULF] = "mulf", [DIV]  = "div",  [DIVF] = "divf",
+    [MOD]  = "mod",  [XOR]  = "xor",  [AND]  = "and",  [OR]   = "or",
+    [SHL]  = "shl",  [SHR]  = "shr",
+    [LD1]  = "ld1",  [ST1]  = "st1",  [LD2]  = "ld2",  [ST2]  = "st2",
+    [LD4]  = "ld4",  [ST4]  = "st4",  [LD8]  = "ld8",  [ST8]  = "st8",
+    [LD8ADD] = "ld8add",
+    [MOV]  = "mov",  [FTOI] = "ftoi", [ITOF] = "itof", [PUSH] = "push",
+    [POP]  = "pop",  [CALL] = "call", [RET]  = "ret",  [CMP]  = "cmp",
+    [ADDI] = "addi", [CALLF] = "callf",
+    [JMP]  = "jmp",  [JE]   = "je",   [JNE]  = "jne",  [JL]   = "jl",
+    [JLE]  = "jle",  [JG]   = "jg",   [JGE]  = "jge",
+    [CMPJE] = "cmpje", [CMPJNE] = "cmpjne", [CMPJL] = "cmpjl",
+    [CMPJLE] = "cmpjle", [CMPJG] = "cmpjg", [CMPJGE] = "cmpjge",
+    [VADDF32] = "vaddf32", [VSUBF32] = "vsubf32", [VMULF32] = "vmulf32", [VDIVF32] = "vdivf32",
+    [VADDF64] = "vaddf64", [VSUBF64] = "vsubf64", [VMULF64] = "vmulf64", [VDIVF64] = "vdivf64",
+    [VADDI32] = "vaddi32", [VSUBI32] = "vsubi32", [VMULI32] = "vmuli32",
+    [VADDI64] = "vaddi64", [VSUBI64] = "vsubi64", [VMULI64] = "vmuli64",
+    [VSHUF]   = "vshuf",
+    [VLD16] = "vld16", [VST16] = "vst16", [VLD32] = "vld32", [VST32] = "vst32",
+    [AST]  = "ast",
 };
 
 u8 size_for_register(Reg reg) {
@@ -151,7 +123,9 @@ void enc(BCBuilder *b, Opcode opcode, Reg x, BCOperand y, BCOperand z) {
     u8 operands = (op_x << 6) | (op_y << 3) | op_z;
     arrput(b->block->code, operands);
     enc_register(b, x);
+    if (y.is_address) arrput(b->block->address_sites, arrlen(b->block->code));
     enc_operand(b, y);
+    if (z.is_address) arrput(b->block->address_sites, arrlen(b->block->code));
     enc_operand(b, z);
 }
 
@@ -199,8 +173,10 @@ void e_ftoi(BCBuilder *b, Reg y, BCOperand z)              { enc(b, FTOI, 0, reg
 void e_itof(BCBuilder *b, Reg y, BCOperand z)              { enc(b, ITOF, 0, reg(y), z); }
 void e_push(BCBuilder *b, BCOperand z)                     { enc(b, PUSH, 0, RZ0, z); }
 void e_pop (BCBuilder *b, Reg z)                           { enc(b, POP,  0, RZ0, reg(z)); }
-void e_call(BCBuilder *b, BCOperand z)                     { enc(b, CALL, 0, RZ0, z); }
+void e_ast (BCBuilder *b, BCOperand z)                     { enc(b, AST,  0, RZ0, z); }
+void e_call(BCBuilder *b, Reg base, BCOperand z)           { enc(b, CALL, base, RZ0, z); }
 void e_ret (BCBuilder *b)                                  { arrput(b->block->code, RET); }
+void e_callf(BCBuilder *b, Reg base, u32 index)            { enc(b, CALLF, base, RZ0, imm(index)); }
 void e_cmp (BCBuilder *b, BCOperand y, BCOperand z)        { enc(b, CMP, 0, y, z); }
 void e_jmp (BCBuilder *b, BCOperand z)                     { enc(b, JMP, 0, RZ0, z); }
 void e_je  (BCBuilder *b, BCOperand z)                     { enc(b, JE,  0, RZ0, z); }
@@ -210,6 +186,35 @@ void e_jle (BCBuilder *b, BCOperand z)                     { enc(b, JLE, 0, RZ0,
 void e_jg  (BCBuilder *b, BCOperand z)                     { enc(b, JG,  0, RZ0, z); }
 void e_jge (BCBuilder *b, BCOperand z)                     { enc(b, JGE, 0, RZ0, z); }
 
+void e_ld8add(BCBuilder *b, Reg x, BCOperand y, BCOperand z) { enc(b, LD8ADD, x, y, z); }
+void e_addi  (BCBuilder *b, Reg x, BCOperand z)              { enc(b, ADDI,   x, RZ0, z); }
+void e_cmpje (BCBuilder *b, i32 x, BCOperand y, BCOperand z) { enc(b, CMPJE,  (u32) x, y, z); }
+void e_cmpjne(BCBuilder *b, i32 x, BCOperand y, BCOperand z) { enc(b, CMPJNE, (u32) x, y, z); }
+void e_cmpjl (BCBuilder *b, i32 x, BCOperand y, BCOperand z) { enc(b, CMPJL,  (u32) x, y, z); }
+void e_cmpjle(BCBuilder *b, i32 x, BCOperand y, BCOperand z) { enc(b, CMPJLE, (u32) x, y, z); }
+void e_cmpjg (BCBuilder *b, i32 x, BCOperand y, BCOperand z) { enc(b, CMPJG,  (u32) x, y, z); }
+void e_cmpjge(BCBuilder *b, i32 x, BCOperand y, BCOperand z) { enc(b, CMPJGE, (u32) x, y, z); }
+
+void e_vaddf32(BCBuilder *b, Reg x, Reg y, Reg z)             { enc(b, VADDF32, x, reg(y), reg(z)); }
+void e_vsubf32(BCBuilder *b, Reg x, Reg y, Reg z)             { enc(b, VSUBF32, x, reg(y), reg(z)); }
+void e_vmulf32(BCBuilder *b, Reg x, Reg y, Reg z)             { enc(b, VMULF32, x, reg(y), reg(z)); }
+void e_vdivf32(BCBuilder *b, Reg x, Reg y, Reg z)             { enc(b, VDIVF32, x, reg(y), reg(z)); }
+void e_vaddf64(BCBuilder *b, Reg x, Reg y, Reg z)             { enc(b, VADDF64, x, reg(y), reg(z)); }
+void e_vsubf64(BCBuilder *b, Reg x, Reg y, Reg z)             { enc(b, VSUBF64, x, reg(y), reg(z)); }
+void e_vmulf64(BCBuilder *b, Reg x, Reg y, Reg z)             { enc(b, VMULF64, x, reg(y), reg(z)); }
+void e_vdivf64(BCBuilder *b, Reg x, Reg y, Reg z)             { enc(b, VDIVF64, x, reg(y), reg(z)); }
+void e_vaddi32(BCBuilder *b, Reg x, Reg y, Reg z)             { enc(b, VADDI32, x, reg(y), reg(z)); }
+void e_vsubi32(BCBuilder *b, Reg x, Reg y, Reg z)             { enc(b, VSUBI32, x, reg(y), reg(z)); }
+void e_vmuli32(BCBuilder *b, Reg x, Reg y, Reg z)             { enc(b, VMULI32, x, reg(y), reg(z)); }
+void e_vaddi64(BCBuilder *b, Reg x, Reg y, Reg z)             { enc(b, VADDI64, x, reg(y), reg(z)); }
+void e_vsubi64(BCBuilder *b, Reg x, Reg y, Reg z)             { enc(b, VSUBI64, x, reg(y), reg(z)); }
+void e_vmuli64(BCBuilder *b, Reg x, Reg y, Reg z)             { enc(b, VMULI64, x, reg(y), reg(z)); }
+void e_vshuf  (BCBuilder *b, Reg x, Reg y, u32 lanes)         { enc(b, VSHUF,   x, reg(y), imm(lanes)); }
+void e_vld16  (BCBuilder *b, Reg x, BCOperand y, BCOperand z) { enc(b, VLD16,   x, y, z); }
+void e_vst16  (BCBuilder *b, Reg x, BCOperand y, BCOperand z) { enc(b, VST16,   x, y, z); }
+void e_vld32  (BCBuilder *b, Reg x, BCOperand y, BCOperand z) { enc(b, VLD32,   x, y, z); }
+void e_vst32  (BCBuilder *b, Reg x, BCOperand y, BCOperand z) { enc(b, VST32,   x, y, z); }
+
 i32 reg_size[] = { 0, 1, 2, 4 };
 i32 imm_size[] = { 1, 2, 4, 8 };
 const char *reg_names[] = { "rzo", "rip", "rfp", "rsp" };
@@ -343,53 +348,130 @@ i32 disasm0p(const char *name, u8 *code) {
     return (i32) (code - start);
 }
 
+bool bc_has_operands(u8 opcode) {
+    return opcode != HLT && opcode != NOP && opcode != RET;
+}
+
+// Returns the number of bytes taken by the operand byte and the operands it describes
+i32 bc_operands_length(u8 operands) {
+    i32 len = 1 + reg_size[(operands & 0xC0) >> 6];
+    len += (operands & 0x20) ? imm_size[(operands & 0x18) >> 3] : reg_size[(operands & 0x18) >> 3];
+    len += (operands & 0x04) ? imm_size[operands & 0x3] : reg_size[operands & 0x3];
+    return len;
+}
+
+// Returns the length of the instruction at offset or 0 if it runs past the end of the code
+i32 bc_inst_length(u8 *code, u64 len, u64 offset) {
+    if (offset >= len) return 0;
+    if (!bc_has_operands(code[offset])) return 1;
+    if (offset + 1 >= len) return 0;
+    i32 inst_len = 1 + bc_operands_length(code[offset + 1]);
+    if (offset + inst_len > len) return 0;
+    return inst_len;
+}
+
+// Compare and branch superinstructions have a signed displacement in place of the X register
+i32 disasmcmpj(const char *name, u8 *code) {
+    u8 operands = code[1];
+    i32 bytes = reg_size[(operands & 0xC0) >> 6];
+    i32 disp = (i32) (u32) read_bytes(bytes, code + 2);
+    printf("%s #%d", name, disp);
+
+    // Print Y & Z as a 2 operand instruction would by skipping over X
+    u8 copy[2 + 8 + 8];
+    copy[0] = code[0];
+    copy[1] = operands & 0x3F;
+    i32 rest = bc_operands_length(operands) - 1 - bytes;
+    memcpy(copy + 2, code + 2 + bytes, rest);
+    return disasm2p("", copy) + bytes;
+}
+
+// Calls name the register starting the callee's window in X
+i32 disasmcall(const char *name, u8 *code) {
+    u8 operands = code[1];
+    i32 bytes = reg_size[(operands & 0xC0) >> 6];
+    printf("%s ", name);
+    disasmreg(read_bytes(bytes, code + 2));
+
+    u8 copy[2 + 8 + 8];
+    copy[0] = code[0];
+    copy[1] = operands & 0x3F;
+    i32 rest = bc_operands_length(operands) - 1 - bytes;
+    memcpy(copy + 2, code + 2 + bytes, rest);
+    return disasm1p("", copy) + bytes;
+}
+
+// Vector instructions name vector registers in X, and in Y & Z too unless they are an address
+i32 disasmvec(const char *name, u8 *code, bool address) {
+    u8 *start = code++;
+    printf("%s ", name);
+
+    u8 operands = *code++;
+    u8 sizes[3] = { (operands & 0xC0) >> 6, (operands & 0x18) >> 3, operands & 0x3 };
+    bool imms[3] = { false, (operands & 0x20) != 0, (operands & 0x4) != 0 };
+    for (i32 i = 0; i < 3; i++) {
+        i32 bytes = imms[i] ? imm_size[sizes[i]] : reg_size[sizes[i]];
+        u64 val = read_bytes(bytes, code);
+        code += bytes;
+        if (imms[i])                 printf("#%llu ", val);
+        else if (i == 0 || !address) printf("v%llu ", val);
+        else                         disasmreg(val);
+    }
+
+    return (i32) (code - start);
+}
+
 void disassemble(u8 *code, const char *name) {
+    disassemble_at(code, arrlen(code), name, -1);
+}
+
+// Disassembles code marking the instruction starting at offset mark, stopping at invalid bytes
+void disassemble_at(u8 *code, u64 len, const char *name, i64 mark) {
     printf("== %s ==\n", name);
-    for (i32 i = 0; i < arrlen(code);) {
-        u8 instruction = code[i];
-        switch (instruction) {
-            case HLT:  i += disasm0p("hlt",  code + i); break;
-            case NOP:  i += disasm0p("nop",  code + i); break;
-            case ADD:  i += disasm3p("add",  code + i); break;
-            case ADDF: i += disasm3p("addf", code + i); break;
-            case SUB:  i += disasm3p("sub",  code + i); break;
-            case SUBF: i += disasm3p("subf", code + i); break;
-            case MUL:  i += disasm3p("mul",  code + i); break;
-            case MULF: i += disasm3p("mulf", code + i); break;
-            case DIV:  i += disasm3p("div",  code + i); break;
-            case DIVF: i += disasm3p("divf", code + i); break;
-            case MOD:  i += disasm3p("mod",  code + i); break;
-            case XOR:  i += disasm3p("xor",  code + i); break;
-            case AND:  i += disasm3p("and",  code + i); break;
-            case OR:   i += disasm3p("or",   code + i); break;
-            case SHL:  i += disasm3p("shl",  code + i); break;
-            case SHR:  i += disasm3p("shr",  code + i); break;
-            case LD1:  i += disasm3p("ld1",  code + i); break;
-            case LD2:  i += disasm3p("ld2",  code + i); break;
-            case LD4:  i += disasm3p("ld4",  code + i); break;
-            case LD8:  i += disasm3p("ld8",  code + i); break;
-            case ST1:  i += disasm3p("st1",  code + i); break;
-            case ST2:  i += disasm3p("st2",  code + i); break;
-            case ST4:  i += disasm3p("st4",  code + i); break;
-            case ST8:  i += disasm3p("st8",  code + i); break;
-            case MOV:  i += disasm2p("mov",  code + i); break;
-            case FTOI: i += disasm2p("ftoi", code + i); break;
-            case ITOF: i += disasm2p("itof", code + i); break;
-            case PUSH: i += disasm1p("push", code + i); break;
-            case POP:  i += disasm1p("pop",  code + i); break;
-            case CALL: i += disasm1p("call", code + i); break;
-            case RET:  i += disasm0p("ret",  code + i); break;
-            case CMP:  i += disasm2p("cmp",  code + i); break;
-            case JMP:  i += disasm1p("jmp",  code + i); break;
-            case JE:   i += disasm1p("je",   code + i); break;
-            case JNE:  i += disasm1p("jne",  code + i); break;
-            case JL:   i += disasm1p("jl",   code + i); break;
-            case JLE:  i += disasm1p("jle",  code + i); break;
-            case JG:   i += disasm1p("jg",   code + i); break;
-            case JGE:  i += disasm1p("jge",  code + i); break;
-            case AST:  i += disasm1p("ast",  code + i); break;
-        }
+    for (i32 i = 0; i < len;) {
+        printf("%s%4d  ", i == mark ? "-> " : "   ", i);
+        i32 inst_len = disassemble_inst(code, len, i);
         printf("\n");
+        if (!inst_len) return;
+        i += inst_len;
+    }
+}
+
+// Prints the instruction at offset without a trailing newline returning its length, 0 if invalid
+i32 disassemble_inst(u8 *code, u64 len, u64 offset) {
+    u8 instruction = code[offset];
+    if (!bc_inst_length(code, len, offset)) {
+        printf(".byte 0x%02x (truncated)", instruction);
+        return 0;
+    }
+    const char *name = bc_opcode_names[instruction];
+    switch (instruction) {
+        case HLT: case NOP: case RET:
+            return disasm0p(name, code + offset);
+        case ADD: case ADDF: case SUB: case SUBF: case MUL: case MULF: case DIV: case DIVF:
+        case MOD: case XOR:  case AND: case OR:   case SHL: case SHR:
+        case LD1: case LD2:  case LD4: case LD8:  case ST1: case ST2: case ST4: case ST8:
+        case LD8ADD: case ADDI:
+            return disasm3p(name, code + offset);
+        case MOV: case FTOI: case ITOF: case CMP:
+            return disasm2p(name, code + offset);
+        case CALL: case CALLF:
+            return disasmcall(name, code + offset);
+        case PUSH: case POP: case AST:
+        case JMP: case JE: case JNE: case JL: case JLE: case JG: case JGE:
+            return disasm1p(name, code + offset);
+        case CMPJE: case CMPJNE: case CMPJL: case CMPJLE: case CMPJG: case CMPJGE:
+            return disasmcmpj(name, code + offset);
+        case VADDF32: case VSUBF32: case VMULF32: case VDIVF32:
+        case VADDF64: case VSUBF64: case VMULF64: case VDIVF64:
+        case VADDI32: case VSUBI32: case VMULI32: case VADDI64: case VSUBI64: case VMULI64:
+        case VSHUF:
+            return disasmvec(name, code + offset, false);
+        case VLD16: case VST16: case VLD32: case VST32:
+            return disasmvec(name, code + offset, true);
+        default:
+            printf(".byte 0x%02x (invalid opcode)", instruction);
+            return 0;
     }
 }
 
@@ -407,10 +489,11 @@ struct VMInstructionOperands {
     VMOperand z;
 };
 
-VMInstructionOperands vm_decode_operands(VM *vm) {
-    VMInstructionOperands op;
-    u8 operand = *vm->ip++;
-    op.operand = operand;
+// Decodes the operand byte and the operands that follow it, returns the number of bytes read
+i32 vm_decode_operands(u8 *ip, VMInstructionOperands *op) {
+    u8 *start = ip;
+    u8 operand = *ip++;
+    op->operand = operand;
     u8 nx_bytes = reg_size[(operand & 0xC0) >> 6];
     u8 ny_bytes;
     u8 nz_bytes;
@@ -422,161 +505,1976 @@ VMInstructionOperands vm_decode_operands(VM *vm) {
     else          ny_bytes = reg_size[(operand & 0x18) >> 3];
     if (z_is_imm) nz_bytes = imm_size[(operand & 0x3)];
     else          nz_bytes = reg_size[(operand & 0x3)];
-    op.x = (VMOperand){ false, read_bytes(nx_bytes, vm->ip) };
-    vm->ip += nx_bytes;
-    op.y = (VMOperand){ y_is_imm, read_bytes(ny_bytes, vm->ip) };
-    vm->ip += ny_bytes;
-    op.z = (VMOperand){ z_is_imm, read_bytes(nz_bytes, vm->ip) };
-    vm->ip += nz_bytes;
-    return op;
+    op->x = (VMOperand){ false, read_bytes(nx_bytes, ip) };
+    ip += nx_bytes;
+    op->y = (VMOperand){ y_is_imm, read_bytes(ny_bytes, ip) };
+    ip += ny_bytes;
+    op->z = (VMOperand){ z_is_imm, read_bytes(nz_bytes, ip) };
+    ip += nz_bytes;
+    return (i32) (ip - start);
 }
 
-Val vm_val(VM *vm, VMOperand op) {
-    if (op.is_imm) return (Val){ op.val };
-    ASSERT(arrlen(vm->registers) > op.val); // FIXME: Need to allocated more as needed
-    return vm->registers[op.val];
+/*
+ Before it is run the byte stream is decoded into an array of fixed width VMInst. Every opcode is
+ specialised on the form of it's Y & Z operands (R: register, I: immediate) and immediate branch
+ targets are resolved to indices into the instruction array, leaving nothing for the interpreter
+ to decode.
+
+ Forms taking Y & Z operands have 4 variants (_RR, _RI, _IR & _II) while those only taking a Z
+ operand have 2 (_R & _I). For the latter the written register (MOV's Y, POP's Z) is moved to X.
+ */
+
+#define VM_FORMS4(_, NAME) _(NAME##_RR) _(NAME##_RI) _(NAME##_IR) _(NAME##_II)
+#define VM_FORMS2(_, NAME) _(NAME##_R) _(NAME##_I)
+
+#define VM_OPS(_) \
+    _(HLT) _(NOP) _(RET) _(POP) _(CALLF) _(GUARD) _(BAD) \
+    VM_FORMS4(_, ADD) VM_FORMS4(_, ADDF) VM_FORMS4(_, SUB) VM_FORMS4(_, SUBF) \
+    VM_FORMS4(_, MUL) VM_FORMS4(_, MULF) VM_FORMS4(_, DIV) VM_FORMS4(_, DIVF) \
+    VM_FORMS4(_, MOD) VM_FORMS4(_, XOR)  VM_FORMS4(_, AND) VM_FORMS4(_, OR)   \
+    VM_FORMS4(_, SHL) VM_FORMS4(_, SHR) \
+    VM_FORMS4(_, LD1) VM_FORMS4(_, LD2)  VM_FORMS4(_, LD4) VM_FORMS4(_, LD8)  \
+    VM_FORMS4(_, ST1) VM_FORMS4(_, ST2)  VM_FORMS4(_, ST4) VM_FORMS4(_, ST8)  \
+    VM_FORMS4(_, CMP) VM_FORMS4(_, LD8ADD) VM_FORMS2(_, ADDI) \
+    VM_FORMS2(_, MOV)  VM_FORMS2(_, FTOI) VM_FORMS2(_, ITOF) VM_FORMS2(_, PUSH) VM_FORMS2(_, AST) \
+    VM_FORMS2(_, CALL) VM_FORMS2(_, JMP)  VM_FORMS2(_, JE)   VM_FORMS2(_, JNE)  \
+    VM_FORMS2(_, JL)   VM_FORMS2(_, JLE)  VM_FORMS2(_, JG)   VM_FORMS2(_, JGE)  \
+    VM_FORMS4(_, CMPJE) VM_FORMS4(_, CMPJNE) VM_FORMS4(_, CMPJL) \
+    VM_FORMS4(_, CMPJLE) VM_FORMS4(_, CMPJG) VM_FORMS4(_, CMPJGE) \
+    _(VADDF32) _(VSUBF32) _(VMULF32) _(VDIVF32) _(VADDF64) _(VSUBF64) _(VMULF64) _(VDIVF64) \
+    _(VADDI32) _(VSUBI32) _(VMULI32) _(VADDI64) _(VSUBI64) _(VMULI64) _(VSHUF) \
+    VM_FORMS4(_, VLD16) VM_FORMS4(_, VST16) VM_FORMS4(_, VLD32) VM_FORMS4(_, VST32)
+
+typedef enum VMOp VMOp;
+enum VMOp {
+#define VM_ENUM(name) VM_##name,
+    VM_OPS(VM_ENUM)
+#undef VM_ENUM
+    NUM_VM_OPS
+};
+
+typedef enum VMRegMask {
+    VM_REG_X = 0x1,
+    VM_REG_Y = 0x2,
+    VM_REG_Z = 0x4,
+    VM_VREG_X = 0x8, // vector registers
+    VM_VREG_Y = 0x10,
+    VM_VREG_Z = 0x20,
+} VMRegMask;
+
+struct VMInst {
+    u16 op;
+    u8 regs; // VMRegMask of the operands naming registers
+    u32 x;
+    Val y;
+    Val z;
+};
+
+typedef enum VMOpLayout VMOpLayout;
+enum VMOpLayout {
+    VM_INVALID = 0,
+    VM_NONE,   // no operands
+    VM_XYZ,    // X register and Y & Z operands
+    VM_YZ,     // Y & Z operands
+    VM_DST_Z,  // Y register written and Z operand
+    VM_Z,      // Z operand
+    VM_DST,    // Z register written
+    VM_BRANCH, // Z operand is a target relative to the next instruction
+    VM_ACC,    // X register read & written and Z operand
+    VM_CMPJ,   // Y & Z operands, X is a target relative to the next instruction
+    VM_FOREIGN, // X register starts the callee's window and Z immediate selects the function
+    VM_VEC,    // X, Y & Z vector registers
+    VM_VEC_IMM, // X & Y vector registers and Z immediate
+    VM_VEC_MEM, // X vector register and Y & Z operands addressing memory
+};
+
+typedef struct VMOpInfo VMOpInfo;
+struct VMOpInfo {
+    VMOpLayout layout;
+    VMOp base; // The first specialisation, the rest follow in operand form order
+};
+
+VMOpInfo vm_op_info[256] = {
+    [HLT]  = { VM_NONE,   VM_HLT },
+    [NOP]  = { VM_NONE,   VM_NOP },
+    [ADD]  = { VM_XYZ,    VM_ADD_RR },
+    [ADDF] = { VM_XYZ,    VM_ADDF_RR },
+    [SUB]  = { VM_XYZ,    VM_SUB_RR },
+    [SUBF] = { VM_XYZ,    VM_SUBF_RR },
+    [MUL]  = { VM_XYZ,    VM_MUL_RR },
+    [MULF] = { VM_XYZ,    VM_MULF_RR },
+    [DIV]  = { VM_XYZ,    VM_DIV_RR },
+    [DIVF] = { VM_XYZ,    VM_DIVF_RR },
+    [MOD]  = { VM_XYZ,    VM_MOD_RR },
+    [XOR]  = { VM_XYZ,    VM_XOR_RR },
+    [AND]  = { VM_XYZ,    VM_AND_RR },
+    [OR]   = { VM_XYZ,    VM_OR_RR },
+    [SHL]  = { VM_XYZ,    VM_SHL_RR },
+    [SHR]  = { VM_XYZ,    VM_SHR_RR },
+    [LD1]  = { VM_XYZ,    VM_LD1_RR },
+    [ST1]  = { VM_XYZ,    VM_ST1_RR },
+    [LD2]  = { VM_XYZ,    VM_LD2_RR },
+    [ST2]  = { VM_XYZ,    VM_ST2_RR },
+    [LD4]  = { VM_XYZ,    VM_LD4_RR },
+    [ST4]  = { VM_XYZ,    VM_ST4_RR },
+    [LD8]  = { VM_XYZ,    VM_LD8_RR },
+    [ST8]  = { VM_XYZ,    VM_ST8_RR },
+    [MOV]  = { VM_DST_Z,  VM_MOV_R },
+    [FTOI] = { VM_DST_Z,  VM_FTOI_R },
+    [ITOF] = { VM_DST_Z,  VM_ITOF_R },
+    [PUSH] = { VM_Z,      VM_PUSH_R },
+    [POP]  = { VM_DST,    VM_POP },
+    [CALL] = { VM_BRANCH, VM_CALL_R },
+    [RET]  = { VM_NONE,   VM_RET },
+    [CMP]  = { VM_YZ,     VM_CMP_RR },
+    [JMP]  = { VM_BRANCH, VM_JMP_R },
+    [JE]   = { VM_BRANCH, VM_JE_R },
+    [JNE]  = { VM_BRANCH, VM_JNE_R },
+    [JL]   = { VM_BRANCH, VM_JL_R },
+    [JLE]  = { VM_BRANCH, VM_JLE_R },
+    [JG]   = { VM_BRANCH, VM_JG_R },
+    [JGE]  = { VM_BRANCH, VM_JGE_R },
+    [AST]  = { VM_Z,      VM_AST_R },
+
+    [LD8ADD] = { VM_XYZ,  VM_LD8ADD_RR },
+    [ADDI]   = { VM_ACC,  VM_ADDI_R },
+    [CALLF]  = { VM_FOREIGN, VM_CALLF },
+    [CMPJE]  = { VM_CMPJ, VM_CMPJE_RR },
+    [CMPJNE] = { VM_CMPJ, VM_CMPJNE_RR },
+    [CMPJL]  = { VM_CMPJ, VM_CMPJL_RR },
+    [CMPJLE] = { VM_CMPJ, VM_CMPJLE_RR },
+    [CMPJG]  = { VM_CMPJ, VM_CMPJG_RR },
+    [CMPJGE] = { VM_CMPJ, VM_CMPJGE_RR },
+
+    [VADDF32] = { VM_VEC,     VM_VADDF32 },
+    [VSUBF32] = { VM_VEC,     VM_VSUBF32 },
+    [VMULF32] = { VM_VEC,     VM_VMULF32 },
+    [VDIVF32] = { VM_VEC,     VM_VDIVF32 },
+    [VADDF64] = { VM_VEC,     VM_VADDF64 },
+    [VSUBF64] = { VM_VEC,     VM_VSUBF64 },
+    [VMULF64] = { VM_VEC,     VM_VMULF64 },
+    [VDIVF64] = { VM_VEC,     VM_VDIVF64 },
+    [VADDI32] = { VM_VEC,     VM_VADDI32 },
+    [VSUBI32] = { VM_VEC,     VM_VSUBI32 },
+    [VMULI32] = { VM_VEC,     VM_VMULI32 },
+    [VADDI64] = { VM_VEC,     VM_VADDI64 },
+    [VSUBI64] = { VM_VEC,     VM_VSUBI64 },
+    [VMULI64] = { VM_VEC,     VM_VMULI64 },
+    [VSHUF]   = { VM_VEC_IMM, VM_VSHUF },
+    [VLD16]   = { VM_VEC_MEM, VM_VLD16_RR },
+    [VST16]   = { VM_VEC_MEM, VM_VST16_RR },
+    [VLD32]   = { VM_VEC_MEM, VM_VLD32_RR },
+    [VST32]   = { VM_VEC_MEM, VM_VST32_RR },
+};
+
+bool bc_is_memory_op(u8 opcode) {
+    return (opcode >= LD1 && opcode <= ST8) || opcode == LD8ADD || (opcode >= VLD16 && opcode <= VST32);
 }
 
-void vm_init(VM *vm, u8 *code, u32 highest_register) {
-    vm->code = code;
-    vm->ip = code;
-    arrsetlen(vm->registers, highest_register + 1 + sizeof(reg_names) / sizeof(*reg_names));
-    memset(vm->registers, 0, (highest_register + 1 + sizeof(reg_names) / sizeof(*reg_names)) * 8);
+bool bc_is_store(u8 opcode) {
+    return ((opcode >= ST1 && opcode <= ST8) || (opcode >= VST16 && opcode <= VST32)) && (opcode & 1);
+}
+
+u64 bc_access_size(u8 opcode) {
+    if (opcode == LD8ADD) return 8;
+    if (opcode >= VLD16)  return opcode >= VLD32 ? 32 : 16;
+    return 1 << ((opcode - LD1) / 2);
+}
+
+// Scalar stores address memory with X + Y, every other load and store with Y + Z
+bool bc_addresses_xy(u8 opcode) {
+    return opcode >= ST1 && opcode <= ST8 && (opcode & 1);
 }
 
-void vm_interp(VM *vm) {
-    u8 *end = vm->code + arrlen(vm->code);
-    while (vm->ip < end) {
-        u8 instruction = *vm->ip++;
-        switch (instruction) { // No operands
-            case HLT: goto end;
-            case NOP: continue;
-            case RET: UNIMPLEMENTED();
+bool vm_is_cmpj(u32 op) {
+    return op >= VM_CMPJE_RR && op <= VM_CMPJGE_II;
+}
+
+i32 vm_layout_forms[] = {
+    [VM_XYZ] = 4, [VM_YZ] = 4, [VM_CMPJ] = 4,
+    [VM_DST_Z] = 2, [VM_Z] = 2, [VM_BRANCH] = 2, [VM_ACC] = 2,
+    [VM_NONE] = 1, [VM_DST] = 1, [VM_FOREIGN] = 1,
+    [VM_VEC] = 1, [VM_VEC_IMM] = 1, [VM_VEC_MEM] = 4,
+};
+
+// The opcode each VMOp was specialised from, -1 for those inserted by the loader
+i16 vm_op_opcode[NUM_VM_OPS];
+
+void vm_op_opcode_init(void) {
+    static bool initialized;
+    if (initialized) return;
+    initialized = true;
+    for (i32 i = 0; i < NUM_VM_OPS; i++) vm_op_opcode[i] = -1;
+    for (i32 opcode = 0; opcode < 256; opcode++) {
+        VMOpInfo info = vm_op_info[opcode];
+        for (i32 form = 0; form < vm_layout_forms[info.layout]; form++) {
+            if (vm_op_opcode[info.base + form] < 0) vm_op_opcode[info.base + form] = opcode;
         }
+    }
+}
 
-        VMInstructionOperands op = vm_decode_operands(vm);
-        switch (instruction) {
-            case ADD:
-                vm->registers[op.x.val].u = vm_val(vm, op.y).u + vm_val(vm, op.z).u;
-                break;
-            case ADDF:
-                vm->registers[op.x.val].f = vm_val(vm, op.y).f + vm_val(vm, op.z).f;
-                break;
-            case SUB:
-                vm->registers[op.x.val].u = vm_val(vm, op.y).u - vm_val(vm, op.z).u;
-                break;
-            case SUBF:
-                vm->registers[op.x.val].f = vm_val(vm, op.y).f - vm_val(vm, op.z).f;
-                break;
-            case MUL:
-                vm->registers[op.x.val].u = vm_val(vm, op.y).u * vm_val(vm, op.z).u;
-                break;
-            case MULF:
-                vm->registers[op.x.val].f = vm_val(vm, op.y).f * vm_val(vm, op.z).f;
-                break;
-            case DIV:
-                vm->registers[op.x.val].u = vm_val(vm, op.y).u / vm_val(vm, op.z).u;
-                break;
-            case DIVF:
-                vm->registers[op.x.val].f = vm_val(vm, op.y).f / vm_val(vm, op.z).f;
-                break;
-            case MOD:
-                vm->registers[op.x.val].u = vm_val(vm, op.y).u % vm_val(vm, op.z).u;
-                break;
-            case XOR:
-                vm->registers[op.x.val].u = vm_val(vm, op.y).u ^ vm_val(vm, op.z).u;
-                break;
-            case AND:
-                vm->registers[op.x.val].u = vm_val(vm, op.y).u & vm_val(vm, op.z).u;
-                break;
-            case OR:
-                vm->registers[op.x.val].u = vm_val(vm, op.y).u | vm_val(vm, op.z).u;
-                break;
-            case SHL:
-                vm->registers[op.x.val].u = vm_val(vm, op.y).u << vm_val(vm, op.z).u;
-                break;
-            case SHR:
-                vm->registers[op.x.val].u = vm_val(vm, op.y).u >> vm_val(vm, op.z).u;
-                break;
-            case LD1:
-                vm->registers[op.x.val].u = read_bytes(1, vm_val(vm, op.y).p + vm_val(vm, op.z).i);
-                break;
-            case LD2:
-                vm->registers[op.x.val].u = read_bytes(2, vm_val(vm, op.y).p + vm_val(vm, op.z).i);
+// Returns the index of the instruction starting at offset or one past the last instruction
+u32 vm_inst_index(VM *vm, u64 offset) {
+    u32 lo = 0;
+    u32 hi = (u32) arrlen(vm->offsets);
+    while (lo < hi) {
+        u32 mid = lo + (hi - lo) / 2;
+        if (vm->offsets[mid] < offset) lo = mid + 1;
+        else                          hi = mid;
+    }
+    if (lo < arrlen(vm->offsets) && vm->offsets[lo] == offset) return lo;
+    return (u32) arrlen(vm->insts);
+}
+
+// Decodes vm->code into vm->insts, verified code guards accesses through computed addresses
+void vm_load(VM *vm) {
+    arrsetlen(vm->insts, 0);
+    arrsetlen(vm->offsets, 0);
+    arrsetlen(vm->natives, 0);
+    arrsetlen(vm->heat, 0);
+    u32 *fixups = NULL;
+    u32 len = (u32) vm->code_size;
+    u32 offset = 0;
+    while (offset < len) {
+        u8 opcode = vm->code[offset];
+        VMOpInfo info = vm_op_info[opcode];
+        i32 inst_len = bc_inst_length(vm->code, len, offset);
+        if (info.layout == VM_INVALID || !inst_len) {
+            arrput(vm->offsets, offset);
+            arrput(vm->insts, (VMInst){ VM_BAD });
+            break;
+        }
+
+        VMInst inst = { info.base };
+        VMInstructionOperands op = {0};
+        if (bc_has_operands(opcode)) vm_decode_operands(vm->code + offset + 1, &op);
+        u32 next = offset + inst_len;
+
+        switch (info.layout) {
+            case VM_XYZ:
+                inst.x = (u32) op.x.val;
+                inst.regs |= VM_REG_X;
+                // fallthrough
+            case VM_YZ:
+                inst.op += (op.y.is_imm << 1) | op.z.is_imm;
+                inst.regs |= (op.y.is_imm ? 0 : VM_REG_Y) | (op.z.is_imm ? 0 : VM_REG_Z);
+                inst.y.u = op.y.val;
+                inst.z.u = op.z.val;
                 break;
-            case LD4:
-                vm->registers[op.x.val].u = read_bytes(4, vm_val(vm, op.y).p + vm_val(vm, op.z).i);
+            case VM_DST_Z:
+                inst.x = (u32) op.y.val;
+                inst.regs |= VM_REG_X;
+                // fallthrough
+            case VM_Z:
+                inst.op += op.z.is_imm;
+                inst.regs |= op.z.is_imm ? 0 : VM_REG_Z;
+                inst.z.u = op.z.val;
                 break;
-            case LD8:
-                vm->registers[op.x.val].u = read_bytes(8, vm_val(vm, op.y).p + vm_val(vm, op.z).i);
+            case VM_DST:
+                inst.x = (u32) op.z.val;
+                inst.regs |= VM_REG_X;
                 break;
-            case ST1:
-                *((u8 *) (vm_val(vm, op.x).p + vm_val(vm, op.y).i)) = (u8) vm_val(vm, op.z).u;
+            case VM_BRANCH:
+                if (opcode == CALL) {
+                    inst.x = (u32) op.x.val; // the start of the callee's window
+                    inst.regs |= VM_REG_X;
+                }
+                inst.op += op.z.is_imm;
+                inst.regs |= op.z.is_imm ? 0 : VM_REG_Z;
+                inst.y.u = next; // targets are relative to the next instruction
+                inst.z.u = op.z.is_imm ? next + op.z.val : op.z.val;
+                if (op.z.is_imm) arrput(fixups, (u32) arrlen(vm->insts));
                 break;
-            case ST2:
-                *((u16 *) (vm_val(vm, op.x).p + vm_val(vm, op.y).i)) = (u16) vm_val(vm, op.z).u;
+            case VM_ACC:
+                inst.x = (u32) op.x.val;
+                inst.op += op.z.is_imm;
+                inst.regs |= VM_REG_X | (op.z.is_imm ? 0 : VM_REG_Z);
+                inst.z.u = op.z.val;
                 break;
-            case ST4:
-                *((u32 *) (vm_val(vm, op.x).p + vm_val(vm, op.y).i)) = (u32) vm_val(vm, op.z).u;
+            case VM_CMPJ:
+                inst.op += (op.y.is_imm << 1) | op.z.is_imm;
+                inst.regs |= (op.y.is_imm ? 0 : VM_REG_Y) | (op.z.is_imm ? 0 : VM_REG_Z);
+                inst.x = next + (i32) (u32) op.x.val;
+                inst.y.u = op.y.val;
+                inst.z.u = op.z.val;
+                arrput(fixups, (u32) arrlen(vm->insts));
                 break;
-            case ST8:
-                *((u64 *) (vm_val(vm, op.x).p + vm_val(vm, op.y).i)) = (u64) vm_val(vm, op.z).u;
+            case VM_FOREIGN:
+                inst.x = (u32) op.x.val;
+                inst.regs |= VM_REG_X;
+                inst.z.u = op.z.val;
                 break;
-            case MOV:
-                vm->registers[op.y.val] = vm_val(vm, op.z);
+            case VM_VEC:
+                inst.regs |= VM_VREG_Z;
+                // fallthrough
+            case VM_VEC_IMM:
+                inst.x = (u32) op.x.val;
+                inst.regs |= VM_VREG_X | VM_VREG_Y;
+                inst.y.u = op.y.val;
+                inst.z.u = op.z.val;
                 break;
-            case FTOI:
-                vm->registers[op.y.val].i = (i64) vm_val(vm, op.z).f;
+            case VM_VEC_MEM:
+                inst.x = (u32) op.x.val;
+                inst.op += (op.y.is_imm << 1) | op.z.is_imm;
+                inst.regs |= VM_VREG_X | (op.y.is_imm ? 0 : VM_REG_Y) | (op.z.is_imm ? 0 : VM_REG_Z);
+                inst.y.u = op.y.val;
+                inst.z.u = op.z.val;
                 break;
-            case ITOF:
-                vm->registers[op.y.val].f = (f64) vm_val(vm, op.z).i;
+            default:
                 break;
-            case PUSH:
-                arrpush(vm->stack, vm_val(vm, op.z));
+        }
+        if (vm->verified && bc_is_memory_op(opcode)) {
+            bool xy = bc_addresses_xy(opcode);
+            bool static_base = xy ? op.x.val == 0 : op.y.is_imm || op.y.val == 0;
+            bool static_offset = xy ? op.y.is_imm || op.y.val == 0 : op.z.is_imm || op.z.val == 0;
+            if (!static_base || !static_offset) {
+                arrput(vm->offsets, offset);
+                arrput(vm->insts, (VMInst){ VM_GUARD });
+            }
+        }
+        arrput(vm->offsets, offset);
+        arrput(vm->insts, inst);
+        offset = next;
+    }
+    arrput(vm->offsets, len);
+    arrput(vm->insts, (VMInst){ VM_HLT }); // Running off the end of the code halts
+
+    for (i64 i = 0; i < arrlen(fixups); i++) {
+        VMInst *inst = &vm->insts[fixups[i]];
+        bool is_cmpj = vm_is_cmpj(inst->op);
+        u32 index = vm_inst_index(vm, is_cmpj ? inst->x : inst->z.u);
+        if (is_cmpj) inst->x   = index;
+        else         inst->z.u = index;
+        if (index == arrlen(vm->insts)) inst->op = VM_BAD;
+    }
+    arrfree(fixups);
+}
+
+void vm_init_code(VM *vm, u8 *code, u64 code_size, u32 highest_register) {
+    vm->code = code;
+    vm->code_size = code_size;
+    vm->flgs = 0;
+    vm->verified = false;
+    vm_op_opcode_init();
+    u32 num_registers = highest_register + 1 + sizeof(reg_names) / sizeof(*reg_names);
+    ASSERT(num_registers <= VM_STACK_SIZE);
+    if (!vm->stack) vm->stack = xmalloc(VM_STACK_SIZE * sizeof *vm->stack);
+    vm->registers = vm->stack;
+    vm->num_registers = num_registers;
+    memset(vm->registers, 0, num_registers * sizeof *vm->registers);
+    vm->sp = VM_STACK_SIZE;
+    vm_load(vm);
+}
+
+void vm_init(VM *vm, u8 *code, u32 highest_register) {
+    vm_init_code(vm, code, arrlen(code), highest_register);
+}
+
+void vm_add_region(VM *vm, void *base, u64 size, bool writable) {
+    VMRegion region = { base, size, writable };
+    arrput(vm->regions, region);
+}
+
+bool vm_region_contains(VM *vm, u64 addr, u64 size, bool write) {
+    for (i64 i = 0; i < arrlen(vm->regions); i++) {
+        VMRegion region = vm->regions[i];
+        u64 base = (u64) region.base;
+        if (addr < base || addr + size < addr || addr + size > base + region.size) continue;
+        if (write && !region.writable) continue;
+        return true;
+    }
+    return false;
+}
+
+// Checks the memory access made by the (decoded) load or store inst with registers r lies within a region
+bool vm_access_ok(VM *vm, Val *r, VMInst *inst) {
+    u8 opcode = (u8) vm_op_opcode[inst->op];
+    bool is_store = bc_is_store(opcode);
+    u64 size = bc_access_size(opcode);
+    u64 addr;
+    if (bc_addresses_xy(opcode)) {
+        addr = r[inst->x].u + ((inst->regs & VM_REG_Y) ? r[inst->y.u].u : inst->y.u);
+    } else {
+        addr = (inst->regs & VM_REG_Y) ? r[inst->y.u].u : inst->y.u;
+        addr += (inst->regs & VM_REG_Z) ? r[inst->z.u].u : inst->z.u;
+    }
+    return vm_region_contains(vm, addr, size, is_store);
+}
+
+bool vm_registers_ok(VMInst *inst, u64 num_registers) {
+    if ((inst->regs & VM_REG_X) && inst->x >= num_registers) return false;
+    if ((inst->regs & VM_REG_Y) && inst->y.u >= num_registers) return false;
+    if ((inst->regs & VM_REG_Z) && inst->z.u >= num_registers) return false;
+    if ((inst->regs & VM_VREG_X) && inst->x >= VM_NUM_VREGS) return false;
+    if ((inst->regs & VM_VREG_Y) && inst->y.u >= VM_NUM_VREGS) return false;
+    if ((inst->regs & VM_VREG_Z) && inst->z.u >= VM_NUM_VREGS) return false;
+    return true;
+}
+
+void vm_fault(VM *vm, u32 index, const char *msg) {
+    u32 offset = vm->offsets[MIN(index, arrlen(vm->offsets) - 1)];
+    printf("error: VM fault at offset %u: %s\n", offset, msg);
+    disassemble_at(vm->code, vm->code_size, "fault", offset);
+}
+
+void vm_reject(VM *vm, u64 offset, const char *fmt, ...) {
+    char msg[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(msg, sizeof msg, fmt, args);
+    va_end(args);
+    printf("error: Bytecode rejected at offset %llu: %s\n", offset, msg);
+    disassemble_at(vm->code, vm->code_size, "rejected", offset);
+}
+
+/*
+ The verifier proves the properties the unchecked interpreter relies on:
+  - Every instruction is a valid opcode with well formed operands that fit within the code
+  - Registers are within the register file and rzo is never written so it always reads zero,
+    vector registers are within vm->vregs
+  - Calls start the callee's window above the caller's link registers and foreign calls name a
+    function added to vm->foreigns
+  - Branches have immediate targets that land on an instruction boundary (or the end)
+  - Loads and stores through constant addresses lie within a region, stores in a writable one.
+    Those through computed addresses are guarded at runtime by vm_access_ok instead.
+ */
+bool vm_verify(VM *vm) {
+    u64 len = vm->code_size;
+    u64 num_registers = vm->num_registers;
+    u8 *boundaries = xcalloc(len + 1);
+    u64 *targets = NULL;
+    u64 *sources = NULL; // offset of the branch to each of targets
+    bool ok = false;
+    for (u64 offset = 0; offset < len;) {
+        u8 opcode = vm->code[offset];
+        VMOpInfo info = vm_op_info[opcode];
+        if (info.layout == VM_INVALID) {
+            vm_reject(vm, offset, "Invalid opcode 0x%02x", opcode);
+            goto done;
+        }
+        i32 inst_len = bc_inst_length(vm->code, len, offset);
+        if (!inst_len) {
+            vm_reject(vm, offset, "Instruction runs past the end of the code");
+            goto done;
+        }
+        boundaries[offset] = true;
+
+        VMInstructionOperands op = {0};
+        if (bc_has_operands(opcode)) vm_decode_operands(vm->code + offset + 1, &op);
+        u8 x_size = (op.operand & 0xC0) >> 6;
+        bool y_is_rz0 = !op.y.is_imm && !(op.operand & 0x18);
+        bool z_is_reg = !op.z.is_imm;
+
+        bool writes_x = false;
+        bool x_is_reg = true;
+        bool vector_y_z = false; // Y & Z name vector registers rather than scalar ones
+        switch (info.layout) {
+            case VM_XYZ:
+                writes_x = !bc_is_store(opcode);
                 break;
-            case POP:
-                vm->registers[op.z.val] = arrpop(vm->stack);
+            case VM_YZ:
+                if (x_size) goto malformed;
                 break;
-            case CALL:
-                arrpush(vm->stack, vm->registers[RFP]);
-                vm->ip += vm_val(vm, op.z).i;
+            case VM_DST_Z:
+                if (x_size || op.y.is_imm) goto malformed;
+                if (op.y.val == 0) goto writes_rzo;
                 break;
-            case CMP:
-                vm->flgs = vm_val(vm, op.y).i - vm_val(vm, op.z).i;
+            case VM_Z:
+                if (x_size || !y_is_rz0) goto malformed;
                 break;
-            case JMP:
-                vm->ip += vm_val(vm, op.z).i;
+            case VM_DST:
+                if (x_size || !y_is_rz0 || !z_is_reg) goto malformed;
+                if (op.z.val == 0) goto writes_rzo;
                 break;
-            case JE:
-                vm->ip += (!(vm->flgs)) * vm_val(vm, op.z).i;
+            case VM_BRANCH:
+                if ((x_size && opcode != CALL) || !y_is_rz0) goto malformed;
+                if (opcode == CALL && op.x.val <= RSP) {
+                    vm_reject(vm, offset, "Call window must start above rsp");
+                    goto done;
+                }
+                if (z_is_reg) {
+                    vm_reject(vm, offset, "Branch targets must be immediates to be verified");
+                    goto done;
+                }
+                arrput(targets, offset + inst_len + op.z.val);
+                arrput(sources, offset);
                 break;
-            case JNE:
-                vm->ip += (!!(vm->flgs)) * vm_val(vm, op.z).i;
+            case VM_ACC:
+                if (!y_is_rz0) goto malformed;
+                writes_x = true;
                 break;
-            case JL:
-                if (vm->flgs < 0)  vm->ip += vm_val(vm, op.z).i;
+            case VM_CMPJ:
+                x_is_reg = false;
+                arrput(targets, offset + inst_len + (i32) (u32) op.x.val);
+                arrput(sources, offset);
                 break;
-            case JLE:
-                if (vm->flgs <= 0) vm->ip += vm_val(vm, op.z).i;
+            case VM_FOREIGN:
+                if (!y_is_rz0 || z_is_reg) goto malformed;
+                if (op.x.val <= RSP) {
+                    vm_reject(vm, offset, "Call window must start above rsp");
+                    goto done;
+                }
+                if (op.z.val >= arrlen(vm->foreigns)) {
+                    vm_reject(vm, offset, "Foreign function %llu is not defined", op.z.val);
+                    goto done;
+                }
                 break;
-            case JG:
-                if (vm->flgs > 0)  vm->ip += vm_val(vm, op.z).i;
+            case VM_VEC:
+            case VM_VEC_IMM:
+                if (op.y.is_imm || z_is_reg != (info.layout == VM_VEC)) goto malformed;
+                vector_y_z = true;
+                // fallthrough
+            case VM_VEC_MEM:
+                x_is_reg = false;
+                if (op.x.val >= VM_NUM_VREGS || (vector_y_z && (op.y.val >= VM_NUM_VREGS ||
+                    (z_is_reg && op.z.val >= VM_NUM_VREGS)))) {
+                    vm_reject(vm, offset, "Vector register out of range (%d registers)", VM_NUM_VREGS);
+                    goto done;
+                }
                 break;
-            case JGE:
-                if (vm->flgs <= 0) vm->ip += vm_val(vm, op.z).i;
+            default:
                 break;
-            case AST:  break;
+        }
+        if (writes_x && op.x.val == 0) goto writes_rzo;
+
+        if ((x_is_reg && op.x.val >= num_registers) ||
+            (!vector_y_z && !op.y.is_imm && op.y.val >= num_registers) ||
+            (!vector_y_z && z_is_reg && op.z.val >= num_registers)) {
+            vm_reject(vm, offset, "Register out of range (%llu registers)", num_registers);
+            goto done;
+        }
+
+        if (bc_is_memory_op(opcode)) {
+            bool is_store = bc_is_store(opcode);
+            u64 size = bc_access_size(opcode);
+            bool xy = bc_addresses_xy(opcode);
+            VMOperand base = xy ? op.x : op.y;
+            VMOperand disp = xy ? op.y : op.z;
+            bool static_base = base.is_imm || base.val == 0;
+            bool static_disp = disp.is_imm || disp.val == 0;
+            if (static_base && static_disp) {
+                u64 addr = (base.is_imm ? base.val : 0) + (disp.is_imm ? disp.val : 0);
+                if (!vm_region_contains(vm, addr, size, is_store)) {
+                    vm_reject(vm, offset, "%s of %llu bytes at 0x%llx is outside of any %sregion",
+                              is_store ? "Store" : "Load", size, addr, is_store ? "writable " : "");
+                    goto done;
+                }
+            }
+        }
+        offset += inst_len;
+        continue;
+
+    malformed:
+        vm_reject(vm, offset, "Malformed operands for opcode");
+        goto done;
+    writes_rzo:
+        vm_reject(vm, offset, "Instruction writes to rzo");
+        goto done;
+    }
+    boundaries[len] = true;
+    for (i64 i = 0; i < arrlen(targets); i++) {
+        if (targets[i] > len || !boundaries[targets[i]]) {
+            vm_reject(vm, sources[i], "Branch target %llu is not an instruction boundary", targets[i]);
+            goto done;
         }
     }
-end:
-    vm->registers[0].u = 0;
-    vm->registers[RIP].u = (u64) (vm->ip - vm->code);
-    return;
+    ok = true;
+    vm->verified = true;
+    vm_load(vm); // reload now verified to insert guards for computed addresses
+
+done:
+    arrfree(sources);
+    arrfree(targets);
+    free(boundaries);
+    return ok;
+}
+
+/*
+ Vector instructions use the widest SIMD the host compiler targets: AVX (AVX2 for integers) works
+ on the full 256 bits at once and SSE2 on each 128 bit half. Lanes the host has no instruction for,
+ or every lane without SSE2, are processed a scalar at a time. Integer lanes wrap on overflow.
+ */
+#define VM_VEC_SCALAR(NAME, T, OP) \
+    void vm_##NAME(VMVec *x, VMVec *y, VMVec *z) { \
+        T ys[32 / sizeof(T)], zs[32 / sizeof(T)]; \
+        memcpy(ys, y, 32); \
+        memcpy(zs, z, 32); \
+        for (u32 i = 0; i < 32 / sizeof(T); i++) ys[i] = ys[i] OP zs[i]; \
+        memcpy(x, ys, 32); \
+    }
+
+#if defined(__AVX__)
+#define VM_VEC_FLOAT(NAME, T, P, INTRINSIC, OP) \
+    void vm_##NAME(VMVec *x, VMVec *y, VMVec *z) { \
+        _mm256_storeu_##P((T *) x, _mm256_##INTRINSIC##_##P(_mm256_loadu_##P((T *) y), _mm256_loadu_##P((T *) z))); \
+    }
+#elif defined(__SSE2__)
+#define VM_VEC_FLOAT(NAME, T, P, INTRINSIC, OP) \
+    void vm_##NAME(VMVec *x, VMVec *y, VMVec *z) { \
+        for (u32 i = 0; i < 32; i += 16) { \
+            T *xs = (T *) (x->bytes + i), *ys = (T *) (y->bytes + i), *zs = (T *) (z->bytes + i); \
+            _mm_storeu_##P(xs, _mm_##INTRINSIC##_##P(_mm_loadu_##P(ys), _mm_loadu_##P(zs))); \
+        } \
+    }
+#else
+#define VM_VEC_FLOAT(NAME, T, P, INTRINSIC, OP) VM_VEC_SCALAR(NAME, T, OP)
+#endif
+
+#if defined(__AVX2__)
+#define VM_VEC_INT(NAME, T, INTRINSIC, OP) \
+    void vm_##NAME(VMVec *x, VMVec *y, VMVec *z) { \
+        __m256i v = _mm256_##INTRINSIC(_mm256_loadu_si256((__m256i *) y), _mm256_loadu_si256((__m256i *) z)); \
+        _mm256_storeu_si256((__m256i *) x, v); \
+    }
+#elif defined(__SSE2__)
+#define VM_VEC_INT(NAME, T, INTRINSIC, OP) \
+    void vm_##NAME(VMVec *x, VMVec *y, VMVec *z) { \
+        for (u32 i = 0; i < 32; i += 16) { \
+            __m128i v = _mm_##INTRINSIC(_mm_loadu_si128((__m128i *) (y->bytes + i)), \
+                                        _mm_loadu_si128((__m128i *) (z->bytes + i))); \
+            _mm_storeu_si128((__m128i *) (x->bytes + i), v); \
+        } \
+    }
+#else
+#define VM_VEC_INT(NAME, T, INTRINSIC, OP) VM_VEC_SCALAR(NAME, T, OP)
+#endif
+
+VM_VEC_FLOAT(vaddf32, f32, ps, add, +)
+VM_VEC_FLOAT(vsubf32, f32, ps, sub, -)
+VM_VEC_FLOAT(vmulf32, f32, ps, mul, *)
+VM_VEC_FLOAT(vdivf32, f32, ps, div, /)
+VM_VEC_FLOAT(vaddf64, f64, pd, add, +)
+VM_VEC_FLOAT(vsubf64, f64, pd, sub, -)
+VM_VEC_FLOAT(vmulf64, f64, pd, mul, *)
+VM_VEC_FLOAT(vdivf64, f64, pd, div, /)
+VM_VEC_INT(vaddi32, u32, add_epi32, +)
+VM_VEC_INT(vsubi32, u32, sub_epi32, -)
+VM_VEC_INT(vaddi64, u64, add_epi64, +)
+VM_VEC_INT(vsubi64, u64, sub_epi64, -)
+#if defined(__AVX2__) || defined(__SSE4_1__)
+VM_VEC_INT(vmuli32, u32, mullo_epi32, *)
+#else
+VM_VEC_SCALAR(vmuli32, u32, *)
+#endif
+VM_VEC_SCALAR(vmuli64, u64, *) // no SIMD multiply of 64 bit lanes before AVX-512
+
+#undef VM_VEC_INT
+#undef VM_VEC_FLOAT
+#undef VM_VEC_SCALAR
+
+void vm_vshuf(VMVec *x, VMVec *y, u32 lanes) {
+#if defined(__AVX2__)
+    __m256i indices = _mm256_setr_epi32(lanes & 7, (lanes >> 3) & 7, (lanes >> 6) & 7, (lanes >> 9) & 7,
+                                        (lanes >> 12) & 7, (lanes >> 15) & 7, (lanes >> 18) & 7, (lanes >> 21) & 7);
+    __m256i v = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((__m256i *) y), indices);
+    _mm256_storeu_si256((__m256i *) x, v);
+#else
+    VMVec v;
+    for (u32 i = 0; i < 8; i++) v.u32s[i] = y->u32s[(lanes >> (3 * i)) & 7];
+    *x = v;
+#endif
+}
+
+// 128 bit loads clear the high half of the register
+void vm_vload(VMVec *x, void *addr, u64 size) {
+    memcpy(x->bytes, addr, size);
+    if (size < sizeof *x) memset(x->bytes + size, 0, sizeof *x - size);
+}
+
+// Whether native code handles inst, it returns to the interpreter at the rest
+bool vm_tier_handles(VMInst *inst) {
+    if (inst->op == VM_GUARD) return true;
+    i16 opcode = vm_op_opcode[inst->op];
+    if (opcode < 0) return false;
+    switch (vm_op_info[opcode].layout) {
+        case VM_XYZ: case VM_YZ: case VM_DST_Z: case VM_ACC: case VM_CMPJ:
+            return true;
+        case VM_BRANCH:
+            return opcode != CALL && !(inst->regs & VM_REG_Z);
+        case VM_NONE:
+            return opcode == NOP;
+        default:
+            return false;
+    }
+}
+
+// Returns the instructions reachable from entry without passing through one native code doesn't handle
+VMTierInst *vm_tier_region(VM *vm, u32 entry) {
+    u32 num_insts = (u32) arrlen(vm->insts);
+    bool *seen = xcalloc(num_insts * sizeof *seen);
+    u32 *work = NULL;
+    VMTierInst *region = NULL;
+    arrput(work, entry);
+    while (arrlen(work)) {
+        u32 index = arrpop(work);
+        if (index >= num_insts || seen[index]) continue;
+        seen[index] = true;
+        VMInst *inst = &vm->insts[index];
+        i16 opcode = inst->op == VM_GUARD ? -1 : vm_op_opcode[inst->op];
+        VMTierInst tier = { index, opcode, inst->regs & (VM_REG_X | VM_REG_Y | VM_REG_Z),
+                            !vm_tier_handles(inst), inst->x, inst->y, inst->z };
+        arrput(region, tier);
+        if (tier.exit) continue;
+        VMOpLayout layout = opcode >= 0 ? vm_op_info[opcode].layout : VM_NONE;
+        if (layout == VM_BRANCH) arrput(work, (u32) inst->z.u);
+        if (layout == VM_CMPJ)   arrput(work, inst->x);
+        if (opcode != JMP)       arrput(work, index + 1);
+    }
+    arrfree(work);
+    free(seen);
+    return region;
+}
+
+VMNative vm_tier_up(VM *vm, u32 entry) {
+    VMNative native = vm->compile(vm, entry);
+    verbose("%s native code entered at instruction %u", native ? "Compiled" : "Failed to compile", entry);
+    return native;
+}
+
+#if !defined(VM_THREADED_DISPATCH) && defined(__GNUC__)
+#define VM_THREADED_DISPATCH 1
+#endif
+
+#define VM_INTERP_NAME vm_interp_checked
+#define VM_INTERP_CHECKED 1
+#define VM_INTERP_PAIRS 0
+#define VM_INTERP_PROFILE 0
+#define VM_INTERP_TIERED 0
+#include "bytecode_interp.h"
+
+#define VM_INTERP_NAME vm_interp_unchecked
+#define VM_INTERP_CHECKED 0
+#define VM_INTERP_PAIRS 0
+#define VM_INTERP_PROFILE 0
+#define VM_INTERP_TIERED 0
+#include "bytecode_interp.h"
+
+#define VM_INTERP_NAME vm_interp_pairs
+#define VM_INTERP_CHECKED 1
+#define VM_INTERP_PAIRS 1
+#define VM_INTERP_PROFILE 0
+#define VM_INTERP_TIERED 0
+#include "bytecode_interp.h"
+
+#define VM_INTERP_NAME vm_interp_profile
+#define VM_INTERP_CHECKED 1
+#define VM_INTERP_PAIRS 0
+#define VM_INTERP_PROFILE 1
+#define VM_INTERP_TIERED 0
+#include "bytecode_interp.h"
+
+#define VM_INTERP_NAME vm_interp_tiered
+#define VM_INTERP_CHECKED 0
+#define VM_INTERP_PAIRS 0
+#define VM_INTERP_PROFILE 0
+#define VM_INTERP_TIERED 1
+#include "bytecode_interp.h"
+
+// Verified code runs without checking the operands of every instruction executed
+bool vm_interp(VM *vm) {
+    if (vm->profile)  return vm_interp_profile(vm);
+    if (vm->pairs)    return vm_interp_pairs(vm);
+    if (vm->verified && vm->compile) return vm_interp_tiered(vm);
+    if (vm->verified) return vm_interp_unchecked(vm);
+    return vm_interp_checked(vm);
 }
 
 void vm_dump(VM *vm) {
-    for (i32 i = 0; i < arrlen(vm->registers); i++) {
+    for (i32 i = 0; i < vm->num_registers; i++) {
         disasmreg(i);
         printf("%llu\n", vm->registers[i].u);
     }
 }
+
+int vm_pair_count_compare(const void *a, const void *b) {
+    u64 lhs = ((u64 *) a)[0];
+    u64 rhs = ((u64 *) b)[0];
+    return lhs < rhs ? 1 : lhs > rhs ? -1 : 0;
+}
+
+void vm_dump_pairs(BCPairCounts *pairs, u32 max) {
+    u64 (*sorted)[2] = NULL; // count, first << 8 | second
+    for (u32 first = 0; first < 256; first++) {
+        for (u32 second = 0; second < 256; second++) {
+            if (!pairs->counts[first][second]) continue;
+            u64 entry[2] = { pairs->counts[first][second], first << 8 | second };
+            arraddn(sorted, 1);
+            memcpy(sorted[arrlen(sorted) - 1], entry, sizeof entry);
+        }
+    }
+    qsort(sorted, arrlen(sorted), sizeof *sorted, vm_pair_count_compare);
+    printf("== opcode pairs (%llu executed) ==\n", pairs->total);
+    for (i64 i = 0; i < arrlen(sorted) && i < max; i++) {
+        u8 first = sorted[i][1] >> 8;
+        u8 second = sorted[i][1] & 0xFF;
+        printf("%-8s %-8s %12llu %5.1f%%\n", bc_opcode_names[first], bc_opcode_names[second],
+               sorted[i][0], 100.0 * sorted[i][0] / pairs->total);
+    }
+    arrfree(sorted);
+}
+
+void vm_free_profile(VMProfile *profile) {
+    arrfree(profile->counts);
+    arrfree(profile->taken);
+    arrfree(profile->frame_calls);
+    arrfree(profile->frame_nanoseconds);
+    arrfree(profile->open_frames);
+}
+
+void vm_report_bar(u64 count, u64 total) {
+    i32 width = total ? (i32) (40 * count / total) : 0;
+    for (i32 i = 0; i < width; i++) putchar('#');
+}
+
+/*
+ Reports the profile of the last runs of vm as counters to the profiler and as text: a histogram of
+ the opcodes executed, the max hottest instructions disassembled with how often conditional branches
+ were taken and the time spent in each frame.
+*/
+void vm_report_profile(VM *vm, u32 max) {
+    VMProfile *profile = vm->profile;
+    u64 opcodes[256] = {0};
+    for (i64 i = 0; i < arrlen(profile->counts); i++) {
+        i32 opcode = vm_op_opcode[vm->insts[i].op];
+        if (opcode >= 0) opcodes[opcode] += profile->counts[i];
+    }
+
+    COUNTER2(BYTECODE, "vm", INT("instructions", profile->total), INT("nanoseconds", profile->nanoseconds));
+    printf("== opcodes (%llu executed in %.3fms) ==\n", profile->total, profile->nanoseconds / 1e6);
+    for (u32 opcode = 0; opcode < 256; opcode++) {
+        if (!opcodes[opcode]) continue;
+        COUNTER1(BYTECODE, bc_opcode_names[opcode], INT("executions", opcodes[opcode]));
+        printf("%-8s %12llu %5.1f%% ", bc_opcode_names[opcode], opcodes[opcode],
+               100.0 * opcodes[opcode] / profile->total);
+        vm_report_bar(opcodes[opcode], profile->total);
+        printf("\n");
+    }
+
+    u64 (*sorted)[2] = NULL; // count, instruction
+    for (i64 i = 0; i < arrlen(profile->counts); i++) {
+        if (!profile->counts[i]) continue;
+        u64 entry[2] = { profile->counts[i], i };
+        arraddn(sorted, 1);
+        memcpy(sorted[arrlen(sorted) - 1], entry, sizeof entry);
+    }
+    qsort(sorted, arrlen(sorted), sizeof *sorted, vm_pair_count_compare);
+    printf("== hot instructions ==\n");
+    for (i64 i = 0; i < arrlen(sorted) && i < max; i++) {
+        u64 count = sorted[i][0];
+        u32 index = (u32) sorted[i][1];
+        u32 offset = vm->offsets[index];
+        printf("%12llu %5.1f%% %4u  ", count, 100.0 * count / profile->total, offset);
+        i32 opcode = vm_op_opcode[vm->insts[index].op];
+        if (opcode < 0) {
+            printf("(%s)", vm->insts[index].op == VM_GUARD ? "guard" : "invalid");
+        } else if (offset < vm->code_size) {
+            disassemble_inst(vm->code, vm->code_size, offset);
+        } else {
+            printf("hlt (end of code)");
+        }
+        bool conditional = (opcode >= JE && opcode <= JGE) || (opcode >= CMPJE && opcode <= CMPJGE);
+        if (conditional) {
+            printf("  taken %.1f%%", 100.0 * profile->taken[index] / count);
+        }
+        printf("\n");
+    }
+    arrfree(sorted);
+
+    printf("== frames ==\n");
+    for (i64 i = 0; i < arrlen(profile->frame_calls); i++) {
+        if (!profile->frame_calls[i]) continue;
+        printf("%4u %12llu calls %12.3fms\n", vm->offsets[i], profile->frame_calls[i],
+               profile->frame_nanoseconds[i] / 1e6);
+    }
+}
+
+/*
+ Trampolines are generated as x86-64 machine code with the signature VMTrampoline:
+
+     push rbp; mov rbp, rsp
+     mov r11, rdi; mov r10, rsi              r11 = function, r10 = args
+     sub rsp, 8                              if needed to keep rsp 16 byte aligned at the call
+     push [r10 + 8*i] ...                    arguments past the registers, from the last
+     mov rdi..r9, [r10 + 8*i]                integer arguments
+     movsd/cvtsd2ss xmm0..7, [r10 + 8*i]     floating point arguments
+     mov eax, number of xmm registers used   as variadic functions expect
+     call r11
+     movsx/movzx rax or movq rax, xmm0       widen the result
+     leave; ret
+*/
+#if defined(__x86_64__) && !defined(_WIN32)
+#define BC_HAS_TRAMPOLINES 1
+#else
+#define BC_HAS_TRAMPOLINES 0
+#endif
+
+#define X64(code, ...) bc_x64(code, (u8[]){ __VA_ARGS__ }, sizeof((u8[]){ __VA_ARGS__ }))
+
+void bc_x64(u8 **code, u8 *bytes, u32 len) {
+    arraddn(*code, len);
+    memcpy(*code + arrlen(*code) - len, bytes, len);
+}
+
+void bc_x64_disp32(u8 **code, u32 disp) {
+    X64(code, disp & 0xFF, (disp >> 8) & 0xFF, (disp >> 16) & 0xFF, disp >> 24);
+}
+
+typedef struct BCTrampolineEntry BCTrampolineEntry;
+struct BCTrampolineEntry {
+    BCSignature key;
+    VMTrampoline value;
+};
+
+BCTrampolineEntry *bc_trampolines; // hm, every trampoline generated so far
+
+// Returns the trampoline for signature, generating it the first time the signature is seen
+VMTrampoline bc_trampoline(BCSignature signature) {
+#if BC_HAS_TRAMPOLINES
+    if (signature.num_args > BC_MAX_FOREIGN_ARGS) return NULL;
+    memset(signature.args + signature.num_args, 0, BC_MAX_FOREIGN_ARGS - signature.num_args);
+    VMTrampoline trampoline = hmget(bc_trampolines, signature);
+    if (trampoline) return trampoline;
+
+    static const u8 int_regs[] = { 7, 6, 2, 1, 8, 9 }; // rdi rsi rdx rcx r8 r9
+    u32 num_ints = 0;
+    u32 num_floats = 0;
+    u32 stack_args[BC_MAX_FOREIGN_ARGS];
+    u32 num_stack = 0;
+    for (u32 i = 0; i < signature.num_args; i++) {
+        bool is_float = signature.args[i] == BC_ARG_F32 || signature.args[i] == BC_ARG_F64;
+        if (is_float && num_floats < 8)    num_floats++;
+        else if (!is_float && num_ints < 6) num_ints++;
+        else stack_args[num_stack++] = i;
+    }
+
+    u8 *code = NULL;
+    X64(&code, 0x55);                         // push rbp
+    X64(&code, 0x48, 0x89, 0xE5);             // mov rbp, rsp
+    X64(&code, 0x49, 0x89, 0xFB);             // mov r11, rdi
+    X64(&code, 0x49, 0x89, 0xF2);             // mov r10, rsi
+    if (num_stack & 1) {
+        X64(&code, 0x48, 0x83, 0xEC, 0x08);   // sub rsp, 8
+    }
+    for (i32 i = (i32) num_stack - 1; i >= 0; i--) {
+        u32 disp = stack_args[i] * sizeof(Val);
+        if (signature.args[stack_args[i]] == BC_ARG_F32) {
+            X64(&code, 0xF2, 0x45, 0x0F, 0x5A, 0xBA);       // cvtsd2ss xmm15, [r10 + disp]
+            bc_x64_disp32(&code, disp);
+            X64(&code, 0x48, 0x83, 0xEC, 0x08);             // sub rsp, 8
+            X64(&code, 0xF3, 0x44, 0x0F, 0x11, 0x3C, 0x24); // movss [rsp], xmm15
+        } else {
+            X64(&code, 0x41, 0xFF, 0xB2);                   // push [r10 + disp]
+            bc_x64_disp32(&code, disp);
+        }
+    }
+    num_ints = num_floats = 0;
+    for (u32 i = 0; i < signature.num_args; i++) {
+        u8 kind = signature.args[i];
+        bool is_float = kind == BC_ARG_F32 || kind == BC_ARG_F64;
+        if (is_float && num_floats < 8) {
+            u8 modrm = 0x80 | (num_floats++ << 3) | 2;
+            X64(&code, 0xF2, 0x41, 0x0F, kind == BC_ARG_F32 ? 0x5A : 0x10, modrm); // cvtsd2ss/movsd xmm, [r10 + disp]
+            bc_x64_disp32(&code, i * sizeof(Val));
+        } else if (!is_float && num_ints < 6) {
+            u8 reg = int_regs[num_ints++];
+            X64(&code, 0x49 | ((reg & 8) >> 1), 0x8B, 0x80 | ((reg & 7) << 3) | 2); // mov reg, [r10 + disp]
+            bc_x64_disp32(&code, i * sizeof(Val));
+        }
+    }
+    X64(&code, 0xB8);                         // mov eax, num_floats
+    bc_x64_disp32(&code, num_floats);
+    X64(&code, 0x41, 0xFF, 0xD3);             // call r11
+    switch (signature.result) {
+        case BC_ARG_VOID: X64(&code, 0x31, 0xC0); break;             // xor eax, eax
+        case BC_ARG_I8:   X64(&code, 0x48, 0x0F, 0xBE, 0xC0); break; // movsx rax, al
+        case BC_ARG_U8:   X64(&code, 0x0F, 0xB6, 0xC0); break;       // movzx eax, al
+        case BC_ARG_I16:  X64(&code, 0x48, 0x0F, 0xBF, 0xC0); break; // movsx rax, ax
+        case BC_ARG_U16:  X64(&code, 0x0F, 0xB7, 0xC0); break;       // movzx eax, ax
+        case BC_ARG_I32:  X64(&code, 0x48, 0x63, 0xC0); break;       // movsxd rax, eax
+        case BC_ARG_U32:  X64(&code, 0x89, 0xC0); break;             // mov eax, eax
+        case BC_ARG_I64:  break;
+        case BC_ARG_F32:
+            X64(&code, 0xF3, 0x0F, 0x5A, 0xC0);                      // cvtss2sd xmm0, xmm0
+            // fallthrough
+        case BC_ARG_F64:
+            X64(&code, 0x66, 0x48, 0x0F, 0x7E, 0xC0);                // movq rax, xmm0
+            break;
+    }
+    X64(&code, 0xC9);                         // leave
+    X64(&code, 0xC3);                         // ret
+
+    trampoline = (VMTrampoline) MapExecutable(code, arrlen(code));
+    arrfree(code);
+    if (trampoline) hmput(bc_trampolines, signature, trampoline);
+    return trampoline;
+#else
+    return NULL;
+#endif
+}
+
+#undef X64
+
+// Adds a function CALLF may call returning its index, -1 if there's no trampoline for its signature
+i64 vm_add_foreign(VM *vm, const char *name, void *address, BCSignature signature) {
+    VMTrampoline trampoline = bc_trampoline(signature);
+    if (!trampoline) return -1;
+    VMForeign foreign = { name, address, signature, trampoline };
+    arrput(vm->foreigns, foreign);
+    return arrlen(vm->foreigns) - 1;
+}
+
+bool bc_foreign_arg_kind(Ty *type, u8 *kind) {
+    switch (type->kind) {
+        case TYPE_VOID:
+            *kind = BC_ARG_VOID;
+            return true;
+        case TYPE_BOOL:
+            *kind = BC_ARG_U8;
+            return true;
+        case TYPE_INT:
+        case TYPE_ENUM: {
+            bool is_signed = (type->flags & SIGNED) != 0;
+            switch (type->size) {
+                case 1: *kind = is_signed ? BC_ARG_I8  : BC_ARG_U8;  return true;
+                case 2: *kind = is_signed ? BC_ARG_I16 : BC_ARG_U16; return true;
+                case 4: *kind = is_signed ? BC_ARG_I32 : BC_ARG_U32; return true;
+                case 8: *kind = BC_ARG_I64; return true;
+                default: return false;
+            }
+        }
+        case TYPE_FLOAT:
+            *kind = type->size == 4 ? BC_ARG_F32 : BC_ARG_F64;
+            return true;
+        case TYPE_PTR:
+        case TYPE_FUNC:
+            *kind = BC_ARG_I64;
+            return true;
+        default: // aggregates aren't passed by value yet
+            return false;
+    }
+}
+
+// Fills signature for a function of type, returning false for those that can't be called from the VM
+bool bc_foreign_signature(Ty *type, BCSignature *signature) {
+    memset(signature, 0, sizeof *signature);
+    if (type->kind != TYPE_FUNC || (type->flags & (FUNC_VARGS | FUNC_CVARGS))) return false;
+    if (arrlen(type->tfunc.params) > BC_MAX_FOREIGN_ARGS) return false;
+    signature->num_args = (u8) arrlen(type->tfunc.params);
+    for (u32 i = 0; i < signature->num_args; i++) {
+        u8 kind;
+        if (!bc_foreign_arg_kind(type->tfunc.params[i], &kind) || kind == BC_ARG_VOID) return false;
+        signature->args[i] = kind;
+    }
+    Ty *result = type->tfunc.result;
+    if (result && result->kind == TYPE_STRUCT) {
+        if (arrlen(result->taggregate.fields) != 1) return false;
+        result = result->taggregate.fields[0].type;
+    }
+    return !result || bc_foreign_arg_kind(result, &signature->result);
+}
+
+typedef struct BCLibrary BCLibrary;
+struct BCLibrary {
+    const char *name;
+    void *handle;
+};
+
+BCLibrary *bc_libraries; // arr, opened by bc_foreign_address
+
+void *bc_foreign_library(const char *name) {
+    for (i64 i = 0; i < arrlen(bc_libraries); i++) {
+        if (name == bc_libraries[i].name || (name && bc_libraries[i].name && strcmp(name, bc_libraries[i].name) == 0)) {
+            return bc_libraries[i].handle;
+        }
+    }
+    BCLibrary library = { name, library_open(name, compiler.library_search_paths, compiler.num_library_search_paths) };
+    if (!library.handle) verbose("Failed to open library %s for foreign calls", name);
+    arrput(bc_libraries, library);
+    return library.handle;
+}
+
+/*
+ Resolves a foreign symbol against the libraries named by #library (arr) then the running executable,
+ which covers libc. The llvm intrinsics packages/math declares resolve to the libm function of the
+ same name, llvm.sqrt.f64 to sqrt and llvm.sqrt.f32 to sqrtf.
+*/
+void *bc_foreign_address(const char *name, const char **libraries) {
+    char intrinsic[MAX_NAME];
+    bool is_intrinsic = strncmp(name, "llvm.", 5) == 0;
+    if (is_intrinsic) {
+        const char *start = name + 5;
+        const char *end = strchr(start, '.');
+        i32 len = (i32) (end ? end - start : strlen(start));
+        bool is_f32 = end && strcmp(end, ".f32") == 0;
+        snprintf(intrinsic, sizeof intrinsic, "%.*s%s", len, start, is_f32 ? "f" : "");
+        name = intrinsic;
+    }
+    for (i64 i = 0; i < arrlen(libraries); i++) {
+        void *library = bc_foreign_library(libraries[i]);
+        void *address = library ? library_symbol(library, name) : NULL;
+        if (address) return address;
+    }
+    void *self = bc_foreign_library(NULL);
+    void *address = self ? library_symbol(self, name) : NULL;
+    if (!address && is_intrinsic) {
+        void *libm = bc_foreign_library("m");
+        address = libm ? library_symbol(libm, name) : NULL;
+    }
+    return address;
+}
+
+// Adds the function a #foreign declaration names to vm, returning its index or -1 if it can't be
+i64 vm_add_foreign_sym(VM *vm, Sym *sym, const char **libraries) {
+    const char *name = sym->external_name ? sym->external_name : sym->name;
+    BCSignature signature;
+    if (!bc_foreign_signature(sym->type, &signature)) {
+        verbose("Foreign function %s has a signature the VM can't call", name);
+        return -1;
+    }
+    void *address = bc_foreign_address(name, libraries);
+    if (!address) {
+        verbose("Failed to find foreign function %s", name);
+        return -1;
+    }
+    return vm_add_foreign(vm, name, address, signature);
+}
+
+/*
+ bc_optimize rewrites a block's code in place. The code is decoded into BCInst with branch targets
+ held as instruction indices, then:
+  - Copy propagation replaces reads of registers last written by a MOV with its source, within
+    each basic block
+  - Dead move elimination removes MOVs to registers which are not live afterwards. Every register
+    is live when the code halts since the host may read any of them
+  - Fusion replaces adjacent pairs with a superinstruction, a CMP and conditional branch becoming
+    a CMPJ* and a LD8 into a temporary added into a register becoming LD8ADD. ADDs of an
+    immediate into their destination become ADDI.
+ The result is re-encoded, growing branch displacements until every one fits.
+
+ Code that branches through registers can not be relocated and is left untouched.
+ */
+
+typedef struct BCInst BCInst;
+struct BCInst {
+    u8 opcode;
+    BCOperand x; // always a register, except for CMPJ* where the target is held instead
+    BCOperand y;
+    BCOperand z;
+    i32 target;  // index of the instruction branched to, -1 if not a branch
+    bool deleted;
+};
+
+// A pair must make up at least 1 in BC_FUSE_MIN_SHARE of those executed to be fused
+#define BC_FUSE_MIN_SHARE 100
+
+bool bc_is_jcc(u8 opcode) {
+    return opcode >= JE && opcode <= JGE;
+}
+
+bool bc_is_branch(u8 opcode) {
+    VMOpLayout layout = vm_op_info[opcode].layout;
+    return layout == VM_BRANCH || layout == VM_CMPJ;
+}
+
+bool bc_is_call(u8 opcode) {
+    return opcode == CALL || opcode == CALLF;
+}
+
+bool bc_ends_block(u8 opcode) {
+    return bc_is_branch(opcode) || opcode == HLT || opcode == RET;
+}
+
+// Decodes the block's code into insts, returns false for invalid code or code that branches through
+// registers
+bool bc_decode(BCBlock *block, BCInst **insts) {
+    u8 *code = block->code;
+    u64 len = arrlen(code);
+    i64 site = 0;
+    i32 *index_of_offset = NULL;
+    arrsetlen(index_of_offset, len + 1);
+    for (u64 i = 0; i <= len; i++) index_of_offset[i] = -1;
+    u64 *targets = NULL; // offset branched to by each inst
+
+    bool ok = false;
+    for (u64 offset = 0; offset < len;) {
+        u8 opcode = code[offset];
+        VMOpInfo info = vm_op_info[opcode];
+        i32 inst_len = bc_inst_length(code, len, offset);
+        if (info.layout == VM_INVALID || !inst_len) goto done;
+
+        VMInstructionOperands op = {0};
+        if (bc_has_operands(opcode)) vm_decode_operands(code + offset + 1, &op);
+        BCInst inst = { opcode, reg((u32) op.x.val), { op.y.is_imm, .val.u = op.y.val },
+                        { op.z.is_imm, .val.u = op.z.val }, -1 };
+        u64 next = offset + inst_len;
+        // Address immediates are marked so encoding the inst again records where they moved to
+        if (site < arrlen(block->address_sites) && block->address_sites[site] < next) {
+            u8 operands = code[offset + 1];
+            u64 y = offset + 2 + reg_size[(operands & 0xC0) >> 6];
+            u64 z = y + ((operands & 0x20) ? imm_size[(operands & 0x18) >> 3] : reg_size[(operands & 0x18) >> 3]);
+            for (; site < arrlen(block->address_sites) && block->address_sites[site] < next; site++) {
+                if (block->address_sites[site] == y) inst.y.is_address = true;
+                else if (block->address_sites[site] == z) inst.z.is_address = true;
+                else goto done;
+            }
+        }
+        u64 target = UINT64_MAX;
+        if (info.layout == VM_BRANCH) {
+            if (!op.z.is_imm) goto done;
+            target = next + op.z.val;
+        } else if (info.layout == VM_CMPJ) {
+            target = next + (i32) (u32) op.x.val;
+        }
+        index_of_offset[offset] = (i32) arrlen(*insts);
+        arrput(*insts, inst);
+        arrput(targets, target);
+        offset = next;
+    }
+    index_of_offset[len] = (i32) arrlen(*insts);
+
+    for (i64 i = 0; i < arrlen(*insts); i++) {
+        if (targets[i] == UINT64_MAX) continue;
+        if (targets[i] > len || index_of_offset[targets[i]] < 0) goto done;
+        (*insts)[i].target = index_of_offset[targets[i]];
+    }
+    ok = true;
+
+done:
+    arrfree(targets);
+    arrfree(index_of_offset);
+    return ok;
+}
+
+// Fills reads with the operands inst reads, imm_ok is set for those an immediate may replace
+i32 bc_reads(BCInst *inst, BCOperand **reads, bool *imm_ok) {
+    i32 n = 0;
+    switch (vm_op_info[inst->opcode].layout) {
+        case VM_XYZ:
+            if (bc_is_store(inst->opcode) || inst->opcode == LD8ADD) {
+                imm_ok[n] = false, reads[n++] = &inst->x;
+            }
+            // fallthrough
+        case VM_YZ:
+        case VM_CMPJ:
+        case VM_VEC_MEM:
+            imm_ok[n] = true, reads[n++] = &inst->y;
+            imm_ok[n] = true, reads[n++] = &inst->z;
+            break;
+        case VM_ACC:
+            imm_ok[n] = false, reads[n++] = &inst->x;
+            imm_ok[n] = true,  reads[n++] = &inst->z;
+            break;
+        case VM_DST_Z:
+        case VM_Z:
+        case VM_BRANCH:
+            imm_ok[n] = true, reads[n++] = &inst->z;
+            break;
+        default:
+            break;
+    }
+    return n;
+}
+
+// Returns the register inst writes or -1
+i64 bc_written(BCInst *inst) {
+    switch (vm_op_info[inst->opcode].layout) {
+        case VM_XYZ: return bc_is_store(inst->opcode) ? -1 : (i64) inst->x.val.u;
+        case VM_ACC: return (i64) inst->x.val.u;
+        case VM_DST_Z: return (i64) inst->y.val.u;
+        case VM_DST: return (i64) inst->z.val.u;
+        default: return -1;
+    }
+}
+
+// Returns the first instruction not deleted at or after index
+i32 bc_resolve(BCInst *insts, i32 index) {
+    while (index < arrlen(insts) && insts[index].deleted) index++;
+    return index;
+}
+
+bool *bc_leaders(BCInst *insts) {
+    bool *leaders = NULL;
+    arrsetlen(leaders, arrlen(insts) + 1);
+    memset(leaders, 0, arrlen(leaders) * sizeof *leaders);
+    leaders[bc_resolve(insts, 0)] = true;
+    for (i32 i = 0; i < arrlen(insts); i++) {
+        if (insts[i].deleted) continue;
+        if (insts[i].target >= 0) leaders[bc_resolve(insts, insts[i].target)] = true;
+        if (bc_ends_block(insts[i].opcode)) leaders[bc_resolve(insts, i + 1)] = true;
+    }
+    return leaders;
+}
+
+bool bc_copy_propagate(BCInst *insts, u32 num_registers) {
+    bool changed = false;
+    bool *leaders = bc_leaders(insts);
+    bool *known = xcalloc(num_registers * sizeof *known);
+    BCOperand *copies = xcalloc(num_registers * sizeof *copies);
+    for (i32 i = 0; i < arrlen(insts); i++) {
+        BCInst *inst = &insts[i];
+        if (inst->deleted) continue;
+        if (leaders[i] || bc_is_call(inst->opcode)) memset(known, 0, num_registers * sizeof *known);
+
+        BCOperand *reads[3];
+        bool imm_ok[3];
+        i32 num_reads = bc_reads(inst, reads, imm_ok);
+        for (i32 j = 0; j < num_reads; j++) {
+            BCOperand *read = reads[j];
+            if (read->is_immediate || !known[read->val.u]) continue;
+            BCOperand copy = copies[read->val.u];
+            if (copy.is_immediate && !imm_ok[j]) continue;
+            *read = copy;
+            changed = true;
+        }
+
+        i64 written = bc_written(inst);
+        if (written < 0) continue;
+        known[written] = false;
+        for (u32 r = 0; r < num_registers; r++) {
+            if (known[r] && !copies[r].is_immediate && copies[r].val.u == (u64) written) known[r] = false;
+        }
+        if (inst->opcode == MOV && written > RSP) {
+            BCOperand src = inst->z;
+            if (!src.is_immediate && src.val.u == 0) src = imm(0);
+            if (src.is_immediate || (src.val.u > RSP && src.val.u != (u64) written)) {
+                known[written] = true;
+                copies[written] = src;
+            }
+        }
+    }
+    free(copies);
+    free(known);
+    arrfree(leaders);
+    return changed;
+}
+
+// Returns the registers live after each instruction, as num_words u64 bitsets. Registers below
+// num_exit_live are live when the code halts or returns, every register is live into a call
+u64 *bc_live_out(BCInst *insts, u32 num_words, u32 num_exit_live) {
+    i64 n = arrlen(insts);
+    u64 *live_in = xcalloc((n + 1) * num_words * sizeof(u64));
+    u64 *live_out = xcalloc((n + 1) * num_words * sizeof(u64));
+    u64 *new_in = xcalloc(num_words * sizeof(u64));
+    u64 *exit_live = live_in + n * num_words; // running off the end halts
+    for (u32 r = 0; r < num_exit_live && r < num_words * 64; r++) exit_live[r / 64] |= 1ull << (r % 64);
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (i64 i = n - 1; i >= 0; i--) {
+            BCInst *inst = &insts[i];
+            u64 *out = live_out + i * num_words;
+            u64 *in = live_in + i * num_words;
+            bool exits = !inst->deleted && (inst->opcode == HLT || inst->opcode == RET);
+            bool all = !inst->deleted && bc_is_call(inst->opcode);
+            bool falls_through = inst->deleted || (inst->opcode != JMP && !exits && !all);
+            for (u32 w = 0; w < num_words; w++) {
+                u64 bits = all ? UINT64_MAX : exits ? exit_live[w] : 0;
+                if (falls_through) bits |= live_in[(i + 1) * num_words + w];
+                if (!inst->deleted && inst->target >= 0) bits |= live_in[inst->target * num_words + w];
+                out[w] = bits;
+            }
+            memcpy(new_in, out, num_words * sizeof *new_in);
+            if (!inst->deleted) {
+                i64 written = bc_written(inst);
+                if (written >= 0) new_in[written / 64] &= ~(1ull << (written % 64));
+                BCOperand *reads[3];
+                bool imm_ok[3];
+                i32 num_reads = bc_reads(inst, reads, imm_ok);
+                for (i32 j = 0; j < num_reads; j++) {
+                    if (reads[j]->is_immediate) continue;
+                    new_in[reads[j]->val.u / 64] |= 1ull << (reads[j]->val.u % 64);
+                }
+            }
+            if (memcmp(new_in, in, num_words * sizeof *new_in) != 0) {
+                memcpy(in, new_in, num_words * sizeof *new_in);
+                changed = true;
+            }
+        }
+    }
+    free(new_in);
+    free(live_in);
+    return live_out;
+}
+
+bool bc_is_live(u64 *live_out, u32 num_words, i32 index, u64 reg) {
+    return (live_out[index * num_words + reg / 64] >> (reg % 64)) & 1;
+}
+
+bool bc_remove_dead_moves(BCInst *insts, u32 num_words) {
+    bool changed = false;
+    u64 *live_out = bc_live_out(insts, num_words, num_words * 64);
+    for (i32 i = 0; i < arrlen(insts); i++) {
+        BCInst *inst = &insts[i];
+        if (inst->deleted || inst->opcode != MOV) continue;
+        u64 dst = inst->y.val.u;
+        bool self = !inst->z.is_immediate && inst->z.val.u == dst;
+        if (dst > RSP && (self || !bc_is_live(live_out, num_words, i, dst))) {
+            inst->deleted = true;
+            changed = true;
+        }
+    }
+    free(live_out);
+    return changed;
+}
+
+bool bc_fusable(BCPairCounts *pairs, u8 first, u8 second) {
+    if (!pairs) return true;
+    u64 count = pairs->counts[first][second];
+    return count && count * BC_FUSE_MIN_SHARE >= pairs->total;
+}
+
+void bc_fuse(BCInst *insts, u32 num_words, BCPairCounts *pairs) {
+    bool *leaders = bc_leaders(insts);
+    u64 *live_out = bc_live_out(insts, num_words, num_words * 64);
+    for (i32 i = 0; i < arrlen(insts); i++) {
+        BCInst *inst = &insts[i];
+        if (inst->deleted) continue;
+
+        if (inst->opcode == ADD && inst->x.val.u != 0) {
+            bool y_is_x = !inst->y.is_immediate && inst->y.val.u == inst->x.val.u;
+            bool z_is_x = !inst->z.is_immediate && inst->z.val.u == inst->x.val.u;
+            if (y_is_x && inst->z.is_immediate) {
+                *inst = (BCInst){ ADDI, inst->x, RZ0, inst->z, -1 };
+            } else if (z_is_x && inst->y.is_immediate) {
+                *inst = (BCInst){ ADDI, inst->x, RZ0, inst->y, -1 };
+            }
+        }
+
+        i32 j = bc_resolve(insts, i + 1);
+        if (j == arrlen(insts) || leaders[j]) continue;
+        BCInst *next = &insts[j];
+
+        if (inst->opcode == CMP && bc_is_jcc(next->opcode) && bc_fusable(pairs, CMP, next->opcode)) {
+            u8 opcode = CMPJE + (next->opcode - JE);
+            *inst = (BCInst){ opcode, RZ0, inst->y, inst->z, next->target };
+            next->deleted = true;
+        } else if (inst->opcode == LD8 && next->opcode == ADD && bc_fusable(pairs, LD8, ADD)) {
+            u64 tmp = inst->x.val.u;
+            u64 dst = next->x.val.u;
+            bool y_is_tmp = !next->y.is_immediate && next->y.val.u == tmp;
+            bool z_is_tmp = !next->z.is_immediate && next->z.val.u == tmp;
+            bool y_is_dst = !next->y.is_immediate && next->y.val.u == dst;
+            bool z_is_dst = !next->z.is_immediate && next->z.val.u == dst;
+            if (tmp > RSP && dst != 0 && tmp != dst && ((y_is_tmp && z_is_dst) || (z_is_tmp && y_is_dst)) &&
+                !bc_is_live(live_out, num_words, j, tmp)) {
+                *inst = (BCInst){ LD8ADD, next->x, inst->y, inst->z, -1 };
+                next->deleted = true;
+            }
+        }
+    }
+    free(live_out);
+    arrfree(leaders);
+}
+
+void bc_encode(BCBuilder *b, BCInst *inst, i64 disp) {
+    switch (vm_op_info[inst->opcode].layout) {
+        case VM_NONE:
+            arrput(b->block->code, inst->opcode);
+            break;
+        case VM_BRANCH:
+            enc(b, inst->opcode, (Reg) inst->x.val.u, RZ0, imm((u64) disp));
+            break;
+        case VM_CMPJ:
+            enc(b, inst->opcode, (u32) (i32) disp, inst->y, inst->z);
+            break;
+        default:
+            enc(b, inst->opcode, (Reg) inst->x.val.u, inst->y, inst->z);
+            break;
+    }
+}
+
+i64 bc_displacement(BCInst *insts, u64 *offsets, u32 *lengths, i64 index) {
+    if (insts[index].target < 0) return 0;
+    u64 target = offsets[bc_resolve(insts, insts[index].target)];
+    return (i64) target - (i64) (offsets[index] + lengths[index]);
+}
+
+// Encodes the instructions not deleted into code. Every branch starts out at its shortest and is
+// grown until its displacement fits, lengths only ever grow so this terminates
+void bc_relayout(BCInst *insts, BCBlock *block) {
+    i64 n = arrlen(insts);
+    u64 *offsets = xcalloc((n + 1) * sizeof *offsets);
+    u32 *lengths = xcalloc((n + 1) * sizeof *lengths);
+    BCBlock scratch = {0};
+    BCBuilder b = { &scratch };
+
+    for (bool changed = true; changed;) {
+        u64 offset = 0;
+        for (i64 i = 0; i <= n; i++) {
+            offsets[i] = offset;
+            if (i < n && !insts[i].deleted) offset += lengths[i];
+        }
+        changed = false;
+        for (i64 i = 0; i < n; i++) {
+            if (insts[i].deleted) continue;
+            arrsetlen(scratch.code, 0);
+            bc_encode(&b, &insts[i], bc_displacement(insts, offsets, lengths, i));
+            if (arrlen(scratch.code) > lengths[i]) {
+                lengths[i] = (u32) arrlen(scratch.code);
+                changed = true;
+            }
+        }
+    }
+
+    arrsetlen(block->code, 0);
+    arrsetlen(block->address_sites, 0);
+    BCBuilder out = { block };
+    for (i64 i = 0; i < n; i++) {
+        if (insts[i].deleted) continue;
+        bc_encode(&out, &insts[i], bc_displacement(insts, offsets, lengths, i));
+        // Growing a branch can shrink its own displacement, pad it out to the length laid out
+        while (arrlen(block->code) < offsets[i] + lengths[i]) arrput(block->code, NOP);
+    }
+
+    arrfree(scratch.code);
+    arrfree(scratch.address_sites);
+    free(lengths);
+    free(offsets);
+}
+
+// Returns false, leaving the code untouched, if it can't be optimized
+bool bc_optimize(BCBlock *block, BCPairCounts *pairs) {
+    BCInst *insts = NULL;
+    if (!bc_decode(block, &insts)) {
+        arrfree(insts);
+        return false;
+    }
+
+    u32 num_registers = RSP + 1;
+    for (i64 i = 0; i < arrlen(insts); i++) {
+        BCOperand *ops[3] = { &insts[i].x, &insts[i].y, &insts[i].z };
+        for (i32 j = 0; j < 3; j++) {
+            if (vm_op_info[insts[i].opcode].layout == VM_CMPJ && j == 0) continue;
+            if (!ops[j]->is_immediate) num_registers = MAX(num_registers, (u32) ops[j]->val.u + 1);
+        }
+    }
+    u32 num_words = (num_registers + 63) / 64;
+
+    for (i32 pass = 0; pass < 4; pass++) {
+        bool changed = bc_copy_propagate(insts, num_registers);
+        changed |= bc_remove_dead_moves(insts, num_words);
+        if (!changed) break;
+    }
+    bc_fuse(insts, num_words, pairs);
+    bc_relayout(insts, block);
+    arrfree(insts);
+    return true;
+}
+
+/*
+ bc_allocate_registers packs the virtual registers of a block, those from num_fixed up, into as few
+ physical registers as possible using linear scan over live intervals.
+
+ Instruction i reads its operands at point 2i and writes its result at 2i + 1, so a value last read
+ by an instruction can share a register with the one it writes. A register live after i is live
+ at 2i + 2. Virtual registers are not live once the code halts, fixed ones are left untouched.
+
+ Intervals never need spilling since the register file grows to fit, but registers past 255 take
+ longer encodings. Each physical register is weighted by the uses of the intervals assigned to it,
+ scaled by loop depth, and the heaviest are numbered first so hot values get the short encodings.
+ */
+
+typedef struct BCInterval BCInterval;
+struct BCInterval {
+    u32 reg;
+    u32 start;
+    u32 end;
+    u32 color; // index of the physical register before they are ordered by weight
+    f64 weight;
+};
+
+int bc_interval_compare(const void *a, const void *b) {
+    const BCInterval *lhs = a;
+    const BCInterval *rhs = b;
+    if (lhs->start != rhs->start) return lhs->start < rhs->start ? -1 : 1;
+    return lhs->reg < rhs->reg ? -1 : lhs->reg > rhs->reg;
+}
+
+typedef struct BCColor BCColor;
+struct BCColor {
+    u32 color;
+    f64 weight;
+};
+
+int bc_color_compare(const void *a, const void *b) {
+    const BCColor *lhs = a;
+    const BCColor *rhs = b;
+    if (lhs->weight != rhs->weight) return lhs->weight > rhs->weight ? -1 : 1;
+    return lhs->color < rhs->color ? -1 : lhs->color > rhs->color;
+}
+
+// Uses are weighted 10x for each loop they're within, up to 8 deep
+static const u32 bc_loop_weights[] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000,
+};
+
+// Returns the number of loops each instruction is within, loops being found from backward branches
+u32 *bc_loop_depths(BCInst *insts) {
+    i64 n = arrlen(insts);
+    i32 *deltas = xcalloc((n + 1) * sizeof *deltas);
+    for (i64 i = 0; i < n; i++) {
+        if (insts[i].target < 0 || insts[i].target > i || insts[i].opcode == CALL) continue;
+        deltas[insts[i].target]++;
+        deltas[i + 1]--;
+    }
+    u32 *depths = xcalloc((n + 1) * sizeof *depths);
+    i32 depth = 0;
+    for (i64 i = 0; i < n; i++) {
+        depth += deltas[i];
+        depths[i] = depth;
+    }
+    free(deltas);
+    return depths;
+}
+
+// Returns the first of X, Y & Z which may name a scalar register, 3 when none of them do
+i32 bc_first_scalar_operand(u8 opcode) {
+    switch (vm_op_info[opcode].layout) {
+        case VM_CMPJ: case VM_VEC_MEM: return 1;
+        case VM_VEC:  case VM_VEC_IMM: return 3;
+        default: return 0;
+    }
+}
+
+// Returns false, leaving the code untouched, if it can't be allocated. Code making calls can't be as
+// the registers of a call's window are fixed by where the window starts.
+bool bc_allocate_registers(BCBlock *block, u32 num_fixed, u32 *highest_register) {
+    num_fixed = MAX(num_fixed, RSP + 1);
+    BCInst *insts = NULL;
+    if (!bc_decode(block, &insts)) {
+        arrfree(insts);
+        return false;
+    }
+    i64 n = arrlen(insts);
+    for (i64 i = 0; i < n; i++) {
+        if (!bc_is_call(insts[i].opcode)) continue;
+        arrfree(insts);
+        return false;
+    }
+
+    u32 num_registers = num_fixed;
+    for (i64 i = 0; i < n; i++) {
+        BCOperand *ops[3] = { &insts[i].x, &insts[i].y, &insts[i].z };
+        for (i32 j = bc_first_scalar_operand(insts[i].opcode); j < 3; j++) {
+            if (!ops[j]->is_immediate) num_registers = MAX(num_registers, (u32) ops[j]->val.u + 1);
+        }
+    }
+    u32 num_words = (num_registers + 63) / 64;
+    u64 *live_out = bc_live_out(insts, num_words, num_fixed);
+    u32 *depths = bc_loop_depths(insts);
+
+    // Build an interval for every virtual register from its references and where it is live
+    BCInterval *intervals = xcalloc(num_registers * sizeof *intervals);
+    for (u32 r = 0; r < num_registers; r++) intervals[r] = (BCInterval){ r, UINT32_MAX, 0 };
+    for (i64 i = 0; i < n; i++) {
+        u32 read = (u32) (2 * i), write = read + 1, after = read + 2;
+        f64 weight = bc_loop_weights[MIN(depths[i], 8)];
+        BCOperand *reads[3];
+        bool imm_ok[3];
+        i32 num_reads = bc_reads(&insts[i], reads, imm_ok);
+        for (i32 j = 0; j < num_reads; j++) {
+            if (reads[j]->is_immediate || reads[j]->val.u < num_fixed) continue;
+            BCInterval *interval = &intervals[reads[j]->val.u];
+            interval->start = MIN(interval->start, read);
+            interval->end = MAX(interval->end, read);
+            interval->weight += weight;
+        }
+        i64 written = bc_written(&insts[i]);
+        if (written >= num_fixed) {
+            BCInterval *interval = &intervals[written];
+            interval->start = MIN(interval->start, write);
+            interval->end = MAX(interval->end, write);
+            interval->weight += weight;
+        }
+        u64 *out = live_out + i * num_words;
+        for (u32 w = num_fixed / 64; w < num_words; w++) {
+            for (u64 bits = out[w]; bits; bits &= bits - 1) {
+                u32 r = w * 64 + __builtin_ctzll(bits);
+                if (r < num_fixed) continue;
+                // Only values live into i are live at its reads, one it defines starts at its write
+                intervals[r].start = MIN(intervals[r].start, r == written ? write : read);
+                intervals[r].end = MAX(intervals[r].end, after);
+            }
+        }
+    }
+    free(depths);
+    free(live_out);
+
+    BCInterval *sorted = NULL;
+    for (u32 r = num_fixed; r < num_registers; r++) {
+        if (intervals[r].start != UINT32_MAX) arrput(sorted, intervals[r]);
+    }
+    qsort(sorted, arrlen(sorted), sizeof *sorted, bc_interval_compare);
+
+    // Linear scan, the active intervals are kept ordered by their end
+    BCInterval **active = NULL;
+    u32 *free_colors = NULL; // kept in descending order so the lowest is popped first
+    BCColor *colors = NULL;
+    for (i64 i = 0; i < arrlen(sorted); i++) {
+        BCInterval *interval = &sorted[i];
+        while (arrlen(active) && active[0]->end < interval->start) {
+            u32 color = active[0]->color;
+            arrdel(active, 0);
+            i64 at = arrlen(free_colors);
+            while (at > 0 && free_colors[at - 1] < color) at--;
+            arrins(free_colors, at, color);
+        }
+        if (arrlen(free_colors)) {
+            interval->color = arrpop(free_colors);
+        } else {
+            interval->color = (u32) arrlen(colors);
+            arrput(colors, ((BCColor){ interval->color, 0 }));
+        }
+        colors[interval->color].weight += interval->weight;
+        i64 at = arrlen(active);
+        while (at > 0 && active[at - 1]->end > interval->end) at--;
+        arrins(active, at, interval);
+    }
+
+    qsort(colors, arrlen(colors), sizeof *colors, bc_color_compare);
+    u32 *physical = xcalloc((arrlen(colors) + 1) * sizeof *physical);
+    for (i64 i = 0; i < arrlen(colors); i++) physical[colors[i].color] = num_fixed + (u32) i;
+    for (i64 i = 0; i < arrlen(sorted); i++) intervals[sorted[i].reg].color = sorted[i].color;
+
+    for (i64 i = 0; i < n; i++) {
+        BCOperand *ops[3] = { &insts[i].x, &insts[i].y, &insts[i].z };
+        for (i32 j = bc_first_scalar_operand(insts[i].opcode); j < 3; j++) {
+            if (ops[j]->is_immediate || ops[j]->val.u < num_fixed) continue;
+            ops[j]->val.u = physical[intervals[ops[j]->val.u].color];
+        }
+    }
+    u32 num_physical = (u32) arrlen(colors);
+    verbose("Allocated %u virtual registers to %u physical registers", num_registers - num_fixed, num_physical);
+    if (highest_register) *highest_register = num_fixed - 1 + num_physical;
+
+    bc_relayout(insts, block);
+    free(physical);
+    arrfree(colors);
+    arrfree(free_colors);
+    arrfree(active);
+    arrfree(sorted);
+    free(intervals);
+    arrfree(insts);
+    return true;
+}
+
+// Addresses are tagged until the program is written and the layout of its sections is known
+#define BC_ADDRESS_TAG  0xBC00000000000000ull
+#define BC_ADDRESS_MASK 0xFF00000000000000ull
+
+BCOperand bc_address(BCSection section, u64 offset) {
+    ASSERT(offset < (1ull << 48));
+    BCOperand op = imm(BC_ADDRESS_TAG | (u64) section << 48 | offset);
+    op.is_address = true;
+    return op;
+}
+
+u64 bc_add_data(BytecodeProgram *program, BCSection section, const void *bytes, u64 size, u64 align) {
+    ASSERT(section == BC_SECTION_DATA || section == BC_SECTION_RODATA);
+    u8 **data = section == BC_SECTION_DATA ? &program->data : &program->rodata;
+    u64 end = arrlen(*data);
+    u64 offset = ALIGN_UP(end, align);
+    arrsetlen(*data, offset + size);
+    memset(*data + end, 0, offset - end);
+    memcpy(*data + offset, bytes, size);
+    return offset;
+}
+
+u64 bc_add_constant(BytecodeProgram *program, Val val) {
+    arrput(program->constants, val);
+    return (arrlen(program->constants) - 1) * sizeof val;
+}
+
+void bc_add_symbol(BytecodeProgram *program, const char *name, BCSection section, u64 offset, u64 size) {
+    BCSymbol symbol = { (u32) arrlen(program->strings), section, offset, size };
+    size_t len = strlen(name) + 1;
+    arraddn(program->strings, len);
+    memcpy(program->strings + arrlen(program->strings) - len, name, len);
+    arrput(program->symbols, symbol);
+}
+
+// Stores the address of target_offset within target at offset within the data or rodata section
+void bc_add_pointer(BytecodeProgram *program, BCSection section, u64 offset, BCSection target, u64 target_offset) {
+    ASSERT(section == BC_SECTION_DATA || section == BC_SECTION_RODATA);
+    u8 *data = section == BC_SECTION_DATA ? program->data : program->rodata;
+    ASSERT(offset + 8 <= arrlen(data));
+    u64 address = bc_address(target, target_offset).val.u;
+    memcpy(data + offset, &address, sizeof address);
+    BCReloc reloc = { section, target, offset };
+    arrput(program->relocs, reloc);
+}
+
+// Replaces the tagged address at site with its address in the file, returning false if it isn't one
+bool bc_resolve_address(BCFileHeader *header, u8 *site, u32 *target) {
+    u64 address;
+    memcpy(&address, site, sizeof address);
+    if ((address & BC_ADDRESS_MASK) != BC_ADDRESS_TAG) return false;
+    *target = (address >> 48) & 0xFF;
+    if (*target >= NUM_BC_SECTIONS) return false;
+    address = header->base + header->sections[*target].offset + (address & ((1ull << 48) - 1));
+    memcpy(site, &address, sizeof address);
+    return true;
+}
+
+bool bc_write_program(BytecodeProgram *program, const char *path) {
+    TRACE(EMITTING);
+    u64 sizes[NUM_BC_SECTIONS] = {
+        [BC_SECTION_CODE]      = arrlen(program->code),
+        [BC_SECTION_CONSTANTS] = arrlen(program->constants) * sizeof *program->constants,
+        [BC_SECTION_DATA]      = arrlen(program->data),
+        [BC_SECTION_RODATA]    = arrlen(program->rodata),
+        [BC_SECTION_SYMBOLS]   = arrlen(program->symbols) * sizeof *program->symbols,
+        [BC_SECTION_STRINGS]   = arrlen(program->strings),
+    };
+    void *contents[NUM_BC_SECTIONS] = {
+        program->code, program->constants, program->data, program->rodata,
+        program->symbols, program->strings,
+    };
+
+    // Addresses in code are the immediates recorded as code_sites when bc_address operands were
+    // encoded. They are relocated like those in data, by patching the instruction when the file
+    // isn't mapped at its base
+    BCFileHeader header = { BC_FILE_MAGIC, BC_FILE_VERSION, BC_DEFAULT_BASE };
+    header.num_sections = NUM_BC_SECTIONS;
+    u64 len = arrlen(program->code);
+    for (u64 offset = 0; offset < len;) {
+        u8 opcode = program->code[offset];
+        i32 inst_len = bc_inst_length(program->code, len, offset);
+        if (vm_op_info[opcode].layout == VM_INVALID || !inst_len) {
+            warn("Invalid bytecode at offset %llu of %s", offset, path);
+            return false;
+        }
+        if (bc_has_operands(opcode)) {
+            VMInstructionOperands op;
+            vm_decode_operands(program->code + offset + 1, &op);
+            i32 first = bc_first_scalar_operand(opcode);
+            if (first <= 0) header.highest_register = MAX(header.highest_register, (u32) op.x.val);
+            if (first <= 1 && !op.y.is_imm) header.highest_register = MAX(header.highest_register, (u32) op.y.val);
+            if (first <= 2 && !op.z.is_imm) header.highest_register = MAX(header.highest_register, (u32) op.z.val);
+        }
+        offset += inst_len;
+    }
+    sizes[BC_SECTION_RELOCS] = (arrlen(program->code_sites) + arrlen(program->relocs)) * sizeof(BCReloc);
+
+    u64 offset = ALIGN_UP(sizeof header, BC_FILE_ALIGN);
+    for (u32 i = 0; i < NUM_BC_SECTIONS; i++) {
+        header.sections[i] = (BCFileSection){ offset, sizes[i] };
+        offset = ALIGN_UP(offset + sizes[i], BC_FILE_ALIGN);
+    }
+    header.size = offset;
+
+    u8 *file = xcalloc(header.size);
+    memcpy(file, &header, sizeof header);
+    for (u32 i = 0; i < BC_SECTION_RELOCS; i++) {
+        if (sizes[i]) memcpy(file + header.sections[i].offset, contents[i], sizes[i]);
+    }
+
+    BCReloc *relocs = (BCReloc *) (file + header.sections[BC_SECTION_RELOCS].offset);
+    bool ok = true;
+    for (i64 i = 0; i < arrlen(program->code_sites) && ok; i++) {
+        BCReloc reloc = { BC_SECTION_CODE, 0, program->code_sites[i] };
+        ok = reloc.offset + 8 <= len &&
+             bc_resolve_address(&header, file + header.sections[BC_SECTION_CODE].offset + reloc.offset, &reloc.target);
+        *relocs++ = reloc;
+    }
+    for (i64 i = 0; i < arrlen(program->relocs) && ok; i++) {
+        BCReloc reloc = program->relocs[i];
+        ok = bc_resolve_address(&header, file + header.sections[reloc.section].offset + reloc.offset, &reloc.target);
+        *relocs++ = reloc;
+    }
+    if (!ok) {
+        warn("Bytecode for %s holds an address that does not name a section", path);
+        free(file);
+        return false;
+    }
+
+    FILE *f = fopen(path, "wb");
+    if (!f || fwrite(file, 1, header.size, f) != header.size) {
+        warn("Failed to write bytecode to %s", path);
+        ok = false;
+    }
+    if (f) fclose(f);
+    free(file);
+    return ok;
+}
+
+bool bc_load_program(const char *path, BCImage *image) {
+    TRACE(IO);
+    memset(image, 0, sizeof *image);
+    BCFileHeader *header = NULL;
+    FILE *f = fopen(path, "rb");
+    BCFileHeader peek;
+    bool read = f && fread(&peek, sizeof peek, 1, f) == 1;
+    if (f) fclose(f);
+    if (!read || peek.magic != BC_FILE_MAGIC) {
+        warn("%s is not a bytecode file", path);
+        return false;
+    }
+    if (peek.version != BC_FILE_VERSION || peek.num_sections != NUM_BC_SECTIONS) {
+        warn("%s is bytecode version %u, expected %u", path, peek.version, BC_FILE_VERSION);
+        return false;
+    }
+
+    image->base = MapEntireFile(path, (void *) peek.base, &image->size);
+    if (!image->base) {
+        warn("Failed to map %s", path);
+        return false;
+    }
+    header = image->header = (BCFileHeader *) image->base;
+    if (header->size != image->size) goto malformed;
+    for (u32 i = 0; i < NUM_BC_SECTIONS; i++) {
+        BCFileSection section = header->sections[i];
+        if (section.offset > image->size || section.size > image->size - section.offset) goto malformed;
+        image->sections[i] = image->base + section.offset;
+        image->sizes[i] = section.size;
+    }
+
+    image->relocated = (u64) image->base != header->base;
+    BCReloc *relocs = (BCReloc *) image->sections[BC_SECTION_RELOCS];
+    u64 num_relocs = image->sizes[BC_SECTION_RELOCS] / sizeof *relocs;
+    for (u64 i = 0; i < num_relocs && image->relocated; i++) {
+        BCReloc reloc = relocs[i];
+        if (reloc.section >= NUM_BC_SECTIONS || reloc.offset + 8 > image->sizes[reloc.section]) goto malformed;
+        u8 *site = image->sections[reloc.section] + reloc.offset;
+        u64 address;
+        memcpy(&address, site, sizeof address);
+        address += (u64) image->base - header->base;
+        memcpy(site, &address, sizeof address);
+    }
+    verbose("Mapped %s at %p%s", path, image->base, image->relocated ? " (relocated)" : "");
+    return true;
+
+malformed:
+    warn("%s is malformed", path);
+    bc_unload_program(image);
+    return false;
+}
+
+void bc_unload_program(BCImage *image) {
+    if (image->base) UnmapFile(image->base, image->size);
+    memset(image, 0, sizeof *image);
+}
+
+BCSymbol *bc_find_symbol(BCImage *image, const char *name) {
+    BCSymbol *symbols = (BCSymbol *) image->sections[BC_SECTION_SYMBOLS];
+    const char *strings = (const char *) image->sections[BC_SECTION_STRINGS];
+    u64 num_symbols = image->sizes[BC_SECTION_SYMBOLS] / sizeof *symbols;
+    for (u64 i = 0; i < num_symbols; i++) {
+        if (symbols[i].name >= image->sizes[BC_SECTION_STRINGS]) continue;
+        const char *symbol_name = strings + symbols[i].name;
+        if (strncmp(symbol_name, name, image->sizes[BC_SECTION_STRINGS] - symbols[i].name) == 0) {
+            return &symbols[i];
+        }
+    }
+    return NULL;
+}
+
+// Runs the image's code with its sections as the memory regions verified code may access
+void vm_init_image(VM *vm, BCImage *image) {
+    vm_add_region(vm, image->sections[BC_SECTION_CONSTANTS], image->sizes[BC_SECTION_CONSTANTS], false);
+    vm_add_region(vm, image->sections[BC_SECTION_DATA], image->sizes[BC_SECTION_DATA], true);
+    vm_add_region(vm, image->sections[BC_SECTION_RODATA], image->sizes[BC_SECTION_RODATA], false);
+    vm_init_code(vm, image->sections[BC_SECTION_CODE], image->sizes[BC_SECTION_CODE],
+                 image->header->highest_register);
+}
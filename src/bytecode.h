@@ -4,16 +4,109 @@
 
 // checker.h
 typedef union Val Val;
+typedef struct Sym Sym;
+
+// types.h
+typedef struct Ty Ty;
+
+// package.h
+typedef struct Package Package;
+
+typedef enum Opcode Opcode;
+enum Opcode {
+//| Name | Opcode | Description                          |
+//+------+--------+--------------------------------------+
+    HLT  = 0x00,
+    NOP  = 0x01,
+    ADD  = 0x02, // X = Y + Z
+    ADDF = 0x03,
+    SUB  = 0x04, // X = Y - Z
+    SUBF = 0x05,
+    MUL  = 0x06, // X = Y * Z
+    MULF = 0x07,
+    DIV  = 0x08, // X = Y / Z
+    DIVF = 0x09,
+    MOD  = 0x0A, // X = Y % Z
+    XOR  = 0x0B, // X = Y ^ Z
+    AND  = 0x0C, // X = Y & Z
+    OR   = 0x0D, // X = Y | Z
+    SHL  = 0x0E, // X = Y << Z
+    SHR  = 0x0F, // X = Y >> Z
+
+    LD1  = 0x10, // X = *(Y + Z)
+    ST1  = 0x11, // *(X + Y) = Z
+    LD2  = 0x12,
+    ST2  = 0x13,
+    LD4  = 0x14,
+    ST4  = 0x15,
+    LD8  = 0x16,
+    ST8  = 0x17,
+    LD8ADD = 0x18, // X = X + *(Y + Z)
+
+    MOV  = 0x20, // Y = Z
+    FTOI = 0x21, // Y = ftoi(Z)
+    ITOF = 0x22, // Y = itof(Z)
+    PUSH = 0x23, // *(--sp) = Z
+    POP  = 0x24, // Z = *(sp++)
+    CALL = 0x25, // window = &X; window.rip = rip; window.rfp = frame; rip += Z
+    RET  = 0x26, // rip = window.rip; window = window.rfp
+    CMP  = 0x27, // flgs = Y - Z
+    ADDI = 0x28, // X = X + Z
+    CALLF = 0x29, // window = &X; window.r4 = foreigns[Z](window.r4...)
+
+    JMP  = 0x30, // rip += Z
+    JE   = 0x31, // if(flgs == 0) rip += Z
+    JNE  = 0x32, // if(flgs != 0) rip += Z
+    JL   = 0x33, // if(flgs <  0) rip += Z
+    JLE  = 0x34, // if(flgs <= 0) rip += Z
+    JG   = 0x35, // if(flgs >  0) rip += Z
+    JGE  = 0x36, // if(flgs >= 0) rip += Z
+
+    // Superinstructions, formed by bc_optimize. X is a signed displacement relative to rip
+    CMPJE  = 0x40, // flgs = Y - Z; if(flgs == 0) rip += X
+    CMPJNE = 0x41, // flgs = Y - Z; if(flgs != 0) rip += X
+    CMPJL  = 0x42, // flgs = Y - Z; if(flgs <  0) rip += X
+    CMPJLE = 0x43, // flgs = Y - Z; if(flgs <= 0) rip += X
+    CMPJG  = 0x44, // flgs = Y - Z; if(flgs >  0) rip += X
+    CMPJGE = 0x45, // flgs = Y - Z; if(flgs >= 0) rip += X
+
+    // Vector instructions, X, Y & Z name vector registers operated on lane-wise
+    VADDF32 = 0x50, // X = Y + Z
+    VSUBF32 = 0x51, // X = Y - Z
+    VMULF32 = 0x52, // X = Y * Z
+    VDIVF32 = 0x53, // X = Y / Z
+    VADDF64 = 0x54,
+    VSUBF64 = 0x55,
+    VMULF64 = 0x56,
+    VDIVF64 = 0x57,
+    VADDI32 = 0x58,
+    VSUBI32 = 0x59,
+    VMULI32 = 0x5A,
+    VADDI64 = 0x5B,
+    VSUBI64 = 0x5C,
+    VMULI64 = 0x5D,
+    VSHUF   = 0x5E, // X.lane[i] = Y.lane[(Z >> 3i) & 7] for each of the 8 32 bit lanes
+
+    // Vector loads & stores, X names a vector register and Y & Z the address as scalar loads
+    VLD16 = 0x60, // X = *(Y + Z), 128 bits into the low half
+    VST16 = 0x61, // *(Y + Z) = X, 128 bits from the low half
+    VLD32 = 0x62, // X = *(Y + Z)
+    VST32 = 0x63, // *(Y + Z) = X
+
+    AST  = 0xA5,
+};
 
 typedef struct BCOperand BCOperand;
 struct BCOperand {
     bool is_immediate;
     Val val;
+    bool is_address; // made by bc_address, its immediate is relocated when the program is written
 };
 
 typedef struct BCBlock BCBlock;
 struct BCBlock {
     u8 *code;
+    u64 *address_sites; // arr, offsets in code of the immediates encoded from bc_address operands
 };
 
 typedef struct BCBuilder BCBuilder;
@@ -21,17 +114,245 @@ struct BCBuilder {
     BCBlock *block;
 };
 
+typedef struct VMInst VMInst;
+
+typedef struct VMRegion VMRegion;
+struct VMRegion {
+    u8 *base;
+    u64 size;
+    bool writable;
+};
+
+typedef struct BCPairCounts BCPairCounts;
+struct BCPairCounts {
+    u64 total;
+    u64 counts[256][256]; // indexed by the first then second opcode of each pair executed
+};
+
+/*
+ Filled in by vm_interp when set on a VM. The per instruction arrays are indexed as vm->insts and
+ are sized on the first run, a profile may be reused to accumulate over several runs of the same code.
+ A frame is entered at the start of vm_interp and by every CALL, its time is attributed to the
+ instruction it was entered at until it returns or execution stops.
+*/
+typedef struct VMProfileFrame VMProfileFrame;
+struct VMProfileFrame {
+    u32 entry; // instruction the frame was entered at
+    u64 start; // time_nanoseconds when it was entered
+};
+
+typedef struct VMProfile VMProfile;
+struct VMProfile {
+    u64 total;          // instructions executed
+    u64 nanoseconds;    // spent inside vm_interp
+    u64 *counts;        // arr, times each instruction was executed
+    u64 *taken;         // arr, times each branch instruction jumped
+    u64 *frame_calls;   // arr, frames entered at each instruction
+    u64 *frame_nanoseconds; // arr, time spent in frames entered at each instruction, callees included
+    VMProfileFrame *open_frames; // arr, frames not yet returned from, only used while running
+};
+
+/*
+ Foreign functions are called through a trampoline generated for their signature. A trampoline loads
+ the arguments into registers and onto the stack as the host's C calling convention (SysV x86-64)
+ has them, calls the function and returns its result widened to 64 bits, f32 converted to f64.
+*/
+typedef enum BCArgKind {
+    BC_ARG_VOID,
+    BC_ARG_I8,
+    BC_ARG_U8,
+    BC_ARG_I16,
+    BC_ARG_U16,
+    BC_ARG_I32,
+    BC_ARG_U32,
+    BC_ARG_I64, // pointers too
+    BC_ARG_F32,
+    BC_ARG_F64,
+} BCArgKind;
+
+#define BC_MAX_FOREIGN_ARGS 16
+
+typedef struct BCSignature BCSignature;
+struct BCSignature {
+    u8 num_args;
+    u8 args[BC_MAX_FOREIGN_ARGS]; // BCArgKind
+    u8 result;                    // BCArgKind
+};
+
+typedef u64 (*VMTrampoline)(void *function, Val *args);
+
+typedef struct VMForeign VMForeign;
+struct VMForeign {
+    const char *name;
+    void *address;
+    BCSignature signature;
+    VMTrampoline trampoline; // shared by every function with the same signature
+};
+
+/*
+ Calls run in register windows on the VM stack. CALL x, target starts the callee's window at the
+ caller's register x, so the caller's x+4 onwards are the callee's r4 onwards: arguments are passed
+ and results returned in them without copying. The callee's rzo, rip and rfp link it to the caller;
+ rzo is cleared, rip holds the instruction to return to and rfp the index into stack of the caller's
+ window. Every register of the caller from x on is clobbered by a call. RET from the root frame stops
+ execution as HLT does. CALLF x, index calls vm->foreigns[index] the same way, its arguments taken
+ from and result returned in the caller's x+4 onwards.
+
+ Windows grow up from the bottom of the stack and pushed values down from the top, a call or push
+ that would make them meet faults as does nesting calls deeper than max_depth.
+*/
+#define VM_STACK_SIZE (64 * 1024)
+#define VM_MAX_CALL_DEPTH 1024
+
+/*
+ Vector registers are 256 bits wide and live apart from the register windows, every frame shares the
+ same VM_NUM_VREGS of them. Vector arithmetic always operates on all lanes of the full 256 bits, a
+ 128 bit load fills the low half and clears the high half.
+*/
+#define VM_NUM_VREGS 16
+
+typedef union VMVec VMVec;
+union VMVec {
+    u8  bytes[32];
+    f32 f32s[8];
+    f64 f64s[4];
+    u32 u32s[8];
+    u64 u64s[4];
+};
+
+/*
+ Verified code run with a VMCompiler is tiered. Every call target, return site and loop header
+ counts how often execution reaches it and once that reaches tier_threshold the compiler is asked for
+ native code entered there from then on. vm_tier_region describes the code reachable from the entry
+ for it to translate. Native code works on the same register window and flags as the interpreter,
+ returning the index of the instruction to resume interpreting at when it reaches one it doesn't
+ handle. Faults are left to the interpreter: native code returns at the instruction that would fault.
+*/
 typedef struct VM VM;
+
+typedef u32 (*VMNative)(Val *r, i64 *flgs, VM *vm);
+typedef VMNative (*VMCompiler)(VM *vm, u32 entry); // returns NULL when the code can't be compiled
+
+#define VM_TIER_THRESHOLD 1000
+
+typedef struct VMTierInst VMTierInst;
+struct VMTierInst {
+    u32 index;    // into vm->insts
+    i16 opcode;   // specialised from, -1 for a guard of the access the next instruction makes
+    u8 regs;      // which of X, Y & Z (0x1, 0x2 & 0x4) name registers, the rest are immediates
+    bool exit;    // not handled by native code, which returns index to interpret it
+    u32 x;        // register or the target index of a compare and branch
+    Val y;
+    Val z;        // register, immediate or the target index of a branch
+};
+
 struct VM {
     u8 *code;
-    u8 *ip;
-    Val *registers;
-    Val *stack;
-    u64 flgs;
+    u64 code_size;
+    VMInst *insts; // arr, decoded from code by vm_init
+    u32 *offsets;  // arr, byte offset into code of each of insts
+    Val *registers;    // the root frame's window, at the bottom of stack
+    u32 num_registers; // in every window
+    Val *stack;        // VM_STACK_SIZE values, allocated by the first vm_init
+    u64 sp;            // index into stack of the last value pushed, VM_STACK_SIZE when empty
+    u32 max_depth;     // of nested calls, VM_MAX_CALL_DEPTH when 0
+    VMVec vregs[VM_NUM_VREGS];
+    VMForeign *foreigns; // arr, functions CALLF may call, added by vm_add_foreign
+    i64 flgs;
+    VMRegion *regions; // arr, memory verified code may access
+    bool verified;     // set by vm_verify, verified code runs without per instruction checks
+    BCPairCounts *pairs; // when set vm_interp counts the pairs of opcodes executed into it
+    VMProfile *profile;  // when set vm_interp profiles execution into it
+    VMCompiler compile;  // when set verified code is tiered, hot code running natively
+    u32 tier_threshold;  // VM_TIER_THRESHOLD when 0
+    VMNative *natives;   // arr, native code entered at each instruction
+    u32 *heat;           // arr, times execution entered each instruction through a call, return or loop
 };
 
 typedef u32 Reg;
 
+/*
+ Bytecode programs are stored in a single file which is mapped into memory as is. The file starts
+ with a BCFileHeader followed by each section in BCSection order, every one aligned to 16 bytes.
+
+ Addresses within a program are laid out against the header's base and the loader maps the file
+ there, so when that address is free nothing needs to be fixed up. Otherwise every 8 byte address
+ listed in the relocations section is adjusted by the difference, including the address immediates
+ of instructions in the code section, which are patched in place. Those are the immediates encoded
+ from bc_address operands, recorded by the builder as they're emitted.
+ */
+
+#define BC_FILE_MAGIC 0x0043424B // "KBC\0"
+#define BC_FILE_VERSION 1
+#define BC_FILE_ALIGN 16
+#define BC_DEFAULT_BASE 0x4B4200000000ull
+
+typedef enum BCSection {
+    BC_SECTION_CODE,
+    BC_SECTION_CONSTANTS, // Val
+    BC_SECTION_DATA,
+    BC_SECTION_RODATA,
+    BC_SECTION_SYMBOLS,   // BCSymbol
+    BC_SECTION_STRINGS,   // nul terminated symbol names
+    BC_SECTION_RELOCS,    // BCReloc
+    NUM_BC_SECTIONS,
+} BCSection;
+
+typedef struct BCFileSection BCFileSection;
+struct BCFileSection {
+    u64 offset; // from the start of the file
+    u64 size;
+};
+
+typedef struct BCFileHeader BCFileHeader;
+struct BCFileHeader {
+    u32 magic;
+    u32 version;
+    u64 base; // address the file was laid out to be mapped at
+    u64 size;
+    u32 highest_register;
+    u32 num_sections;
+    BCFileSection sections[NUM_BC_SECTIONS];
+};
+
+typedef struct BCSymbol BCSymbol;
+struct BCSymbol {
+    u32 name; // offset into the strings section
+    u32 section;
+    u64 offset;
+    u64 size;
+};
+
+typedef struct BCReloc BCReloc;
+struct BCReloc {
+    u32 section; // holding the address
+    u32 target;  // section addressed
+    u64 offset;
+};
+
+typedef struct BytecodeProgram BytecodeProgram;
+struct BytecodeProgram {
+    Package *package;
+    u8 *code;
+    u8 *data;
+    u8 *rodata;
+    Val *constants;
+    BCSymbol *symbols;
+    char *strings;
+    u64 *code_sites; // arr, offsets of the addresses within code, the address_sites of its BCBlock
+    BCReloc *relocs; // addresses stored within data or rodata by bc_add_pointer
+};
+
+typedef struct BCImage BCImage;
+struct BCImage {
+    u8 *base;
+    u64 size;
+    BCFileHeader *header;
+    u8 *sections[NUM_BC_SECTIONS];
+    u64 sizes[NUM_BC_SECTIONS];
+    bool relocated; // wasn't mapped at the header's base so addresses were adjusted
+};
+
 #define RZ0 ((BCOperand) {0})
 #define RIP 0x1
 #define RFP 0x2
@@ -66,8 +387,10 @@ void e_ftoi(BCBuilder *b, Reg y, BCOperand z);
 void e_itof(BCBuilder *b, Reg y, BCOperand z);
 void e_push(BCBuilder *b, BCOperand z);
 void e_pop (BCBuilder *b, Reg z);
-void e_call(BCBuilder *b, BCOperand z);
+void e_ast (BCBuilder *b, BCOperand z);
+void e_call(BCBuilder *b, Reg base, BCOperand z);
 void e_ret (BCBuilder *b);
+void e_callf(BCBuilder *b, Reg base, u32 index);
 void e_cmp (BCBuilder *b, BCOperand y, BCOperand z);
 void e_jmp (BCBuilder *b, BCOperand z);
 void e_je  (BCBuilder *b, BCOperand z);
@@ -77,11 +400,78 @@ void e_jle (BCBuilder *b, BCOperand z);
 void e_jg  (BCBuilder *b, BCOperand z);
 void e_jge (BCBuilder *b, BCOperand z);
 
+void e_ld8add(BCBuilder *b, Reg x, BCOperand y, BCOperand z);
+void e_addi  (BCBuilder *b, Reg x, BCOperand z);
+void e_cmpje (BCBuilder *b, i32 x, BCOperand y, BCOperand z);
+void e_cmpjne(BCBuilder *b, i32 x, BCOperand y, BCOperand z);
+void e_cmpjl (BCBuilder *b, i32 x, BCOperand y, BCOperand z);
+void e_cmpjle(BCBuilder *b, i32 x, BCOperand y, BCOperand z);
+void e_cmpjg (BCBuilder *b, i32 x, BCOperand y, BCOperand z);
+void e_cmpjge(BCBuilder *b, i32 x, BCOperand y, BCOperand z);
+
+// Vector instructions, X, Y & Z name vector registers except for the address operands of loads & stores
+void e_vaddf32(BCBuilder *b, Reg x, Reg y, Reg z);
+void e_vsubf32(BCBuilder *b, Reg x, Reg y, Reg z);
+void e_vmulf32(BCBuilder *b, Reg x, Reg y, Reg z);
+void e_vdivf32(BCBuilder *b, Reg x, Reg y, Reg z);
+void e_vaddf64(BCBuilder *b, Reg x, Reg y, Reg z);
+void e_vsubf64(BCBuilder *b, Reg x, Reg y, Reg z);
+void e_vmulf64(BCBuilder *b, Reg x, Reg y, Reg z);
+void e_vdivf64(BCBuilder *b, Reg x, Reg y, Reg z);
+void e_vaddi32(BCBuilder *b, Reg x, Reg y, Reg z);
+void e_vsubi32(BCBuilder *b, Reg x, Reg y, Reg z);
+void e_vmuli32(BCBuilder *b, Reg x, Reg y, Reg z);
+void e_vaddi64(BCBuilder *b, Reg x, Reg y, Reg z);
+void e_vsubi64(BCBuilder *b, Reg x, Reg y, Reg z);
+void e_vmuli64(BCBuilder *b, Reg x, Reg y, Reg z);
+void e_vshuf  (BCBuilder *b, Reg x, Reg y, u32 lanes);
+void e_vld16  (BCBuilder *b, Reg x, BCOperand y, BCOperand z);
+void e_vst16  (BCBuilder *b, Reg x, BCOperand y, BCOperand z);
+void e_vld32  (BCBuilder *b, Reg x, BCOperand y, BCOperand z);
+void e_vst32  (BCBuilder *b, Reg x, BCOperand y, BCOperand z);
+
+// Packs the 32 bit lane of Y each lane of X is taken from for VSHUF
+#define VM_SHUFFLE(l0, l1, l2, l3, l4, l5, l6, l7) \
+    ((l0) | (l1) << 3 | (l2) << 6 | (l3) << 9 | (l4) << 12 | (l5) << 15 | (l6) << 18 | (l7) << 21)
+
 BCOperand imm(u64 val);
 BCOperand imf(f64 val);
 BCOperand reg(u32 reg);
 
 void vm_init(VM *vm, u8 *code, u32 highest_register);
-void vm_interp(VM *vm);
+void vm_init_code(VM *vm, u8 *code, u64 code_size, u32 highest_register);
+void vm_init_image(VM *vm, BCImage *image);
+void vm_add_region(VM *vm, void *base, u64 size, bool writable);
+bool vm_verify(VM *vm);
+bool vm_interp(VM *vm);
 void vm_dump(VM *vm);
+void vm_dump_pairs(BCPairCounts *pairs, u32 max);
+void vm_report_profile(VM *vm, u32 max);
+i64 vm_add_foreign(VM *vm, const char *name, void *address, BCSignature signature);
+i64 vm_add_foreign_sym(VM *vm, Sym *sym, const char **libraries);
+bool bc_foreign_signature(Ty *type, BCSignature *signature);
+void *bc_foreign_address(const char *name, const char **libraries);
+void vm_free_profile(VMProfile *profile);
+VMTierInst *vm_tier_region(VM *vm, u32 entry);
+bool vm_region_contains(VM *vm, u64 addr, u64 size, bool write);
+bool bc_is_store(u8 opcode);
+bool bc_addresses_xy(u8 opcode);
+u64 bc_access_size(u8 opcode);
+
+bool bc_optimize(BCBlock *block, BCPairCounts *pairs);
+bool bc_allocate_registers(BCBlock *block, u32 num_fixed, u32 *highest_register);
+
+BCOperand bc_address(BCSection section, u64 offset);
+u64 bc_add_data(BytecodeProgram *program, BCSection section, const void *bytes, u64 size, u64 align);
+u64 bc_add_constant(BytecodeProgram *program, Val val);
+void bc_add_symbol(BytecodeProgram *program, const char *name, BCSection section, u64 offset, u64 size);
+void bc_add_pointer(BytecodeProgram *program, BCSection section, u64 offset, BCSection target, u64 target_offset);
+bool bc_write_program(BytecodeProgram *program, const char *path);
+bool bc_load_program(const char *path, BCImage *image);
+void bc_unload_program(BCImage *image);
+BCSymbol *bc_find_symbol(BCImage *image, const char *name);
+
+void disassemble(u8 *code, const char *name);
+void disassemble_at(u8 *code, u64 len, const char *name, i64 mark);
+i32 disassemble_inst(u8 *code, u64 len, u64 offset);
 
@@ -0,0 +1,378 @@
+// The body of the interpreter, included by bytecode.c once for every variant of it
+// Requires VM_INTERP_NAME to be the function name to define
+// Requires VM_INTERP_CHECKED to be 1 when every instruction should be checked before it is
+//   executed and 0 when only running code vm_verify has accepted
+// Requires VM_INTERP_PAIRS to be 1 when the opcode pairs executed are counted into vm->pairs
+// Requires VM_INTERP_PROFILE to be 1 when execution is profiled into vm->profile, not with pairs
+// Requires VM_INTERP_TIERED to be 1 when hot code is compiled with vm->compile, only for verified code
+
+bool VM_INTERP_NAME(VM *vm) {
+    VMInst *insts = vm->insts;
+    VMInst *in = insts;
+    u64 num_insts = arrlen(insts);
+    Val *r = vm->registers;
+    Val *stack = vm->stack;
+    VMVec *vregs = vm->vregs;
+    u64 sp = vm->sp;
+    u64 num_registers = vm->num_registers;
+    u32 depth = 0;
+    u32 max_depth = vm->max_depth ? vm->max_depth : VM_MAX_CALL_DEPTH;
+    i64 flgs = vm->flgs;
+    bool ok = true;
+#if VM_INTERP_CHECKED
+#define PRECHECK() if (!vm_registers_ok(in, num_registers)) FAULT("Register out of range")
+#define WINDOWCHECK() if (in->x <= RSP) FAULT("Call window must start above rsp")
+#define FOREIGNCHECK() if (in->z.u >= arrlen(vm->foreigns)) FAULT("Foreign function is not defined")
+#else
+#define PRECHECK()
+#define WINDOWCHECK()
+#define FOREIGNCHECK()
+#endif
+#if VM_INTERP_PAIRS
+    BCPairCounts *pairs = vm->pairs;
+    i32 prev = -1;
+#define COUNT() do { \
+    i32 opcode = vm_op_opcode[in->op]; \
+    if (opcode < 0) break; \
+    if (prev >= 0) { pairs->counts[prev][opcode]++; pairs->total++; } \
+    prev = opcode; \
+} while (0)
+#elif VM_INTERP_PROFILE
+    VMProfile *profile = vm->profile;
+    if (arrlen(profile->counts) != num_insts) {
+        VMProfile empty = {0};
+        vm_free_profile(profile);
+        *profile = empty;
+        arraddn(profile->counts, num_insts);
+        arraddn(profile->taken, num_insts);
+        arraddn(profile->frame_calls, num_insts);
+        arraddn(profile->frame_nanoseconds, num_insts);
+        memset(profile->counts, 0, num_insts * sizeof *profile->counts);
+        memset(profile->taken, 0, num_insts * sizeof *profile->taken);
+        memset(profile->frame_calls, 0, num_insts * sizeof *profile->frame_calls);
+        memset(profile->frame_nanoseconds, 0, num_insts * sizeof *profile->frame_nanoseconds);
+    }
+    u64 run_start = time_nanoseconds();
+#define COUNT() do { profile->counts[in - insts]++; profile->total++; } while (0)
+#define TAKEN() profile->taken[in - insts]++
+#define ENTER(index) do { \
+    VMProfileFrame frame = { (index), time_nanoseconds() }; \
+    arrpush(profile->open_frames, frame); \
+    profile->frame_calls[frame.entry]++; \
+} while (0)
+#define LEAVE() do { \
+    VMProfileFrame frame = arrpop(profile->open_frames); \
+    profile->frame_nanoseconds[frame.entry] += time_nanoseconds() - frame.start; \
+} while (0)
+    ENTER(0);
+#else
+#define COUNT()
+#endif
+#if !VM_INTERP_PROFILE
+#define TAKEN()
+#define ENTER(index)
+#define LEAVE()
+#endif
+#if VM_INTERP_TIERED
+    if (arrlen(vm->natives) != num_insts) {
+        arrsetlen(vm->natives, num_insts);
+        arrsetlen(vm->heat, num_insts);
+        memset(vm->natives, 0, num_insts * sizeof *vm->natives);
+        memset(vm->heat, 0, num_insts * sizeof *vm->heat);
+    }
+    VMNative *natives = vm->natives;
+    u32 *heat = vm->heat;
+    u32 threshold = vm->tier_threshold ? vm->tier_threshold : VM_TIER_THRESHOLD;
+// Continues at index, through its native code when there is some, compiling it once it becomes hot
+#define HOT(index) { \
+    u32 hot = (u32) (index); \
+    if (!natives[hot] && ++heat[hot] == threshold) natives[hot] = vm_tier_up(vm, hot); \
+    if (natives[hot]) hot = natives[hot](r, &flgs, vm); \
+    JUMP(hot); \
+}
+#define BACKEDGE(index) if ((index) <= (u64) (in - insts)) HOT(index)
+#else
+#define HOT(index) JUMP(index)
+#define BACKEDGE(index)
+#endif
+
+#if VM_THREADED_DISPATCH
+    static void *dispatch[NUM_VM_OPS] = {
+#define VM_LABEL(name) &&L_##name,
+        VM_OPS(VM_LABEL)
+#undef VM_LABEL
+    };
+#define CASE(name) L_##name:
+#define DISPATCH() do { PRECHECK(); COUNT(); goto *dispatch[in->op]; } while (0)
+#else
+#define CASE(name) case VM_##name:
+#define DISPATCH() continue
+#endif
+#define NEXT() in++; DISPATCH()
+#define JUMP(index) in = insts + (index); DISPATCH()
+#define FAULT(msg) do { vm_fault(vm, (u32) (in - insts), msg); ok = false; goto end; } while (0)
+
+#define RX r[in->x]
+#define RY r[in->y.u]
+#define RZ r[in->z.u]
+#define IY in->y
+#define IZ in->z
+
+#define BINARY(NAME, F, OP) \
+    CASE(NAME##_RR) RX.F = RY.F OP RZ.F; NEXT(); \
+    CASE(NAME##_RI) RX.F = RY.F OP IZ.F; NEXT(); \
+    CASE(NAME##_IR) RX.F = IY.F OP RZ.F; NEXT(); \
+    CASE(NAME##_II) RX.F = IY.F OP IZ.F; NEXT();
+
+// Only the low 6 bits of the count are used, shifting an u64 by 64 or more is undefined in C
+#define SHIFT(NAME, OP) \
+    CASE(NAME##_RR) RX.u = RY.u OP (RZ.u & 63); NEXT(); \
+    CASE(NAME##_RI) RX.u = RY.u OP (IZ.u & 63); NEXT(); \
+    CASE(NAME##_IR) RX.u = IY.u OP (RZ.u & 63); NEXT(); \
+    CASE(NAME##_II) RX.u = IY.u OP (IZ.u & 63); NEXT();
+
+#define DIVISION(NAME, OP) \
+    CASE(NAME##_RR) if (!RZ.u) FAULT("Division by zero"); RX.u = RY.u OP RZ.u; NEXT(); \
+    CASE(NAME##_RI) if (!IZ.u) FAULT("Division by zero"); RX.u = RY.u OP IZ.u; NEXT(); \
+    CASE(NAME##_IR) if (!RZ.u) FAULT("Division by zero"); RX.u = IY.u OP RZ.u; NEXT(); \
+    CASE(NAME##_II) if (!IZ.u) FAULT("Division by zero"); RX.u = IY.u OP IZ.u; NEXT();
+
+#define LOAD(NAME, T) \
+    CASE(NAME##_RR) { T v; memcpy(&v, (u8 *) RY.p + RZ.i, sizeof v); RX.u = v; NEXT(); } \
+    CASE(NAME##_RI) { T v; memcpy(&v, (u8 *) RY.p + IZ.i, sizeof v); RX.u = v; NEXT(); } \
+    CASE(NAME##_IR) { T v; memcpy(&v, (u8 *) IY.p + RZ.i, sizeof v); RX.u = v; NEXT(); } \
+    CASE(NAME##_II) { T v; memcpy(&v, (u8 *) IY.p + IZ.i, sizeof v); RX.u = v; NEXT(); }
+
+#define STORE(NAME, T) \
+    CASE(NAME##_RR) { T v = (T) RZ.u; memcpy((u8 *) RX.p + RY.i, &v, sizeof v); NEXT(); } \
+    CASE(NAME##_RI) { T v = (T) IZ.u; memcpy((u8 *) RX.p + RY.i, &v, sizeof v); NEXT(); } \
+    CASE(NAME##_IR) { T v = (T) RZ.u; memcpy((u8 *) RX.p + IY.i, &v, sizeof v); NEXT(); } \
+    CASE(NAME##_II) { T v = (T) IZ.u; memcpy((u8 *) RX.p + IY.i, &v, sizeof v); NEXT(); }
+
+// Only unverified code may contain register branches, their target is found when taken
+#define BRANCH(NAME, COND) \
+    CASE(NAME##_R) if (COND) { \
+        u32 index = vm_inst_index(vm, IY.u + RZ.i); \
+        if (index == arrlen(vm->insts)) FAULT("Branch target is not an instruction"); \
+        TAKEN(); \
+        JUMP(index); \
+    } NEXT(); \
+    CASE(NAME##_I) if (COND) { TAKEN(); BACKEDGE(IZ.u); JUMP(IZ.u); } NEXT();
+
+// Links a window for the callee starting at register X, the caller's registers from there on are its
+#define FRAME(index) \
+    WINDOWCHECK(); \
+    Val *window = r + in->x; \
+    if (window + num_registers > stack + sp) FAULT("Stack overflow"); \
+    if (depth == max_depth) FAULT("Calls nested too deeply"); \
+    window[0].u = 0; \
+    window[RIP].u = (in - insts) + 1; \
+    window[RFP].u = r - stack; \
+    r = window; \
+    depth++; \
+    ENTER(index);
+
+#define VECTOR(NAME, FN) CASE(NAME) vm_##FN(vregs + in->x, vregs + in->y.u, vregs + in->z.u); NEXT();
+
+#define VLOAD(NAME, SIZE) \
+    CASE(NAME##_RR) vm_vload(vregs + in->x, (u8 *) RY.p + RZ.i, SIZE); NEXT(); \
+    CASE(NAME##_RI) vm_vload(vregs + in->x, (u8 *) RY.p + IZ.i, SIZE); NEXT(); \
+    CASE(NAME##_IR) vm_vload(vregs + in->x, (u8 *) IY.p + RZ.i, SIZE); NEXT(); \
+    CASE(NAME##_II) vm_vload(vregs + in->x, (u8 *) IY.p + IZ.i, SIZE); NEXT();
+
+#define VSTORE(NAME, SIZE) \
+    CASE(NAME##_RR) memcpy((u8 *) RY.p + RZ.i, vregs + in->x, SIZE); NEXT(); \
+    CASE(NAME##_RI) memcpy((u8 *) RY.p + IZ.i, vregs + in->x, SIZE); NEXT(); \
+    CASE(NAME##_IR) memcpy((u8 *) IY.p + RZ.i, vregs + in->x, SIZE); NEXT(); \
+    CASE(NAME##_II) memcpy((u8 *) IY.p + IZ.i, vregs + in->x, SIZE); NEXT();
+
+// Comparisons subtract wrapping, as the JIT does, rather than overflowing an i64
+#define CMPJ(NAME, COND) \
+    CASE(NAME##_RR) flgs = (i64) (RY.u - RZ.u); if (COND) { TAKEN(); BACKEDGE(in->x); JUMP(in->x); } NEXT(); \
+    CASE(NAME##_RI) flgs = (i64) (RY.u - IZ.u); if (COND) { TAKEN(); BACKEDGE(in->x); JUMP(in->x); } NEXT(); \
+    CASE(NAME##_IR) flgs = (i64) (IY.u - RZ.u); if (COND) { TAKEN(); BACKEDGE(in->x); JUMP(in->x); } NEXT(); \
+    CASE(NAME##_II) flgs = (i64) (IY.u - IZ.u); if (COND) { TAKEN(); BACKEDGE(in->x); JUMP(in->x); } NEXT();
+
+#if VM_THREADED_DISPATCH
+    DISPATCH();
+#else
+    for (;;) { PRECHECK(); COUNT(); switch (in->op) {
+#endif
+    CASE(HLT) goto end;
+    CASE(NOP) NEXT();
+    CASE(RET) {
+        if (!depth) goto end; // returning from the root frame
+        u64 index = r[RIP].u;
+        u64 caller = r[RFP].u;
+        if (index >= num_insts || caller >= (u64) (r - stack)) FAULT("Return through a corrupt frame");
+        r = stack + caller;
+        depth--;
+        LEAVE();
+        HOT(index);
+    }
+    CASE(POP)
+        if (sp == VM_STACK_SIZE) FAULT("Pop from an empty stack");
+        RX = stack[sp++];
+        NEXT();
+    CASE(GUARD) if (!vm_access_ok(vm, r, in + 1)) FAULT("Memory access outside of any region"); NEXT();
+    CASE(BAD) FAULT("Invalid instruction");
+
+    BINARY(ADD,  u, +)
+    BINARY(ADDF, f, +)
+    BINARY(SUB,  u, -)
+    BINARY(SUBF, f, -)
+    BINARY(MUL,  u, *)
+    BINARY(MULF, f, *)
+    DIVISION(DIV, /)
+    BINARY(DIVF, f, /)
+    DIVISION(MOD, %)
+    BINARY(XOR,  u, ^)
+    BINARY(AND,  u, &)
+    BINARY(OR,   u, |)
+    SHIFT(SHL, <<)
+    SHIFT(SHR, >>)
+
+    LOAD(LD1, u8)
+    LOAD(LD2, u16)
+    LOAD(LD4, u32)
+    LOAD(LD8, u64)
+    STORE(ST1, u8)
+    STORE(ST2, u16)
+    STORE(ST4, u32)
+    STORE(ST8, u64)
+
+    CASE(LD8ADD_RR) { u64 v; memcpy(&v, (u8 *) RY.p + RZ.i, sizeof v); RX.u += v; NEXT(); }
+    CASE(LD8ADD_RI) { u64 v; memcpy(&v, (u8 *) RY.p + IZ.i, sizeof v); RX.u += v; NEXT(); }
+    CASE(LD8ADD_IR) { u64 v; memcpy(&v, (u8 *) IY.p + RZ.i, sizeof v); RX.u += v; NEXT(); }
+    CASE(LD8ADD_II) { u64 v; memcpy(&v, (u8 *) IY.p + IZ.i, sizeof v); RX.u += v; NEXT(); }
+    CASE(ADDI_R) RX.u += RZ.u; NEXT();
+    CASE(ADDI_I) RX.u += IZ.u; NEXT();
+
+    CASE(CMP_RR) flgs = (i64) (RY.u - RZ.u); NEXT();
+    CASE(CMP_RI) flgs = (i64) (RY.u - IZ.u); NEXT();
+    CASE(CMP_IR) flgs = (i64) (IY.u - RZ.u); NEXT();
+    CASE(CMP_II) flgs = (i64) (IY.u - IZ.u); NEXT();
+
+    CASE(MOV_R)  RX = RZ; NEXT();
+    CASE(MOV_I)  RX = IZ; NEXT();
+    CASE(FTOI_R) RX.i = (i64) RZ.f; NEXT();
+    CASE(FTOI_I) RX.i = (i64) IZ.f; NEXT();
+    CASE(ITOF_R) RX.f = (f64) RZ.i; NEXT();
+    CASE(ITOF_I) RX.f = (f64) IZ.i; NEXT();
+    CASE(PUSH_R) if (stack + sp == r + num_registers) FAULT("Stack overflow"); stack[--sp] = RZ; NEXT();
+    CASE(PUSH_I) if (stack + sp == r + num_registers) FAULT("Stack overflow"); stack[--sp] = IZ; NEXT();
+    CASE(AST_R)  if (!RZ.u) FAULT("Assertion failed"); NEXT();
+    CASE(AST_I)  if (!IZ.u) FAULT("Assertion failed"); NEXT();
+
+    CASE(CALL_R) {
+        u32 index = vm_inst_index(vm, IY.u + RZ.i);
+        if (index == arrlen(vm->insts)) FAULT("Call target is not an instruction");
+        FRAME(index);
+        JUMP(index);
+    }
+    CASE(CALL_I) { FRAME(IZ.u); HOT(IZ.u); }
+    CASE(CALLF) {
+        WINDOWCHECK();
+        FOREIGNCHECK();
+        VMForeign *foreign = vm->foreigns + in->z.u;
+        Val *args = r + in->x + 4;
+        if (args + MAX(foreign->signature.num_args, 1) > stack + sp) FAULT("Stack overflow");
+        args[0].u = foreign->trampoline(foreign->address, args);
+        NEXT();
+    }
+
+    BRANCH(JMP, true)
+    BRANCH(JE,  flgs == 0)
+    BRANCH(JNE, flgs != 0)
+    BRANCH(JL,  flgs <  0)
+    BRANCH(JLE, flgs <= 0)
+    BRANCH(JG,  flgs >  0)
+    BRANCH(JGE, flgs >= 0)
+
+    CMPJ(CMPJE,  flgs == 0)
+    CMPJ(CMPJNE, flgs != 0)
+    CMPJ(CMPJL,  flgs <  0)
+    CMPJ(CMPJLE, flgs <= 0)
+    CMPJ(CMPJG,  flgs >  0)
+    CMPJ(CMPJGE, flgs >= 0)
+
+    VECTOR(VADDF32, vaddf32)
+    VECTOR(VSUBF32, vsubf32)
+    VECTOR(VMULF32, vmulf32)
+    VECTOR(VDIVF32, vdivf32)
+    VECTOR(VADDF64, vaddf64)
+    VECTOR(VSUBF64, vsubf64)
+    VECTOR(VMULF64, vmulf64)
+    VECTOR(VDIVF64, vdivf64)
+    VECTOR(VADDI32, vaddi32)
+    VECTOR(VSUBI32, vsubi32)
+    VECTOR(VMULI32, vmuli32)
+    VECTOR(VADDI64, vaddi64)
+    VECTOR(VSUBI64, vsubi64)
+    VECTOR(VMULI64, vmuli64)
+    CASE(VSHUF) vm_vshuf(vregs + in->x, vregs + in->y.u, (u32) IZ.u); NEXT();
+
+    VLOAD(VLD16, 16)
+    VLOAD(VLD32, 32)
+    VSTORE(VST16, 16)
+    VSTORE(VST32, 32)
+#if !VM_THREADED_DISPATCH
+    }}
+#endif
+
+#undef VSTORE
+#undef VLOAD
+#undef VECTOR
+#undef CMPJ
+#undef FRAME
+#undef BRANCH
+#undef STORE
+#undef LOAD
+#undef DIVISION
+#undef SHIFT
+#undef BINARY
+#undef IZ
+#undef IY
+#undef RZ
+#undef RY
+#undef RX
+#undef FAULT
+#undef JUMP
+#undef NEXT
+#undef DISPATCH
+#undef CASE
+#undef BACKEDGE
+#undef HOT
+#undef LEAVE
+#undef ENTER
+#undef TAKEN
+#undef COUNT
+#undef FOREIGNCHECK
+#undef WINDOWCHECK
+#undef PRECHECK
+
+end:
+    // Stopping within a call leaves its frames behind, the root window holds where execution stopped
+    vm->flgs = flgs;
+    vm->sp = sp;
+    vm->registers[0].u = 0;
+    u32 offset = vm->offsets[in - insts];
+    vm->registers[RIP].u = MIN(offset + 1, vm->code_size);
+#if VM_INTERP_PROFILE
+    // Frames still open when execution stops end with it
+    u64 run_end = time_nanoseconds();
+    for (i64 i = 0; i < arrlen(profile->open_frames); i++) {
+        VMProfileFrame frame = profile->open_frames[i];
+        profile->frame_nanoseconds[frame.entry] += run_end - frame.start;
+    }
+    arrsetlen(profile->open_frames, 0);
+    profile->nanoseconds += run_end - run_start;
+#endif
+    return ok;
+}
+
+#undef VM_INTERP_TIERED
+#undef VM_INTERP_PROFILE
+#undef VM_INTERP_PAIRS
+#undef VM_INTERP_CHECKED
+#undef VM_INTERP_NAME
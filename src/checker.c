@@ -1322,7 +1322,8 @@ Operand check_stmt_for(Checker *self, Stmt *stmt) {
             Operand aggregate = check_expr(self, stmt->sfor.aggregate, NULL);
             if (ret_operand(aggregate)) return aggregate;
             STATIC_ASSERT(offsetof(Ty, tarray.eltype) == offsetof(Ty, tslice.eltype));
-            if (!is_array(aggregate.type) && !is_slice(aggregate.type)) {
+            STATIC_ASSERT(offsetof(Ty, tarray.eltype) == offsetof(Ty, tvector.eltype));
+            if (!is_array(aggregate.type) && !is_vector(aggregate.type) && !is_slice(aggregate.type)) {
                 error(self, stmt->sfor.aggregate->range, "Cannot iterate over type %s",
                       tyname(aggregate.type));
                 return bad_operand;
@@ -1336,6 +1337,8 @@ Operand check_stmt_for(Checker *self, Stmt *stmt) {
                 Ty *index_type = type_u64;
                 if (is_array(aggregate.type))
                     index_type = smallest_unsigned_int_for_value(aggregate.type->tarray.length);
+                else if (is_vector(aggregate.type))
+                    index_type = smallest_unsigned_int_for_value(aggregate.type->tvector.length);
                 Sym *sym = checker_sym(self, stmt->sfor.index_name, index_type, SYM_VAL);
                 sym->state = SYM_CHECKED;
             }
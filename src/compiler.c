@@ -106,6 +106,8 @@ enum CLIFlagKind {
     CLIFlagKindEnum,
     CLIFlagKindPath,
     CLIFlagKindString,
+    CLIFlagKindInt,
+    CLIFlagKindValue,
 };
 
 typedef struct CLIFlag CLIFlag;
@@ -118,6 +120,7 @@ struct CLIFlag {
     const char *help;
     int nOptions;
     long offs;
+    int value;
 };
 
 CompilerFlags default_flags = {
@@ -130,11 +133,20 @@ CompilerFlags default_flags = {
     .version            = false,
     .help               = false,
     .emit_ir            = false,
+    .emit_obj           = false,
     .emit_header        = false,
     .dump_ir            = false,
     .disable_all_passes = false,
     .debug              = false,
     .link               = true,
+    .run_bytecode       = false,
+    .profile_bytecode   = false,
+    .ct_jit             = false,
+    .cache              = true,
+    .profile_generate   = false,
+    .codegen_threads    = 1,
+    .opt_level          = OPT_LEVEL_2,
+    .lto                = LTO_NONE,
 };
 
 static
@@ -158,6 +170,12 @@ static const char *OutputTypeNames[] = {
 #define FLAG_STRING(NAME, SHORT_NAME, PTR, ARG_NAME, HELP) \
 { CLIFlagKindString, (NAME), (SHORT_NAME), .offs = offsetof(Compiler, PTR), .argumentName = (ARG_NAME), .help = (HELP) }
 
+#define FLAG_INT(NAME, PTR, ARG_NAME, HELP) \
+{ CLIFlagKindInt, (NAME), .offs = offsetof(Compiler, PTR), .argumentName = (ARG_NAME), .help = (HELP) }
+
+#define FLAG_VALUE(NAME, PTR, VALUE, HELP) \
+{ CLIFlagKindValue, (NAME), .offs = offsetof(Compiler, PTR), .value = (VALUE), .help = (HELP) }
+
 CLIFlag CLIFlags[] = {
     FLAG_BOOL("help",    "h",  flags.help,    "Print help information"),
     FLAG_BOOL("version", NULL, flags.version, "Prints compiler version"),
@@ -166,12 +184,28 @@ CLIFlag CLIFlags[] = {
     FLAG_BOOL("disable-all-passes", NULL, flags.disable_all_passes, "Disables all llvm passes"),
     FLAG_BOOL("assertions", NULL, flags.assertions, "Enable extra compiler assersions"),
     FLAG_BOOL("developer", NULL, flags.developer, "Enable developer compiler features"),
-    FLAG_BOOL("small", "-Oz", flags.small, "Optimize for small output"),
+    FLAG_VALUE("O0", flags.opt_level, OPT_LEVEL_0, "Disable optimization, generating code quickly"),
+    FLAG_VALUE("O1", flags.opt_level, OPT_LEVEL_1, "Optimize without slowing compilation much"),
+    FLAG_VALUE("O2", flags.opt_level, OPT_LEVEL_2, "Optimize (default)"),
+    FLAG_VALUE("O3", flags.opt_level, OPT_LEVEL_3, "Optimize aggressively, inlining and vectorizing more"),
+    FLAG_VALUE("Os", flags.opt_level, OPT_LEVEL_SIZE, "Optimize favouring smaller output"),
+    FLAG_BOOL("small", "Oz", flags.small, "Optimize for small output"),
+    FLAG_INT("codegen-threads", flags.codegen_threads, "n", "Split code generation over n threads (default: 1)"),
+    FLAG_VALUE("lto=thin", flags.lto, LTO_THIN, "Optimize across packages with ThinLTO"),
+    FLAG_BOOL("profile-generate", NULL, flags.profile_generate, "Instrument the output to write default.profraw when run"),
+    FLAG_PATH("profile-use", NULL, profile_use_path, "file", "Optimize with the profile merged into file by llvm-profdata"),
+    FLAG_STRING("mcpu", NULL, target_cpu, "cpu", "Target CPU, native for the host's (default: generic)"),
+    FLAG_STRING("march", NULL, target_cpu, "cpu", "Same as -mcpu, -march=native for the host's CPU and features"),
+    FLAG_STRING("mattr", NULL, target_features, "features", "Target features to add or remove, e.g. +avx2,-fma"),
 
     FLAG_BOOL("dump-ir", NULL, flags.dump_ir,  "Dump LLVM IR"),
     FLAG_BOOL("emit-ir", NULL, flags.emit_ir,  "Emit LLVM IR file(s)"),
+    FLAG_BOOL("emit-obj", NULL, flags.emit_obj, "Write object files next to the sources when linking"),
 
     FLAG_BOOL("emit-header", NULL, flags.emit_header, "Emit C header file(s)"),
+    FLAG_BOOL("run-bytecode", NULL, flags.run_bytecode, "Run the input as a bytecode file"),
+    FLAG_BOOL("profile-bytecode", NULL, flags.profile_bytecode, "Report where time is spent running bytecode"),
+    FLAG_BOOL("ct-jit", NULL, flags.ct_jit, "Compile hot bytecode to native code with LLVM as it runs"),
 
     FLAG_BOOL("error-codes",  NULL, flags.error_codes,  "Show error codes along side error location"),
     FLAG_BOOL("error-colors", NULL, flags.error_colors, "Show errors in souce code by highlighting in color"),
@@ -181,9 +215,13 @@ CLIFlag CLIFlags[] = {
 
     FLAG_BOOL("parse-comments", NULL, flags.parse_comments, ""),
     FLAG_BOOL("debug", "g", flags.debug, "Include debug symbols"),
-    FLAG_BOOL("link", NULL, flags.link,  "Link object files"),
+    FLAG_BOOL("link", NULL, flags.link,  "Link object files, with -no-link they are written next to the sources"),
+    FLAG_BOOL("cache", NULL, flags.cache, "Reuse the objects of packages unchanged since cached"),
+    FLAG_BOOL("time-report", NULL, flags.time_report, "Report the time and allocations of each stage and package"),
 
     FLAG_PATH("output", "o", output_name, "file", "Output file (default: <input>)"),
+    FLAG_PATH("cache-dir", NULL, cache_dir, "dir", "Object cache directory (default: ~/.cache/kai)"),
+    FLAG_PATH("time-report-json", NULL, time_report_path, "file", "Write the time report to file as JSON too"),
 
     FLAG_ENUM("os", target_os, OsNames, "Target operating system (default: current)"),
     FLAG_ENUM("arch", target_arch, ArchNames, "Target architecture (default: current)"),
@@ -219,10 +257,30 @@ void parse_flags(Compiler *compiler, int *pargc, const char ***pargv) {
                 name += 3;
             }
             CLIFlag *flag = flag_for_name(name);
+            // -name=value, unless the whole of it names a flag like -lto=thin
+            const char *value = NULL;
+            const char *equals = strchr(name, '=');
+            if (!flag && equals && equals - name < 64) {
+                char prefix[64];
+                memcpy(prefix, name, equals - name);
+                prefix[equals - name] = '\0';
+                flag = flag_for_name(prefix);
+                value = equals + 1;
+                if (flag && (flag->kind == CLIFlagKindBool || flag->kind == CLIFlagKindValue)) flag = NULL;
+            }
             if (!flag || (inverse && flag->kind != CLIFlagKindBool)) {
                 printf("Unknown flag %s\n", arg);
                 continue;
             }
+            if (!value && flag->kind != CLIFlagKindBool && flag->kind != CLIFlagKindValue) {
+                if (i + 1 < argc) {
+                    i++;
+                    value = argv[i];
+                } else {
+                    printf("No value argument after -%s\n", arg);
+                    continue;
+                }
+            }
             switch (flag->kind) {
                 case CLIFlagKindBool:;
                     b32 *ptr = ((void *) compiler) + flag->offs;
@@ -230,14 +288,7 @@ void parse_flags(Compiler *compiler, int *pargc, const char ***pargv) {
                     break;
 
                 case CLIFlagKindEnum: {
-                    const char *option;
-                    if (i + 1 < argc) {
-                        i++;
-                        option = argv[i];
-                    } else {
-                        printf("No value argument after -%s\n", arg);
-                        break;
-                    }
+                    const char *option = value;
                     bool found = false;
                     for (int k = 0; k < flag->nOptions; k++) {
                         if (strcmp(flag->options[k], option) == 0) {
@@ -260,23 +311,32 @@ void parse_flags(Compiler *compiler, int *pargc, const char ***pargv) {
                 }
 
                 case CLIFlagKindPath:
-                    if (i + 1 < argc) {
-                        i++;
-                        path_copy((void *) compiler + flag->offs, argv[i]);
-                    } else {
-                        printf("No value argument after -%s\n", arg);
-                    }
+                    path_copy((void *) compiler + flag->offs, value);
                     break;
 
-                case CLIFlagKindString:
-                    if (i + 1 < argc) {
-                        i++;
-                        const char **ptr = ((void *) compiler) + flag->offs;
-                        *ptr = argv[i];
-                    } else {
-                        printf("No value argument after -%s\n", arg);
+                case CLIFlagKindString: {
+                    const char **ptr = ((void *) compiler) + flag->offs;
+                    *ptr = value;
+                    break;
+                }
+
+                case CLIFlagKindInt: {
+                    char *end;
+                    long n = strtol(value, &end, 10);
+                    if (*end || end == value || n < 1 || n > UINT32_MAX) {
+                        printf("Invalid value %s for %s. Expected a positive integer\n", value, arg);
+                        break;
                     }
+                    u32 *ptr = ((void *) compiler) + flag->offs;
+                    *ptr = (u32) n;
                     break;
+                }
+
+                case CLIFlagKindValue: {
+                    int *ptr = ((void *) compiler) + flag->offs;
+                    *ptr = flag->value;
+                    break;
+                }
 
                 default:
                     ASSERT(false);
@@ -287,13 +347,14 @@ void parse_flags(Compiler *compiler, int *pargc, const char ***pargv) {
     }
     *pargc = argc - i;
     *pargv = argv + i;
-    if (argc - i == 1) {
+    if (argc - i >= 1) {
         path_copy(compiler->input_name, argv[i]);
     }
 }
 
 void print_usage(const char *prog_name) {
     printf("Usage: %s [flags] <input>\n", prog_name);
+    printf("       %s run [flags] <input> [args]\n", prog_name);
     size_t nFlags = sizeof(CLIFlags) / sizeof(*CLIFlags);
     for (size_t i = 0; i < nFlags; i++) {
         char invokation[40];
@@ -322,11 +383,15 @@ void print_usage(const char *prog_name) {
                 hLen += snprintf(help + hLen, sizeof(help) - hLen, " (default)");
                 break;
 
+            case CLIFlagKindValue:
+                break;
+
             case CLIFlagKindPath:
                 iLen += snprintf(invokation + iLen, sizeof(invokation) - iLen, " <%s>", flag.argumentName);
                 break;
 
             case CLIFlagKindString:
+            case CLIFlagKindInt:
                 iLen += snprintf(invokation + iLen, sizeof(invokation) - iLen, " <%s>", flag.argumentName);
                 break;
         }
@@ -350,6 +415,22 @@ void configure_defaults(Compiler *compiler) {
     if (compiler->target_arch == Arch_Unknown) {
         compiler->target_arch = ArchForName(info.arch);
     }
+    if (*compiler->time_report_path) compiler->flags.time_report = true;
+    // ThinLTO generates code for each package on a thread of its own, they aren't split further
+    if (compiler->flags.lto == LTO_THIN) compiler->flags.codegen_threads = 1;
+    if (compiler->flags.profile_generate && compiler->flags.run) {
+        warn("-profile-generate is ignored by kai run, the profile runtime is only linked into outputs");
+        compiler->flags.profile_generate = false;
+    }
+    // LLVM only instruments and uses profiles when optimizing
+    if ((compiler->flags.profile_generate || *compiler->profile_use_path) &&
+        compiler->flags.opt_level == OPT_LEVEL_0) {
+        compiler->flags.opt_level = OPT_LEVEL_1;
+    }
+    if (*compiler->profile_use_path && file_mode(compiler->profile_use_path) != FILE_REGULAR) {
+        printf("Profile %s does not exist\n", compiler->profile_use_path);
+        exit(1);
+    }
     if (compiler->target_os == Os_Unknown || compiler->target_arch == Arch_Unknown) {
         printf("Unsupported Os or Arch: %s %s\n",
                OsNames[compiler->target_os], ArchNames[compiler->target_arch]);
@@ -386,15 +467,27 @@ void compiler_init(Compiler *compiler, int argc, const char **argv) {
     TRACE(INIT);
     memset(compiler, 0, sizeof *compiler);
     const char *prog_name = argv[0];
+    // kai run builds the input then runs it in process, passing it the arguments that follow it
+    bool run = argc > 1 && strcmp(argv[1], "run") == 0;
+    if (run) {
+        argv[1] = prog_name;
+        argc--;
+        argv++;
+    }
     parse_flags(compiler, &argc, &argv);
     if (compiler->flags.version) {
         output_version_and_build_info();
         exit(0);
     }
-    if (argc != 1 || compiler->flags.help) {
+    if ((run ? argc < 1 : argc != 1) || compiler->flags.help) {
         print_usage(prog_name);
         exit(1);
     }
+    if (run) {
+        compiler->flags.run = true;
+        compiler->run_args = argv;
+        compiler->num_run_args = argc;
+    }
     configure_defaults(compiler);
     init_search_paths(compiler);
     parser_init_interns();
@@ -413,7 +506,10 @@ bool compiler_parse(Compiler *compiler) {
         COUNTER1(IMPORT, "parsing_queue", INT("length", (int) compiler->parsing_queue.size));
         Package *pkg = queue_pop_front(&compiler->parsing_queue);
         if (pkg) {
+            Timing start;
+            if (compiler->flags.time_report) start = timing_now(true);
             parse_package(pkg);
+            if (compiler->flags.time_report) timing_add(&pkg->parse_timing, start, true);
             continue;
         }
         break;
@@ -434,7 +530,10 @@ bool compiler_typecheck(Compiler *compiler) {
         COUNTER1(IMPORT, "checking_queue", INT("length", (int) compiler->checking_queue.size));
         CheckerWork *work = queue_pop_front(&compiler->checking_queue);
         if (work && !work->package->errors) {
+            Timing start;
+            if (compiler->flags.time_report) start = timing_now(true);
             bool requeue = check(work->package, work->stmt);
+            if (compiler->flags.time_report) timing_add(&work->package->check_timing, start, true);
             if (requeue) {
                 queue_push_back(&compiler->checking_queue, work);
                 verbose("Requeuing stmt within package %s", work->package->path);
@@ -453,21 +552,39 @@ bool compiler_typecheck(Compiler *compiler) {
     return true;
 }
 
-#if TEST
+#if TEST || BENCH
 bool llvm_build_module(Package *package) { return false; }
 bool llvm_emit_object(Package *package) { return false; }
+bool llvm_build_modules(PackageMapEntry *packages) { return false; }
+bool llvm_emit_objects(PackageMapEntry *packages) { return false; }
+VMNative llvm_jit_bytecode(VM *vm, u32 entry) { return NULL; }
+bool llvm_run_modules(PackageMapEntry *packages, int argc, const char **argv, int *exit_code) { return false; }
+bool llvm_link_elf(const char **args, int num_args) { return false; }
+bool llvm_archive(const char *output, PackageMapEntry *packages) { return false; }
+const char **llvm_object_paths(PackageMapEntry *packages) { return NULL; }
+void llvm_remove_scratch_dir(void) {}
+void llvm_cache_prune(void) {}
+const char *llvm_profile_runtime(void) { return "libclang_rt.profile.a"; }
 #endif
 
 bool compiler_build(Compiler *compiler) {
     TRACE(GENERAL);
-    bool failure = llvm_build_module(compiler->packages->value); // the first package is the input
+    bool failure = llvm_build_modules(compiler->packages);
     if (failure) compiler->failure_stage = STAGE_BUILD;
     return !failure;
 }
 
+bool compiler_run(Compiler *compiler) {
+    TRACE(GENERAL);
+    bool failure = llvm_run_modules(compiler->packages, compiler->num_run_args, compiler->run_args,
+                                    &compiler->exit_code);
+    if (failure) compiler->failure_stage = STAGE_RUN;
+    return !failure;
+}
+
 bool compiler_emit_objects(Compiler *compiler) {
     TRACE(GENERAL);
-    bool failure = llvm_emit_object(compiler->packages->value);
+    bool failure = llvm_emit_objects(compiler->packages);
     if (failure) compiler->failure_stage = STAGE_EMIT_OBJECTS;
     return !failure;
 }
@@ -492,16 +609,112 @@ char *arr_printf(char *arr, const char *fmt, ...) {
     return arr;
 }
 
-bool compiler_link_objects(Compiler *compiler) {
-    TRACE(GENERAL);
-    char *linker_flags = NULL;
-    // TODO: Output type (exec, static, dynamic)
+typedef struct LinuxTarget LinuxTarget;
+struct LinuxTarget {
+    const char *multiarch; // directory of the arch's libraries within lib directories
+    const char *dynamic_linker;
+};
+
+const LinuxTarget LinuxTargets[NUM_ARCHES] = {
+    [Arch_x86_64] = {"x86_64-linux-gnu",    "/lib64/ld-linux-x86-64.so.2"},
+    [Arch_x86]    = {"i386-linux-gnu",      "/lib/ld-linux.so.2"},
+    [Arch_arm]    = {"arm-linux-gnueabihf", "/lib/ld-linux-armhf.so.3"},
+    [Arch_arm64]  = {"aarch64-linux-gnu",   "/lib/ld-linux-aarch64.so.1"},
+};
+
+// The C runtime's object name within the first of dirs (arr) having it, or NULL
+const char *find_crt_object(const char **dirs, const char *name) {
+    for (i64 i = 0; i < arrlen(dirs); i++) {
+        char path[MAX_PATH];
+        path_copy(path, dirs[i]);
+        path_join(path, name);
+        if (file_mode(path) == FILE_REGULAR) return str_intern(path);
+    }
+    return NULL;
+}
 
-    char obj_name[MAX_PATH];
-    package_object_path(compiler->packages->value, obj_name);
+/*
+ Arguments to lld's ELF driver, as given to ld.lld. Executables are linked against the C runtime and
+ libc found in the system's library directories, the objects come before the libraries so that
+ references from them are resolved by the libraries.
+*/
+const char **linker_args_elf(Compiler *compiler, const char **objects) {
+    LinuxTarget target = LinuxTargets[compiler->target_arch];
+    const char **system_dirs = NULL;
+    if (target.multiarch) {
+        char path[MAX_PATH];
+        snprintf(path, sizeof path, "/lib/%s", target.multiarch);
+        arrput(system_dirs, str_intern(path));
+        snprintf(path, sizeof path, "/usr/lib/%s", target.multiarch);
+        arrput(system_dirs, str_intern(path));
+    }
+    if (compiler->target_metrics.width == 64) {
+        arrput(system_dirs, "/lib64");
+        arrput(system_dirs, "/usr/lib64");
+    }
+    arrput(system_dirs, "/lib");
+    arrput(system_dirs, "/usr/lib");
+
+    bool exec = compiler->target_output == OutputType_Exec;
+    const char **args = NULL;
+    arrput(args, "ld.lld");
+    arrput(args, "-o");
+    arrput(args, compiler->output_name);
+    if (exec) {
+        const char *crt_begin[] = {"crt1.o", "crti.o"};
+        for (int i = 0; i < 2; i++) {
+            const char *crt = find_crt_object(system_dirs, crt_begin[i]);
+            if (crt) arrput(args, crt);
+            else warn("Could not find %s to link with", crt_begin[i]);
+        }
+        if (target.dynamic_linker) {
+            arrput(args, "-dynamic-linker");
+            arrput(args, target.dynamic_linker);
+        }
+    } else {
+        arrput(args, "-shared");
+    }
+    for (i64 i = 0; i < arrlen(objects); i++)
+        arrput(args, objects[i]);
+    for (int i = 0; i < compiler->num_library_search_paths; i++)
+        if (file_mode(compiler->library_search_paths[i]) == FILE_DIRECTORY)
+            arrput(args, str_join("-L", compiler->library_search_paths[i]));
+    for (i64 i = 0; i < arrlen(system_dirs); i++)
+        if (file_mode(system_dirs[i]) == FILE_DIRECTORY)
+            arrput(args, str_join("-L", system_dirs[i]));
+    for (i64 i = 0; i < arrlen(compiler->libraries); i++)
+        arrput(args, str_join("-l", compiler->libraries[i]));
+    if (compiler->flags.profile_generate) {
+        const char *runtime = llvm_profile_runtime();
+        if (runtime) {
+            // Instrumented modules don't reference the runtime on Linux, it has to be pulled in
+            arrput(args, "-u");
+            arrput(args, "__llvm_profile_runtime");
+            arrput(args, runtime);
+        } else {
+            warn("Could not find the profile runtime to link with");
+        }
+    }
+    arrput(args, "-lc");
+    if (exec) {
+        const char *crt = find_crt_object(system_dirs, "crtn.o");
+        if (crt) arrput(args, crt);
+        else warn("Could not find crtn.o to link with");
+    }
+    arrfree(system_dirs);
+    return args;
+}
 
-    linker_flags = arr_printf(linker_flags, "ld %s -o %s -lSystem -macosx_version_min 10.13",
-                              obj_name, compiler->output_name);
+// Links with the system's ld, which is only done for Darwin
+bool link_objects_system(Compiler *compiler, const char **objects) {
+    char *linker_flags = NULL;
+    linker_flags = arr_printf(linker_flags, "ld");
+    for (i64 i = 0; i < arrlen(objects); i++)
+        linker_flags = arr_printf(linker_flags, " %s", objects[i]);
+    if (compiler->target_output == OutputType_Dynamic)
+        linker_flags = arr_printf(linker_flags, " -dylib");
+    linker_flags = arr_printf(linker_flags, " -o %s -lSystem -macosx_version_min 10.13",
+                              compiler->output_name);
     for (int i = 0; i < compiler->num_library_search_paths; i++)
         if (file_mode(compiler->library_search_paths[i]) == FILE_DIRECTORY)
             linker_flags = arr_printf(linker_flags, " -L%s", compiler->library_search_paths[i]);
@@ -512,19 +725,54 @@ bool compiler_link_objects(Compiler *compiler) {
         linker_flags = arr_printf(linker_flags, " -l%s", compiler->libraries[i]);
     for (int i = 0; i < arrlen(compiler->frameworks); i++)
         linker_flags = arr_printf(linker_flags, " -framework %s", compiler->frameworks[i]);
+    if (compiler->flags.profile_generate) {
+        const char *runtime = llvm_profile_runtime();
+        if (runtime) linker_flags = arr_printf(linker_flags, " %s", runtime);
+        else warn("Could not find the profile runtime to link with");
+    }
 
     verbose("$ %s", linker_flags);
     int result = system((char *) linker_flags);
-    if (result) {
+    arrfree(linker_flags);
+    return result == 0;
+}
+
+bool compiler_link_objects(Compiler *compiler) {
+    TRACE(GENERAL);
+    const char **objects = llvm_object_paths(compiler->packages);
+    bool success;
+    if (compiler->target_output == OutputType_Static) {
+        verbose("Archiving objects into %s", compiler->output_name);
+        success = !llvm_archive(compiler->output_name, compiler->packages);
+    } else if (compiler->target_os == Os_Linux) {
+        const char **args = linker_args_elf(compiler, objects);
+        if (compiler->flags.verbose) {
+            char *command = NULL;
+            for (i64 i = 0; i < arrlen(args); i++)
+                command = arr_printf(command, i ? " %s" : "%s", args[i]);
+            verbose("$ %s", command);
+            arrfree(command);
+        }
+        success = !llvm_link_elf(args, (int) arrlen(args));
+        arrfree(args);
+    } else {
+        success = link_objects_system(compiler, objects);
+    }
+    arrfree(objects);
+    llvm_remove_scratch_dir();
+    // Only once nothing reads cached objects any more, pruning could remove them otherwise
+    if (compiler->flags.cache) llvm_cache_prune();
+    if (!success) {
         compiler->failure_stage = STAGE_LINK_OBJECTS;
         return false;
     }
 
-    if (compiler->flags.debug && compiler->target_output != OutputType_Static) {
+    if (compiler->flags.debug && compiler->target_os == Os_Darwin &&
+        compiler->target_output != OutputType_Static) {
         char *dsymutil_flags = NULL;
         dsymutil_flags = arr_printf(dsymutil_flags, "dsymutil %s", compiler->output_name);
         verbose("$ %s", dsymutil_flags);
-        result = system((char *) dsymutil_flags);
+        int result = system((char *) dsymutil_flags);
         if (result) {
             compiler->failure_stage = STAGE_LINK_DEBUG_INFO;
             return false;
@@ -533,13 +781,59 @@ bool compiler_link_objects(Compiler *compiler) {
     return true;
 }
 
+bool compiler_run_bytecode(Compiler *compiler) {
+    TRACE(GENERAL);
+    BCImage image;
+    if (!bc_load_program(compiler->input_name, &image)) {
+        compiler->failure_stage = STAGE_RUN_BYTECODE;
+        return false;
+    }
+    VM vm = {0};
+    VMProfile profile = {0};
+    if (compiler->flags.profile_bytecode) vm.profile = &profile;
+    if (compiler->flags.ct_jit) vm.compile = llvm_jit_bytecode;
+    vm_init_image(&vm, &image);
+    bool success = vm_verify(&vm) && vm_interp(&vm);
+    if (compiler->flags.verbose) vm_dump(&vm);
+    if (vm.profile) {
+        vm_report_profile(&vm, 20);
+        vm_free_profile(&profile);
+    }
+    if (!success) compiler->failure_stage = STAGE_RUN_BYTECODE;
+    bc_unload_program(&image);
+    return success;
+}
+
+// Runs a stage, adding the time it takes and what it allocates to the stage's timing
+bool compiler_stage(Compiler *compiler, CompilationStage stage, bool (*run)(Compiler *compiler)) {
+    Timing start = timing_now(false);
+    bool success = run(compiler);
+    Timing *timing = &compiler->stage_timings[stage];
+    timing_add(timing, start, false);
+    // Packages are built and emitted on the backend's threads, their allocations are counted there
+    if (stage == STAGE_BUILD || stage == STAGE_EMIT_OBJECTS) {
+        for (i64 i = 0; i < hmlen(compiler->packages); i++) {
+            Package *package = compiler->packages[i].value;
+            Timing worker = stage == STAGE_BUILD ? package->build_timing : package->emit_timing;
+            timing->allocations += worker.allocations;
+            timing->allocated += worker.allocated;
+        }
+    }
+    return success;
+}
+
 bool compile(Compiler *compiler) {
     TRACE(GENERAL);
-    if (!compiler_parse(compiler))        return false;
-    if (!compiler_typecheck(compiler))    return false;
-    if (!compiler_build(compiler))        return false;
-    if (!compiler_emit_objects(compiler)) return false;
-    if (!compiler_link_objects(compiler)) return false;
+    if (compiler->flags.run_bytecode)
+        return compiler_stage(compiler, STAGE_RUN_BYTECODE, compiler_run_bytecode);
+    if (!compiler_stage(compiler, STAGE_PARSE, compiler_parse))               return false;
+    if (!compiler_stage(compiler, STAGE_TYPECHECK, compiler_typecheck))       return false;
+    if (!compiler_stage(compiler, STAGE_BUILD, compiler_build))               return false;
+    if (compiler->flags.run)
+        return compiler_stage(compiler, STAGE_RUN, compiler_run);
+    if (!compiler_stage(compiler, STAGE_EMIT_OBJECTS, compiler_emit_objects)) return false;
+    if (!compiler->flags.link) return true;
+    if (!compiler_stage(compiler, STAGE_LINK_OBJECTS, compiler_link_objects)) return false;
 
 //    compiler_parse_input(compiler);
 //    compiler_check_input(compiler);
@@ -597,12 +891,97 @@ const char *compiler_stage_name(CompilationStage stage) {
         case STAGE_EMIT_OBJECTS: return "Object emission";
         case STAGE_LINK_OBJECTS: return "Object linking";
         case STAGE_LINK_DEBUG_INFO: return "Dwarf debug info linking";
+        case STAGE_RUN_BYTECODE: return "Bytecode execution";
+        case STAGE_RUN: return "Execution";
         default:
             warn("Unrecognized stage name");
             return "unknown";
     }
 }
 
+// Names of the stages in the JSON time report, stable so results can be compared across commits
+static const char *StageKeys[NUM_COMPILATION_STAGES] = {
+    [STAGE_PARSE]           = "parse",
+    [STAGE_TYPECHECK]       = "typecheck",
+    [STAGE_BUILD]           = "build",
+    [STAGE_EMIT_OBJECTS]    = "emit",
+    [STAGE_LINK_OBJECTS]    = "link",
+    [STAGE_LINK_DEBUG_INFO] = "link_debug_info",
+    [STAGE_RUN_BYTECODE]    = "run_bytecode",
+    [STAGE_RUN]             = "run",
+};
+
+void print_timing(const char *name, Timing timing) {
+    printf("%-28s %10.2f %10.2f %12llu %12.2f\n", name, timing.wall / 1e6, timing.cpu / 1e6,
+           (unsigned long long) timing.allocations, timing.allocated / 1024.0);
+}
+
+void write_timing_json(FILE *file, const char *name, Timing timing, bool last) {
+    fprintf(file, "\"%s\": {\"wall_ns\": %llu, \"cpu_ns\": %llu, \"allocations\": %llu, \"allocated_bytes\": %llu}%s",
+            name, (unsigned long long) timing.wall, (unsigned long long) timing.cpu,
+            (unsigned long long) timing.allocations, (unsigned long long) timing.allocated, last ? "" : ", ");
+}
+
+void write_time_report_json(Compiler *compiler, const char *path) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        warn("Failed to write time report to %s", path);
+        return;
+    }
+    fprintf(file, "{\n  \"version\": \"%s\",\n  \"stages\": {", VERSION);
+    bool first = true;
+    for (int stage = STAGE_PARSE; stage < NUM_COMPILATION_STAGES; stage++) {
+        if (!compiler->stage_timings[stage].wall) continue;
+        fprintf(file, "%s\n    ", first ? "" : ",");
+        write_timing_json(file, StageKeys[stage], compiler->stage_timings[stage], true);
+        first = false;
+    }
+    fprintf(file, "\n  },\n  \"packages\": [");
+    for (i64 i = 0; i < hmlen(compiler->packages); i++) {
+        Package *package = compiler->packages[i].value;
+        fprintf(file, "%s\n    {\"path\": \"", i ? "," : "");
+        for (const char *c = package->path; *c; c++) {
+            if (*c == '"' || *c == '\\') fputc('\\', file);
+            fputc(*c, file);
+        }
+        fprintf(file, "\", ");
+        write_timing_json(file, StageKeys[STAGE_PARSE], package->parse_timing, false);
+        write_timing_json(file, StageKeys[STAGE_TYPECHECK], package->check_timing, false);
+        write_timing_json(file, StageKeys[STAGE_BUILD], package->build_timing, false);
+        write_timing_json(file, StageKeys[STAGE_EMIT_OBJECTS], package->emit_timing, true);
+        fprintf(file, "}");
+    }
+    fprintf(file, "\n  ]\n}\n");
+    fclose(file);
+}
+
+// Packages are timed on the thread working on them, so their CPU time excludes other threads
+void compiler_report_timings(Compiler *compiler) {
+    printf("%-28s %10s %10s %12s %12s\n", "Stage", "Wall (ms)", "CPU (ms)", "Allocations", "Alloc (KB)");
+    Timing total = {0};
+    for (int stage = STAGE_PARSE; stage < NUM_COMPILATION_STAGES; stage++) {
+        Timing timing = compiler->stage_timings[stage];
+        if (!timing.wall) continue;
+        print_timing(compiler_stage_name(stage), timing);
+        total.wall += timing.wall;
+        total.cpu += timing.cpu;
+        total.allocations += timing.allocations;
+        total.allocated += timing.allocated;
+    }
+    print_timing("total", total);
+
+    for (i64 i = 0; i < hmlen(compiler->packages); i++) {
+        Package *package = compiler->packages[i].value;
+        printf("\n%s\n", package->path);
+        print_timing("  parsing", package->parse_timing);
+        print_timing("  type checking", package->check_timing);
+        print_timing("  LLVM IR generation", package->build_timing);
+        print_timing("  Object emission", package->emit_timing);
+    }
+
+    if (*compiler->time_report_path) write_time_report_json(compiler, compiler->time_report_path);
+}
+
 #if TEST
 void init_test_compiler(Compiler *compiler, const char *flags) {
     *compiler = (Compiler){0};
@@ -637,5 +1016,122 @@ void test_flagParsingAndDefaults() {
     ASSERT(compiler.target_arch != Arch_Unknown);
     ASSERT(compiler.target_os != Arch_Unknown);
 }
+
+void test_flagParsingIntegers() {
+    init_test_compiler(&compiler, NULL);
+    ASSERT(compiler.flags.codegen_threads == 1);
+
+    init_test_compiler(&compiler, "-codegen-threads 4");
+    ASSERT(compiler.flags.codegen_threads == 4);
+
+    init_test_compiler(&compiler, "-codegen-threads 0");
+    ASSERT(compiler.flags.codegen_threads == 1);
+}
+
+void test_flagParsingOptLevels() {
+    init_test_compiler(&compiler, NULL);
+    ASSERT(compiler.flags.opt_level == OPT_LEVEL_2);
+
+    init_test_compiler(&compiler, "-O0");
+    ASSERT(compiler.flags.opt_level == OPT_LEVEL_0);
+
+    init_test_compiler(&compiler, "-O3 -Os");
+    ASSERT(compiler.flags.opt_level == OPT_LEVEL_SIZE);
+
+    init_test_compiler(&compiler, "-Oz");
+    ASSERT(compiler.flags.small);
+}
+
+void test_flagParsingLTO() {
+    init_test_compiler(&compiler, NULL);
+    ASSERT(compiler.flags.lto == LTO_NONE);
+
+    init_test_compiler(&compiler, "-lto=thin -codegen-threads 4");
+    ASSERT(compiler.flags.lto == LTO_THIN);
+    ASSERT(compiler.flags.codegen_threads == 1);
+}
+
+void test_flagParsingTargetCPU() {
+    init_test_compiler(&compiler, NULL);
+    ASSERT(!compiler.target_cpu);
+    ASSERT(!compiler.target_features);
+
+    init_test_compiler(&compiler, "-mcpu=haswell -mattr +avx2,-fma");
+    ASSERT(strcmp(compiler.target_cpu, "haswell") == 0);
+    ASSERT(strcmp(compiler.target_features, "+avx2,-fma") == 0);
+
+    init_test_compiler(&compiler, "-march=native -codegen-threads=2");
+    ASSERT(strcmp(compiler.target_cpu, "native") == 0);
+    ASSERT(compiler.flags.codegen_threads == 2);
+}
+
+void test_flagParsingTimeReport() {
+    init_test_compiler(&compiler, NULL);
+    ASSERT(!compiler.flags.time_report);
+
+    init_test_compiler(&compiler, "-time-report-json times.json");
+    ASSERT(compiler.flags.time_report);
+    ASSERT(strcmp(compiler.time_report_path, "times.json") == 0);
+}
+
+void test_runCommand() {
+    init_test_compiler(&compiler, NULL);
+    ASSERT(!compiler.flags.run);
+
+    init_test_compiler(&compiler, "run -O0");
+    ASSERT(compiler.flags.run);
+    ASSERT(compiler.flags.opt_level == OPT_LEVEL_0);
+    ASSERT(strcmp(compiler.input_name, "test.kai") == 0);
+    ASSERT(compiler.num_run_args == 1);
+    ASSERT(strcmp(compiler.run_args[0], "test.kai") == 0);
+}
+
+bool has_arg(const char **args, const char *arg) {
+    for (i64 i = 0; i < arrlen(args); i++)
+        if (strcmp(args[i], arg) == 0) return true;
+    return false;
+}
+
+void test_linkerArgsElf() {
+    init_test_compiler(&compiler, "-os Linux -arch x86_64 -o out");
+    arrput(compiler.libraries, "glfw");
+    const char **objects = NULL;
+    arrput(objects, "main.o");
+    const char **args = linker_args_elf(&compiler, objects);
+    ASSERT(strcmp(args[0], "ld.lld") == 0);
+    ASSERT(has_arg(args, "out"));
+    ASSERT(has_arg(args, "main.o"));
+    ASSERT(has_arg(args, "-lglfw"));
+    ASSERT(has_arg(args, "-lc"));
+    ASSERT(has_arg(args, "-dynamic-linker"));
+    ASSERT(!has_arg(args, "-shared"));
+    arrfree(args);
+
+    init_test_compiler(&compiler, "-os Linux -arch x86_64 -type dynamic");
+    args = linker_args_elf(&compiler, objects);
+    ASSERT(has_arg(args, "-shared"));
+    ASSERT(!has_arg(args, "-dynamic-linker"));
+    ASSERT(!has_arg(args, "__llvm_profile_runtime"));
+    arrfree(args);
+
+    init_test_compiler(&compiler, "-os Linux -arch x86_64 -profile-generate");
+    ASSERT(compiler.flags.opt_level == OPT_LEVEL_2);
+    args = linker_args_elf(&compiler, objects);
+    ASSERT(has_arg(args, "__llvm_profile_runtime"));
+    ASSERT(has_arg(args, "libclang_rt.profile.a"));
+    arrfree(args);
+    arrfree(objects);
+}
+
+void test_timingCountsAllocations() {
+    Timing timing = {0};
+    Timing start = timing_now(true);
+    void *ptr = xmalloc(64);
+    timing_add(&timing, start, true);
+    free(ptr);
+    ASSERT(timing.allocations == 1);
+    ASSERT(timing.allocated == 64);
+    ASSERT(timing.wall > 0);
+}
 #endif
 
@@ -1,6 +1,6 @@
 #pragma once
 
-// Requires package.h queue.h
+// Requires os.h package.h queue.h
 
 // string.h
 typedef struct InternedString InternedString;
@@ -41,6 +41,19 @@ typedef enum Output {
     OutputType_Dynamic
 } Output;
 
+typedef enum OptLevel {
+    OPT_LEVEL_0,
+    OPT_LEVEL_1,
+    OPT_LEVEL_2,
+    OPT_LEVEL_3,
+    OPT_LEVEL_SIZE, // -O2 favouring smaller code
+} OptLevel;
+
+typedef enum LTOMode {
+    LTO_NONE,
+    LTO_THIN, // packages are emitted as bitcode with summaries and optimized across when linked
+} LTOMode;
+
 typedef enum CompilationStage {
     STAGE_NONE,
     STAGE_PARSE,
@@ -49,6 +62,9 @@ typedef enum CompilationStage {
     STAGE_EMIT_OBJECTS,
     STAGE_LINK_OBJECTS,
     STAGE_LINK_DEBUG_INFO,
+    STAGE_RUN_BYTECODE,
+    STAGE_RUN,
+    NUM_COMPILATION_STAGES,
 } CompilationStage;
 
 typedef struct CompilerFlags CompilerFlags;
@@ -62,6 +78,7 @@ struct CompilerFlags {
     b32 version;
     b32 help;
     b32 emit_ir;
+    b32 emit_obj;
     b32 emit_header;
     b32 dump_ir;
     b32 disable_all_passes;
@@ -70,6 +87,16 @@ struct CompilerFlags {
     b32 small;
     b32 debug;
     b32 link;
+    b32 run_bytecode;
+    b32 profile_bytecode;
+    b32 ct_jit;
+    b32 cache;
+    b32 time_report;
+    b32 run; // kai run, set by the command rather than a flag
+    b32 profile_generate;
+    u32 codegen_threads;
+    OptLevel opt_level;
+    LTOMode lto;
 };
 
 #define MAX_SEARCH_PATHS 16
@@ -80,13 +107,23 @@ struct Compiler {
     const char **args;
 
     CompilationStage failure_stage;
+    Timing stage_timings[NUM_COMPILATION_STAGES]; // of the process
+    int exit_code; // of the program with kai run
+
+    const char **run_args; // the input followed by the arguments to the program with kai run
+    int num_run_args;
 
     CompilerFlags flags;
     char input_name[MAX_PATH];
     char output_name[MAX_PATH];
+    char cache_dir[MAX_PATH]; // of objects, the user's cache directory's kai when empty
+    char time_report_path[MAX_PATH]; // the time report is also written here as JSON when set
+    char profile_use_path[MAX_PATH]; // of the .profdata optimized with, none when empty
     Os target_os;
     Arch target_arch;
     Output target_output;
+    const char *target_cpu; // generic when NULL, the host's CPU and features when "native"
+    const char *target_features; // +feature,-feature
     TargetMetrics target_metrics;
 
     const char *import_search_paths[MAX_SEARCH_PATHS];
@@ -126,3 +163,4 @@ extern Compiler compiler;
 const char *compiler_stage_name(CompilationStage stage);
 void compiler_init(Compiler *compiler, int argc, const char **argv);
 bool compile(Compiler *compiler);
+void compiler_report_timings(Compiler *compiler);
@@ -1,6 +1,7 @@
 
 #include "all.h" // stb_ds needs to be imported as C++
 extern "C" {
+#include "os.h"
 #include "arena.h"
 #include "package.h"
 #include "checker.h"
@@ -9,6 +10,7 @@ extern "C" {
 #include "queue.h"
 #include "package.h"
 #include "compiler.h"
+#include "bytecode.h"
 }
 #include "llvm.hpp"
 
@@ -18,6 +20,7 @@ extern "C" {
 
 #include <llvm/ADT/APFloat.h>
 #include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/StringSet.h>
 #include <llvm/IR/BasicBlock.h>
 #include <llvm/IR/Constants.h>
 #include <llvm/IR/DerivedTypes.h>
@@ -29,10 +32,25 @@ extern "C" {
 #include <llvm/IR/Verifier.h>
 #include <llvm/IR/DIBuilder.h>
 #include <llvm/IR/LegacyPassManager.h>
+#include <llvm/CodeGen/ParallelCG.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/LTO/LTO.h>
+#include <llvm/LTO/Caching.h>
+#include <llvm/MC/SubtargetFeature.h>
 
 #include <llvm/Target/TargetMachine.h>
 #include <llvm/Target/TargetOptions.h>
 #include <llvm/Support/Timer.h>
+#include <llvm/Support/ThreadPool.h>
+#include <llvm/Support/CachePruning.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/SHA1.h>
+#include <llvm/Support/StringSaver.h>
+#include <llvm/Support/Process.h>
+#include <llvm/Support/Host.h>
+#include <llvm/ADT/StringExtras.h>
 #include <llvm/Support/TargetSelect.h>
 #include <llvm/Support/TargetRegistry.h>
 #include <llvm/Analysis/TargetLibraryInfo.h>
@@ -42,17 +60,35 @@ extern "C" {
 #include <llvm/Transforms/Scalar.h>
 #include <llvm/Transforms/Utils.h>
 #include <llvm/LinkAllPasses.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/Support/DynamicLibrary.h>
+#include <llvm/Object/ArchiveWriter.h>
+#include <lld/Common/Driver.h>
+#include <atomic>
 
 
 #pragma clang diagnostic pop
 
 using namespace llvm;
 
+#ifndef LLVM_LIBDIR // llvm-config --libdir, set by the Makefile
+#define LLVM_LIBDIR "/usr/local/lib"
+#endif
+
 struct IRValue {
     Value *val;
     bool is_temp_alloca;
 };
 
+// Debug info already created for a module, shared by every IRContext building it
+struct DebugCache {
+    DenseMap<Source *, DIFile *> files;
+    DenseMap<Ty *, DIType *> types[2]; // indexed by do_not_hide_behind_pointer
+    DenseMap<std::pair<Package *, u32>, PosInfo> positions; // by offset within the package
+    DenseMap<std::pair<u64, DIScope *>, DILocation *> locations; // by line << 32 | column and scope
+};
+
 struct DebugContext {
     DIType *i8;
     DIType *i16;
@@ -69,6 +105,7 @@ struct DebugContext {
     DIBuilder *builder;
     DICompileUnit *unit;
     Source *source_file;
+    DebugCache *cache;
 };
 
 struct BuiltinTypes {
@@ -96,11 +133,32 @@ struct BuiltinTypes {
     PointerType *rawptr;
 };
 
+// LLVM types already converted for a module's LLVMContext, shared by every IRContext building it
+struct TypeCache {
+    DenseMap<Ty *, Type *> types[2]; // indexed by do_not_hide_behind_pointer
+};
+
+// Looks key up in cache, creating and caching its value the first time. The value isn't stored through
+// a reference into cache as creating it may add entries and grow the map
+template <typename Key, typename T, typename Create>
+T *find_or_create(DenseMap<Key, T *> &cache, Key key, Create create) {
+    auto it = cache.find(key);
+    if (it != cache.end()) return it->second;
+    T *value = create();
+    if (value) cache[key] = value;
+    return value;
+}
+
 struct BuiltinSymbols {
     Value *True;
     Value *False;
 };
 
+struct SymDataEntry {
+    Sym *key;
+    void *value;
+};
+
 struct IRFunction {
     Function *function;
     BasicBlock *entry_block;
@@ -114,6 +172,12 @@ struct IRFunction {
     BasicBlock **next_cases; // switch, fallthroughs
 };
 
+// An object emitted for a package, see llvm_write_object
+struct ObjectFile {
+    SmallVector<char, 0> buffer;
+    std::string path; // empty unless written or found in the cache
+};
+
 struct IRContext {
     Package *package;
     LLVMContext &context;
@@ -126,12 +190,16 @@ struct IRContext {
 
     IRFunction *fn; // arr
     Sym **symbols; // arr
+    SymDataEntry *foreign_syms; // hm, backend data of other packages' symbols declared in module
 
     BuiltinTypes ty;
     BuiltinSymbols sym;
+    TypeCache *types;
 
     Range last_debug_range;
 
+    std::vector<ObjectFile> objects; // one per partition
+
     IRContext(IRContext *prev, Package *new_package) :
         context(prev->context),
         data_layout(prev->data_layout),
@@ -142,10 +210,12 @@ struct IRContext {
         target = prev->target;
         ty = prev->ty;
         sym = prev->sym;
+        types = prev->types;
         dbg = prev->dbg;
         dbg.scopes = NULL;
         fn = NULL;
         symbols = NULL;
+        foreign_syms = prev->foreign_syms;
         arrpush(dbg.scopes, prev->dbg.unit); // Everything in 1 CU
     }
 
@@ -157,7 +227,9 @@ struct IRContext {
         target = tm;
         data_layout = dl;
         dbg.builder = new DIBuilder(*module);
+        dbg.cache = new DebugCache();
         symbols = NULL;
+        foreign_syms = NULL;
         fn = NULL;
         {
             using namespace dwarf;
@@ -174,6 +246,7 @@ struct IRContext {
             dbg.scopes = NULL;
 
             DIFile *package_file = dbg.builder->createFile(package->sources->filename, package->path);
+            dbg.cache->files[package->sources] = package_file;
 
             dbg.unit = dbg.builder->createCompileUnit(
                 DW_LANG_C, package_file, "Kai",
@@ -198,6 +271,7 @@ struct IRContext {
 
         sym.True  = ConstantInt::getTrue(context);
         sym.False = ConstantInt::getFalse(context);
+        types = new TypeCache();
     }
 };
 
@@ -216,9 +290,16 @@ void setupTarget() {
     initialized = true;
 }
 
-IRContext *llvm_create_context(Package *pkg) {
-    LLVMContext *context = new LLVMContext();
+CodeGenOpt::Level llvm_codegen_level() {
+    switch (compiler.flags.opt_level) {
+        case OPT_LEVEL_0: return CodeGenOpt::None;
+        case OPT_LEVEL_1: return CodeGenOpt::Less;
+        case OPT_LEVEL_3: return CodeGenOpt::Aggressive;
+        default:          return CodeGenOpt::Default;
+    }
+}
 
+TargetMachine *llvm_target_machine() {
     setupTarget();
 
     std::string error;
@@ -231,16 +312,41 @@ IRContext *llvm_create_context(Package *pkg) {
         return nullptr;
     }
 
-    verbose("Target: %s\n", triple.str().c_str());
-
-    const char *cpu = "generic";
-    const char *features = "";
+    std::string cpu = compiler.target_cpu ? compiler.target_cpu : "generic";
+    SubtargetFeatures features;
+    if (cpu == "native") {
+        cpu = sys::getHostCPUName().str();
+        StringMap<bool> host_features;
+        if (sys::getHostCPUFeatures(host_features)) {
+            for (auto &feature : host_features) features.AddFeature(feature.first(), feature.second);
+        }
+    }
+    // After the host's, so -mattr can disable them
+    if (compiler.target_features) {
+        for (const std::string &feature : SubtargetFeatures(compiler.target_features).getFeatures())
+            features.AddFeature(feature);
+    }
 
     TargetOptions opt;
-    TargetMachine *tm = target->createTargetMachine(triple.str(), cpu, features, opt, None);
+    // Objects of shared libraries have to be position independent
+    Optional<Reloc::Model> reloc;
+    if (compiler.target_output == OutputType_Dynamic) reloc = Reloc::PIC_;
+    TargetMachine *tm = target->createTargetMachine(
+        triple.str(), cpu, features.getString(), opt, reloc, None, llvm_codegen_level());
+    tm->setO0WantsFastISel(compiler.flags.opt_level == OPT_LEVEL_0);
+    return tm;
+}
+
+IRContext *llvm_create_context(Package *pkg) {
+    LLVMContext *context = new LLVMContext();
 
-    // TODO: Only on unoptimized builds
-    tm->setO0WantsFastISel(true);
+    TargetMachine *tm = llvm_target_machine();
+    if (!tm) return nullptr;
+    const Triple &triple = tm->getTargetTriple();
+
+    verbose("Target: %s\n", triple.str().c_str());
+    verbose("CPU: %s, features: %s\n", tm->getTargetCPU().str().c_str(),
+            tm->getTargetFeatureString().empty() ? "(default)" : tm->getTargetFeatureString().str().c_str());
 
     DataLayout dl = tm->createDataLayout();
 
@@ -275,20 +381,42 @@ Type *llvm_float(IRContext *c, u64 bits) {
 
 // MARK: - debug
 
+DIFile *llvm_debug_file(IRContext *self, Source *source) {
+    DIFile *&file = self->dbg.cache->files[source];
+    if (!file) file = self->dbg.builder->createFile(source->filename, self->package->path);
+    return file;
+}
+
+// package_posinfo lexes from the position to find its column, positions are looked up only once
+PosInfo llvm_debug_pos(IRContext *self, u32 offset) {
+    auto key = std::make_pair(self->package, offset);
+    auto it = self->dbg.cache->positions.find(key);
+    if (it != self->dbg.cache->positions.end()) return it->second;
+    PosInfo pos = package_posinfo(self->package, offset);
+    self->dbg.cache->positions[key] = pos;
+    return pos;
+}
+
+DILocation *llvm_debug_location(IRContext *self, PosInfo pos, DIScope *scope) {
+    DILocation *&loc = self->dbg.cache->locations[std::make_pair((u64) pos.line << 32 | pos.column, scope)];
+    if (!loc) loc = DILocation::get(self->context, pos.line, pos.column, scope);
+    return loc;
+}
+
 void set_debug_pos(IRContext *self, Range range) {
     TRACE(EMITTING);
     if (!compiler.flags.debug) return;
-    PosInfo pos = package_posinfo(self->package, range.start);
     if (range.start >= self->last_debug_range.start && range.end <= self->last_debug_range.end)
         return;
     self->last_debug_range = range;
+    PosInfo pos = llvm_debug_pos(self, range.start);
     if (pos.source != self->dbg.source_file) {
-        DIFile *file = self->dbg.builder->createFile(self->package->path, pos.source->filename);
+        self->dbg.source_file = pos.source;
+        self->dbg.file = llvm_debug_file(self, pos.source);
         arrsetlen(self->dbg.scopes, 1); // TODO: Do we need to preserve the ordering?
-        arrpush(self->dbg.scopes, file);
+        arrpush(self->dbg.scopes, self->dbg.file);
     }
-    DebugLoc loc = DebugLoc::get(pos.line, pos.column, arrlast(self->dbg.scopes));
-    self->builder.SetCurrentDebugLocation(loc);
+    self->builder.SetCurrentDebugLocation(llvm_debug_location(self, pos, arrlast(self->dbg.scopes)));
 }
 
 void llvm_debug_unset_pos(IRContext *c) {
@@ -307,9 +435,26 @@ bool llvm_validate(IRContext *context) {
     return broken;
 }
 
-Type *llvm_type(IRContext *c, Ty *type, bool do_not_hide_behind_pointer = false) {
+/*
+ Every package is built into a module of its own on its own thread, so only the package owning a
+ symbol keeps its backend data in the Sym's userdata. Modules referencing the symbols of other
+ packages declare them and keep the declarations in foreign_syms. Builtin symbols belong to no
+ package and are only types with nothing kept for them.
+*/
+void *llvm_sym_data(IRContext *c, Sym *sym) {
+    if (!sym->owning_package || sym->owning_package == c->package) return sym->userdata;
+    return hmget(c->foreign_syms, sym);
+}
+
+void llvm_set_sym_data(IRContext *c, Sym *sym, void *data) {
+    if (!sym->owning_package || sym->owning_package == c->package) sym->userdata = data;
+    else hmput(c->foreign_syms, sym, data);
+}
+
+Type *llvm_type(IRContext *c, Ty *type, bool do_not_hide_behind_pointer = false);
+
+Type *create_type(IRContext *c, Ty *type, bool do_not_hide_behind_pointer) {
     TRACE(EMITTING);
-    if (type->sym && type->sym->userdata) return (Type *) type->sym->userdata;
     switch (type->kind) {
         case TYPE_INVALID:
         case TYPE_COMPLETING: fatal("Invalid type in backend");
@@ -351,14 +496,15 @@ Type *llvm_type(IRContext *c, Ty *type, bool do_not_hide_behind_pointer = false)
         }
         case TYPE_SLICE: {
             if (type == type_string) return c->ty.rawptr; // FIXME: Temp hack while we don't have slices
-            fatal("Unimplemented slice type");
+            Type *ptr = PointerType::get(llvm_type(c, type->tslice.eltype), 0);
+            return StructType::get(c->context, {ptr, c->ty.intptr, c->ty.intptr}); // ptr, len, cap
         }
         case TYPE_STRUCT: {
             if (type->flags&OPAQUE) {
                 ASSERT(type->sym); // TODO: Frontend check? Opaque can only be named?
                 const char *name = type->sym->external_name ?: type->sym->name;
                 StructType *ty = StructType::create(c->context, name);
-                type->sym->userdata = ty;
+                llvm_set_sym_data(c, type->sym, ty);
                 return ty;
             }
             std::vector<Type *> elements;
@@ -369,7 +515,7 @@ Type *llvm_type(IRContext *c, Ty *type, bool do_not_hide_behind_pointer = false)
             if (type->sym) {
                 const char *name = type->sym->external_name ?: type->sym->name;
                 StructType *ty = StructType::create(c->context, elements, name);
-                if (type->sym) type->sym->userdata = ty;
+                llvm_set_sym_data(c, type->sym, ty);
                 return ty;
             }
             return StructType::get(c->context, elements);
@@ -389,7 +535,20 @@ Type *llvm_type(IRContext *c, Ty *type, bool do_not_hide_behind_pointer = false)
     }
 }
 
-DIType *llvm_debug_type(IRContext *c, Ty *type, bool do_not_hide_behind_pointer = false) {
+// Types are canonical, so each is converted once per LLVMContext rather than for every use
+Type *llvm_type(IRContext *c, Ty *type, bool do_not_hide_behind_pointer) {
+    if (type->sym) {
+        Type *ty = (Type *) llvm_sym_data(c, type->sym);
+        if (ty) return ty;
+    }
+    return find_or_create(c->types->types[do_not_hide_behind_pointer], type, [&] {
+        return create_type(c, type, do_not_hide_behind_pointer);
+    });
+}
+
+DIType *llvm_debug_type(IRContext *c, Ty *type, bool do_not_hide_behind_pointer = false);
+
+DIType *create_debug_type(IRContext *c, Ty *type, bool do_not_hide_behind_pointer) {
     TRACE(EMITTING);
     using namespace dwarf;
     switch (type->kind) {
@@ -473,11 +632,27 @@ DIType *llvm_debug_type(IRContext *c, Ty *type, bool do_not_hide_behind_pointer
         }
         case TYPE_SLICE: {
             if (type == type_string) goto ptr; // FIXME: Temp hack while we don't have slices
-            fatal("Unimplemented slice type");
+            u32 width = c->data_layout.getPointerSizeInBits();
+            DIType *eltype = llvm_debug_type(c, type->tslice.eltype);
+            DIType *fields[] = {
+                c->dbg.builder->createPointerType(eltype, width), width == 64 ? c->dbg.i64 : c->dbg.i32,
+            };
+            const char *names[] = {"ptr", "len", "cap"};
+            std::vector<Metadata *> members;
+            for (u32 i = 0; i < 3; i++) {
+                DIDerivedType *member = c->dbg.builder->createMemberType(
+                    arrlast(c->dbg.scopes), names[i], c->dbg.file, 0, width, width, i * width,
+                    DINode::DIFlags::FlagZero, fields[i ? 1 : 0]);
+                members.push_back(member);
+            }
+            DINodeArray members_arr = c->dbg.builder->getOrCreateArray(members);
+            return c->dbg.builder->createStructType(
+                arrlast(c->dbg.scopes), tyname(type), c->dbg.file, 0, type->size * 8, type->align * 8,
+                DINode::DIFlags::FlagZero, NULL, members_arr);
         }
         case TYPE_STRUCT: {
             if (type->flags&OPAQUE) {
-                PosInfo pos = package_posinfo(c->package, type->sym->decl->range.start);
+                PosInfo pos = llvm_debug_pos(c, type->sym->decl->range.start);
                 DIType *dtype = c->dbg.builder->createForwardDecl(
                     DW_TAG_structure_type, type->sym->external_name ?: type->sym->name,
                     c->dbg.file, c->dbg.file, pos.line); // NOTE: scopes being set correctly crashes
@@ -494,7 +669,7 @@ DIType *llvm_debug_type(IRContext *c, Ty *type, bool do_not_hide_behind_pointer
                 members.push_back(member);
             }
             DINodeArray members_arr = c->dbg.builder->getOrCreateArray(members);
-            PosInfo pos = package_posinfo(c->package, type->sym->decl->range.start);
+            PosInfo pos = llvm_debug_pos(c, type->sym->decl->range.start);
             DIType *dtype = c->dbg.builder->createStructType(
                 arrlast(c->dbg.scopes), type->sym->external_name ?: type->sym->name,
                 c->dbg.file, pos.line, type->size * 8, type->align * 8,
@@ -513,6 +688,12 @@ DIType *llvm_debug_type(IRContext *c, Ty *type, bool do_not_hide_behind_pointer
 //     c->dbg.file, pos.line, arrlast(c->dbg.scopes));
 }
 
+DIType *llvm_debug_type(IRContext *c, Ty *type, bool do_not_hide_behind_pointer) {
+    return find_or_create(c->dbg.cache->types[do_not_hide_behind_pointer], type, [&] {
+        return create_debug_type(c, type, do_not_hide_behind_pointer);
+    });
+}
+
 AllocaInst *emit_entry_alloca(IRContext *self, Type *type, const char *name, u32 alignment_bytes) {
     TRACE(EMITTING);
     IRFunction *fn = &arrlast(self->fn);
@@ -880,38 +1061,72 @@ IRValue emit_expr_str(IRContext *self, Expr *expr) {
 IRValue emit_sym(IRContext *self, Package *package, Sym *sym) {
     TRACE(EMITTING);
     IRContext ctx(self, package);
-    ctx.dbg.source_file = package_posinfo(package, sym->decl->range.start).source;
     if (compiler.flags.debug) {
+        ctx.dbg.source_file = llvm_debug_pos(&ctx, sym->decl->range.start).source;
         arrpush(ctx.dbg.scopes, self->dbg.unit);
-        ctx.dbg.file = ctx.dbg.builder->createFile(ctx.dbg.source_file->filename, package->path);
+        ctx.dbg.file = llvm_debug_file(&ctx, ctx.dbg.source_file);
         arrpush(ctx.dbg.scopes, ctx.dbg.file);
     }
     emit_decl(&ctx, sym->decl);
+    self->foreign_syms = ctx.foreign_syms;
     ASSERT(sym->userdata);
     return irval((Value *) sym->userdata);
 }
 
+// Packages are linked as objects of their own, so their symbols are prefixed with the package to keep
+// names declared by more than 1 package apart. Foreign symbols keep the name they're linked by, as does main.
+// Every definition and declaration of a symbol is named by this, so references across packages resolve
+std::string llvm_sym_name(Sym *sym) {
+    if (sym->external_name) return sym->external_name;
+    if (!sym->owning_package || strcmp(sym->name, "main") == 0) return sym->name;
+    std::string name;
+    for (const char *c = sym->owning_package->path; *c; c++)
+        name.push_back(isalnum(*c) ? *c : '_');
+    return name + "." + sym->name;
+}
+
+// Declares sym, defined by the module of the package owning it, in this module
+Value *declare_sym(IRContext *self, Sym *sym) {
+    TRACE(EMITTING);
+    std::string name = llvm_sym_name(sym);
+    Value *value;
+    if (sym->type->kind == TYPE_FUNC && (sym->kind == SYM_VAL || sym->decl->kind == DECL_FOREIGN)) {
+        FunctionType *type = (FunctionType *) llvm_type(self, sym->type, true);
+        value = self->module->getOrInsertFunction(name, type);
+    } else {
+        GlobalVariable *global = new GlobalVariable(
+            *self->module, llvm_type(self, sym->type), /* IsConstant */ sym->kind == SYM_VAL,
+            GlobalValue::ExternalLinkage, /* Initializer */ NULL, name);
+        global->setAlignment(sym->type->align);
+        value = global;
+    }
+    llvm_set_sym_data(self, sym, value);
+    return value;
+}
+
+IRValue emit_sym_ref(IRContext *self, Sym *sym) {
+    TRACE(EMITTING);
+    Value *value = (Value *) llvm_sym_data(self, sym);
+    if (!value) { // the package's own declarations are emitted on first reference when out of order
+        if (sym->owning_package == self->package) value = emit_sym(self, self->package, sym).val;
+        else value = declare_sym(self, sym);
+    }
+    if (isa<Function>(value)) return irval(value);
+    return irval(create_load(self, value));
+}
+
 IRValue emit_expr_name(IRContext *self, Expr *expr) {
     TRACE(EMITTING);
     Sym *sym = hmget(self->package->symbols, expr);
-    if (!sym->userdata) {
-        emit_sym(self, self->package, sym);
-        ASSERT(sym->userdata);
-    }
-    if (isa<Function>((Value *) sym->userdata)) return irval((Value *) sym->userdata);
-    return irval(create_load(self, (Value *) sym->userdata));
+    return emit_sym_ref(self, sym);
 }
 
 IRValue emit_expr_field(IRContext *self, Expr *expr) {
     TRACE(EMITTING);
     Operand operand = hmget(self->package->operands, expr->efield.expr);
     if (operand.flags&PACKAGE) { // operand.val is a pointer to the package Symbol
-        Sym *package_sym = (Sym *) operand.val.p;
         Sym *sym = hmget(self->package->symbols, expr->efield.name);
-        if (!sym->userdata)
-            emit_sym(self, package_sym->package, sym);
-        if (isa<Function>((Value *) sym->userdata)) return irval((Value *) sym->userdata);
-        return irval(create_load(self, (Value *) sym->userdata));
+        return emit_sym_ref(self, sym);
     }
     switch (operand.type->kind) {
         case TYPE_STRUCT:
@@ -1255,14 +1470,13 @@ IRValue emit_expr_func(IRContext *self, Expr *expr) {
     TRACE(EMITTING);
     Operand operand = hmget(self->package->operands, expr);
     FunctionType *type = (FunctionType *) llvm_type(self, operand.type, true);
-    const char *name = NULL;
-    if (arrlen(self->symbols))
-        name = arrlast(self->symbols)->external_name ?: arrlast(self->symbols)->name;
+    const char *name = arrlen(self->symbols) ? arrlast(self->symbols)->name : "";
+    std::string linkage_name = arrlen(self->symbols) ? llvm_sym_name(arrlast(self->symbols)) : "";
     Function::LinkageTypes linkage = Function::LinkageTypes::ExternalLinkage;
-    Function *fn = Function::Create(type, linkage, name ?: "", self->module);
+    Function *fn = Function::Create(type, linkage, linkage_name, self->module);
     if (compiler.flags.debug) {
         DIType *dbg_type = llvm_debug_type(self, operand.type, true);
-        PosInfo pos = package_posinfo(self->package, expr->range.start);
+        PosInfo pos = llvm_debug_pos(self, expr->range.start);
         DINode::DIFlags flags = strcmp(name, "main") == 0 ?
             DISubprogram::DIFlags::FlagMainSubprogram : DINode::DIFlags::FlagZero;
         DISubprogram *sp = self->dbg.builder->createFunction(
@@ -1304,13 +1518,13 @@ IRValue emit_expr_func(IRContext *self, Expr *expr) {
         self->builder.CreateAlignedStore(arg, alloca, sym->type->align);
 
         if (compiler.flags.debug) {
-            PosInfo pos = package_posinfo(self->package, param.name->range.start);
+            PosInfo pos = llvm_debug_pos(self, param.name->range.start);
             DILocalVariable *var = self->dbg.builder->createParameterVariable(
                 arrlast(self->dbg.scopes), sym->name, (u32) i, self->dbg.file, pos.line,
                 llvm_debug_type(self, sym->type));
             self->dbg.builder->insertDeclare(
                 alloca, var, self->dbg.builder->createExpression(),
-                DebugLoc::get(pos.line, pos.column, arrlast(self->dbg.scopes)), entry_block);
+                llvm_debug_location(self, pos, arrlast(self->dbg.scopes)), entry_block);
         }
     }
     fn->arg_end();
@@ -1565,7 +1779,7 @@ void emit_stmt_goto(IRContext *self, Stmt *stmt) {
 void emit_stmt_block(IRContext *self, Stmt *stmt) {
     TRACE(EMITTING);
     if (compiler.flags.debug) {
-        PosInfo pos = package_posinfo(self->package, stmt->range.start);
+        PosInfo pos = llvm_debug_pos(self, stmt->range.start);
         DILexicalBlock *block = self->dbg.builder->createLexicalBlock(
             arrlast(self->dbg.scopes), self->dbg.file, pos.line, pos.column);
         arrpush(self->dbg.scopes, block);
@@ -1598,113 +1812,169 @@ void emit_stmt_if(IRContext *self, Stmt *stmt) {
     self->builder.SetInsertPoint(post);
 }
 
+// A distinct self referential llvm.loop node on the latch identifies the loop to LICM, the
+// unroller and the vectorizer
+void set_loop_metadata(IRContext *self, BranchInst *latch) {
+    SmallVector<Metadata *, 2> ops;
+    ops.push_back(nullptr); // replaced by the node itself
+    if (DILocation *loc = self->builder.getCurrentDebugLocation()) ops.push_back(loc);
+    MDNode *loop = MDNode::getDistinct(self->context, ops);
+    loop->replaceOperandWith(0, loop);
+    latch->setMetadata(LLVMContext::MD_loop, loop);
+}
+
+void emit_stmt_for_aggregate(IRContext *self, Stmt *stmt) {
+    TRACE(EMITTING);
+    IRFunction *fn = &arrlast(self->fn);
+    Operand op = hmget(self->package->operands, stmt->sfor.aggregate);
+    Constant *zero = ConstantInt::get(self->ty.intptr, 0);
+    Constant *one = ConstantInt::get(self->ty.intptr, 1);
+
+    // The aggregate and the trip count are evaluated once, before the loop
+    set_debug_pos(self, stmt->sfor.aggregate->range);
+    Value *aggregate;
+    Value *length;
+    switch (op.type->kind) {
+        case TYPE_ARRAY:
+            aggregate = emit_expr(self, stmt->sfor.aggregate, LVALUE).val;
+            length = ConstantInt::get(self->ty.intptr, op.type->tarray.length);
+            break;
+        case TYPE_VECTOR:
+            aggregate = emit_expr(self, stmt->sfor.aggregate).val;
+            length = ConstantInt::get(self->ty.intptr, op.type->tvector.length);
+            break;
+        case TYPE_SLICE: {
+            Value *slice = emit_expr(self, stmt->sfor.aggregate).val;
+            if (op.type == type_string) { // FIXME: Strings are NUL terminated u8 pointers while we don't have slices
+                FunctionType *strlen_type = FunctionType::get(self->ty.intptr, {self->ty.rawptr}, false);
+                aggregate = slice;
+                length = self->builder.CreateCall(self->module->getOrInsertFunction("strlen", strlen_type), {slice});
+                break;
+            }
+            aggregate = self->builder.CreateExtractValue(slice, {0});
+            length = self->builder.CreateExtractValue(slice, {1});
+            break;
+        }
+        default: fatal("Unhandled type for emission of for aggregate");
+    }
+
+    // The induction variable is a phi, the value and index symbols are copies of it for the body
+    Sym *value_sym = NULL;
+    Sym *index_sym = NULL;
+    if (stmt->sfor.value_name) {
+        value_sym = hmget(self->package->symbols, stmt->sfor.value_name);
+        Type *type = llvm_type(self, value_sym->type);
+        value_sym->userdata = emit_entry_alloca(self, type, value_sym->name, value_sym->type->align);
+        if (compiler.flags.debug) declare_auto_variable(self, value_sym);
+    }
+    if (stmt->sfor.index_name) {
+        index_sym = hmget(self->package->symbols, stmt->sfor.index_name);
+        Type *type = llvm_type(self, index_sym->type);
+        index_sym->userdata = emit_entry_alloca(self, type, index_sym->name, index_sym->type->align);
+        if (compiler.flags.debug) declare_auto_variable(self, index_sym);
+    }
+
+    BasicBlock *preheader = self->builder.GetInsertBlock();
+    BasicBlock *cond = BasicBlock::Create(self->context, "for.cond", fn->function);
+    BasicBlock *body = BasicBlock::Create(self->context, "for.body", fn->function);
+    BasicBlock *step = BasicBlock::Create(self->context, "for.step", fn->function);
+    BasicBlock *post = BasicBlock::Create(self->context, "for.post", fn->function);
+
+    self->builder.CreateBr(cond);
+    self->builder.SetInsertPoint(cond);
+    PHINode *index = self->builder.CreatePHI(self->ty.intptr, 2, "for.index");
+    index->addIncoming(zero, preheader);
+    self->builder.CreateCondBr(self->builder.CreateICmpSLT(index, length), body, post);
+    arrpush(fn->loop_cond_blocks, step); // continue moves on to the next element
+    arrpush(fn->post_blocks, post);
+
+    self->builder.SetInsertPoint(body);
+    if (index_sym) {
+        set_debug_pos(self, stmt->sfor.index_name->range);
+        Value *value = self->builder.CreateZExtOrTrunc(index, llvm_type(self, index_sym->type));
+        create_store(self, value, (Value *) index_sym->userdata);
+    }
+    if (value_sym) {
+        set_debug_pos(self, stmt->sfor.value_name->range);
+        Value *element;
+        switch (op.type->kind) {
+            case TYPE_ARRAY:
+                element = create_load(self, self->builder.CreateGEP(aggregate, {zero, index}));
+                break;
+            case TYPE_VECTOR:
+                element = self->builder.CreateExtractElement(aggregate, index);
+                break;
+            default:
+                element = create_load(self, self->builder.CreateGEP(aggregate, index));
+                break;
+        }
+        create_store(self, element, (Value *) value_sym->userdata);
+    }
+
+    emit_stmt(self, stmt->sfor.body);
+
+    b32 has_jump = self->builder.GetInsertBlock()->getTerminator() != NULL;
+    if (!has_jump) self->builder.CreateBr(step);
+    self->builder.SetInsertPoint(step);
+    // The index is below length, so incrementing it can't wrap
+    Value *next = self->builder.CreateAdd(index, one, "", /*HasNUW*/ true, /*HasNSW*/ true);
+    index->addIncoming(next, step);
+    set_loop_metadata(self, self->builder.CreateBr(cond));
+    arrpop(fn->loop_cond_blocks);
+    arrpop(fn->post_blocks);
+    self->builder.SetInsertPoint(post);
+    if (compiler.flags.dump_ir || compiler.flags.emit_ir)
+        post->moveAfter(self->builder.GetInsertBlock());
+}
+
 void emit_stmt_for(IRContext *self, Stmt *stmt) {
     TRACE(EMITTING);
     IRFunction *fn = &arrlast(self->fn);
     BasicBlock *body, *post, *cond, *step;
     body = post = cond = step = NULL;
     if (compiler.flags.debug) {
-        PosInfo pos = package_posinfo(self->package, stmt->range.start);
+        PosInfo pos = llvm_debug_pos(self, stmt->range.start);
         DILexicalBlock *block = self->dbg.builder->createLexicalBlock(
             arrlast(self->dbg.scopes), self->dbg.file, pos.line, pos.column);
         arrpush(self->dbg.scopes, block);
     }
     if (stmt->flags == FOR_AGGREGATE) {
-        Constant *zero = ConstantInt::get(self->ty.intptr, 0);
-        Constant *one = ConstantInt::get(self->ty.intptr, 1);
-        Sym *value_sym = hmget(self->package->symbols, stmt->sfor.value_name);
-        Type *value_type = llvm_type(self, value_sym->type);
-        Sym *index_sym = NULL;
-        if (stmt->sfor.index_name) hmget(self->package->symbols, stmt->sfor.index_name);
-        u32 value_align = self->data_layout.getPrefTypeAlignment(value_type);
-        u32 index_align = self->data_layout.getPrefTypeAlignment(self->ty.intptr);
-        const char *index_name = index_sym ? index_sym->name : "index";
-        Value *value = emit_entry_alloca(self, value_type, value_sym->name ?: "value", value_align);
-        Value *index = emit_entry_alloca(self, self->ty.intptr, index_name, index_align);
-        create_store(self, zero, index);
-        value_sym->userdata = value;
-        if (index_sym) index_sym->userdata = index;
-
-        Value *aggregate;
-        Value *length;
-        Operand op = hmget(self->package->operands, stmt->sfor.aggregate);
-        switch (op.type->kind) {
-            case TYPE_ARRAY: {
-                aggregate = emit_expr(self, stmt->sfor.aggregate, LVALUE).val;
-                length = Constant::getNullValue(self->ty.intptr);
-                break;
-            }
-            default: fatal("Unhandled type for emission of for aggregate");
-        }
-        cond = BasicBlock::Create(self->context, "for.cond", fn->function);
-        step = BasicBlock::Create(self->context, "for.step", fn->function);
-        body = BasicBlock::Create(self->context, "for.body", fn->function);
-        post = BasicBlock::Create(self->context, "for.post", fn->function);
-
-        self->builder.CreateBr(cond);
-        self->builder.SetInsertPoint(cond);
-
-        set_debug_pos(self, stmt->sfor.aggregate->range);
-        Value *within_bounds = self->builder.CreateICmpSLT(create_load(self, index), length);
-        self->builder.CreateCondBr(within_bounds, body, post);
-        arrpush(fn->loop_cond_blocks, cond);
-        arrpush(fn->post_blocks, post);
-
-        self->builder.SetInsertPoint(body);
-        Value *elptr = self->builder.CreateGEP(aggregate, {zero, create_load(self, index)});
-        set_debug_pos(self, stmt->sfor.value_name->range);
-        create_store(self, create_load(self, elptr), value);
-
-        emit_stmt(self, stmt->sfor.body);
-
-        b32 has_jump = self->builder.GetInsertBlock()->getTerminator() != NULL;
-        if (!has_jump) self->builder.CreateBr(step);
-        self->builder.SetInsertPoint(step);
-        Value *index_incr = self->builder.CreateAdd(create_load(self, index), one);
-        if (stmt->sfor.index_name) set_debug_pos(self, stmt->sfor.index_name->range);
-        create_store(self, index_incr, index);
-        self->builder.CreateBr(cond);
-        self->builder.SetInsertPoint(post);
-        if (compiler.flags.dump_ir || compiler.flags.emit_ir)
-            post->moveAfter(self->builder.GetInsertBlock());
+        emit_stmt_for_aggregate(self, stmt);
+        if (compiler.flags.debug) arrpop(self->dbg.scopes);
         return;
     }
     if (stmt->sfor.init) {
         set_debug_pos(self, stmt->sfor.init->range);
         emit_stmt(self, stmt->sfor.init);
     }
-    if (stmt->sfor.cond) {
-        cond = BasicBlock::Create(self->context, "for.cond", fn->function);
-        if (stmt->sfor.step) {
-            step = BasicBlock::Create(self->context, "for.step", fn->function);
-        }
-        body = BasicBlock::Create(self->context, "for.body", fn->function);
-        post = BasicBlock::Create(self->context, "for.post", fn->function);
-        self->builder.CreateBr(cond ?: body);
+    if (stmt->sfor.cond) cond = BasicBlock::Create(self->context, "for.cond", fn->function);
+    if (stmt->sfor.step) step = BasicBlock::Create(self->context, "for.step", fn->function);
+    body = BasicBlock::Create(self->context, "for.body", fn->function);
+    post = BasicBlock::Create(self->context, "for.post", fn->function);
+    BasicBlock *header = cond ?: body;
+    self->builder.CreateBr(header);
+    if (cond) {
         self->builder.SetInsertPoint(cond);
         set_debug_pos(self, stmt->sfor.cond->range);
         Value *cond_val = emit_expr(self, stmt->sfor.cond).val;
         self->builder.CreateCondBr(cond_val, body, post);
     }
-    arrpush(fn->loop_cond_blocks, cond);
+    arrpush(fn->loop_cond_blocks, step ?: header); // continue runs the step first
     arrpush(fn->post_blocks, post);
     self->builder.SetInsertPoint(body);
     emit_stmt(self, stmt->sfor.body);
     b32 has_jump = self->builder.GetInsertBlock()->getTerminator() != NULL;
-    if (stmt->sfor.step) { // for init; cond; step { ... }
+    if (step) { // for init; cond; step { ... }
         if (!has_jump) self->builder.CreateBr(step);
         self->builder.SetInsertPoint(step);
         set_debug_pos(self, stmt->sfor.step->range);
         emit_stmt(self, stmt->sfor.step);
-        self->builder.CreateBr(cond);
-    } else if (cond) { // for cond { ... }
-        if (!has_jump) self->builder.CreateBr(cond);
-    } else if (!has_jump) { // for { ... }
-        self->builder.CreateBr(body);
+        set_loop_metadata(self, self->builder.CreateBr(header));
+    } else if (!has_jump) { // for cond { ... } and for { ... }
+        set_loop_metadata(self, self->builder.CreateBr(header));
     }
     arrpop(fn->loop_cond_blocks);
     arrpop(fn->post_blocks);
-    if (!self->builder.GetInsertBlock()->getTerminator()) self->builder.CreateBr(post);
     self->builder.SetInsertPoint(post);
     if (compiler.flags.debug) arrpop(self->dbg.scopes);
     if (compiler.flags.dump_ir || compiler.flags.emit_ir)
@@ -1779,14 +2049,14 @@ void emit_decl_var_global(IRContext *self, Decl *decl) {
     Type *type = llvm_type(self, sym->type);
     GlobalVariable *global = new GlobalVariable(
         *self->module, type, /* IsConstant */ false, GlobalValue::ExternalLinkage,
-        init, sym->external_name ?: sym->name);
+        init, llvm_sym_name(sym));
     global->setAlignment(sym->type->align);
     global->setExternallyInitialized(false);
     sym->userdata = global;
     if (compiler.flags.debug) {
-        PosInfo pos = package_posinfo(self->package, sym->decl->range.start);
+        PosInfo pos = llvm_debug_pos(self, sym->decl->range.start);
         self->dbg.builder->createGlobalVariableExpression(
-            arrlast(self->dbg.scopes), sym->name, sym->external_name ?: sym->name,
+            arrlast(self->dbg.scopes), sym->name, global->getName(),
             self->dbg.file, pos.line, llvm_debug_type(self, sym->type),
             /* LocalToUnit */ false, /* Expr */ NULL, /* Decl */ NULL,
             /* TemplateParams */ NULL, sym->type->align * 8);
@@ -1796,11 +2066,11 @@ void emit_decl_var_global(IRContext *self, Decl *decl) {
 
 void declare_auto_variable(IRContext *self, Sym *sym) {
     TRACE(EMITTING);
-    PosInfo pos = package_posinfo(self->package, sym->decl->range.start);
+    PosInfo pos = llvm_debug_pos(self, sym->decl->range.start);
     BasicBlock *block = self->builder.GetInsertBlock();
     DIScope *scope = arrlast(self->dbg.scopes);
     DIExpression *expr = self->dbg.builder->createExpression();
-    DILocation *loc = DebugLoc::get(pos.line, pos.column, scope);
+    DILocation *loc = llvm_debug_location(self, pos, scope);
     DIType *type = llvm_debug_type(self, sym->type);
     DILocalVariable *d = self->dbg.builder->createAutoVariable(scope, sym->name, self->dbg.file, pos.line, type);
     self->dbg.builder->insertDeclare((Value *) sym->userdata, d, expr, loc, block);
@@ -1873,7 +2143,7 @@ void emit_decl_val(IRContext *self, Decl *decl) {
     GlobalValue::LinkageTypes linkage = self->fn ?
     GlobalValue::CommonLinkage : GlobalValue::ExternalLinkage;
     GlobalVariable *global = new GlobalVariable(
-        *self->module, type, true, linkage, (Constant *) value, sym->name);
+        *self->module, type, true, linkage, (Constant *) value, llvm_sym_name(sym));
     sym->userdata = global;
 }
 
@@ -1891,7 +2161,7 @@ void emit_decl_foreign(IRContext *self, Decl *decl) {
     Type *type = llvm_type(self, operand.type);
     if (operand.type->kind == TYPE_FUNC) {
         FunctionType *fn_ty = (FunctionType *) type->getPointerElementType();
-        Function *fn = (Function *) self->module->getOrInsertFunction(sym->external_name, fn_ty);
+        Function *fn = (Function *) self->module->getOrInsertFunction(llvm_sym_name(sym), fn_ty);
         fn->setCallingConv(CallingConv::C);
 
 //        Function *fn = Function::Create(
@@ -1911,7 +2181,7 @@ void emit_decl_foreign(IRContext *self, Decl *decl) {
         return;
     }
 
-    Constant *val = self->module->getOrInsertGlobal(sym->external_name ?: sym->name, type);
+    Constant *val = self->module->getOrInsertGlobal(llvm_sym_name(sym), type);
     GlobalVariable *var = (GlobalVariable *) val;
     var->setExternallyInitialized(true);
     var->setConstant(false);
@@ -1932,7 +2202,7 @@ void emit_stmt(IRContext *self, Stmt *stmt) {
             if (!compiler.flags.debug) return;
             Source *file = ((Decl *) stmt)->dfile;
             self->dbg.source_file = file;
-            self->dbg.file = self->dbg.builder->createFile(file->filename, self->package->path);
+            self->dbg.file = llvm_debug_file(self, file);
             arrsetlen(self->dbg.scopes, 1); // 1 so we keep the compile unit at the top.
             arrpush(self->dbg.scopes, self->dbg.file);
             break;
@@ -1998,25 +2268,183 @@ void emit_decl(IRContext *self, Decl *decl) {
     }
 }
 
+/*
+ Objects are cached under a hash of everything emitting them depends on: the module's bitcode, the
+ target and the flags affecting optimization and code generation. Each object is a file named
+ llvmcache-<hash>, partitions have .<partition> appended, which pruneCache evicts least recently used
+ first once the cache outgrows LLVM_CACHE_MAX_BYTES. Cached objects are hard linked, or copied where
+ that isn't possible, into the output or the scratch directory objects are linked from, so no build
+ pruning the cache can remove one before it is linked. The cache is pruned once linking is done.
+*/
+#define LLVM_CACHE_MAX_BYTES (1024ull * 1024 * 1024)
+
+static std::atomic<u32> cache_hits;
+static std::atomic<u32> cache_misses;
+
+void llvm_cache_dir(SmallVectorImpl<char> &dir) {
+    if (*compiler.cache_dir) {
+        dir.append(compiler.cache_dir, compiler.cache_dir + strlen(compiler.cache_dir));
+    } else {
+        sys::path::cache_directory(dir);
+        sys::path::append(dir, "kai");
+    }
+}
+
+void llvm_cache_path(StringRef key, u32 partition, SmallVectorImpl<char> &path) {
+    llvm_cache_dir(path);
+    sys::path::append(path, "llvmcache-" + key);
+    if (partition) (Twine(".") + Twine(partition)).toVector(path);
+}
+
+std::string llvm_cache_key(IRContext *self, u32 partitions) {
+    TRACE(LLVM);
+    SmallVector<char, 0> bitcode;
+    raw_svector_ostream os(bitcode);
+    WriteBitcodeToFile(*self->module, os);
+
+    SHA1 hasher;
+    hasher.update(StringRef(bitcode.data(), bitcode.size()));
+    hasher.update(VERSION);
+    hasher.update(LLVM_VERSION_STRING);
+    hasher.update(self->target->getTargetTriple().str());
+    hasher.update(self->target->getTargetCPU());
+    hasher.update(self->target->getTargetFeatureString());
+    u32 flags[] = {
+        (u32) self->target->getOptLevel(), partitions, (u32) compiler.flags.debug,
+        (u32) compiler.flags.small, (u32) compiler.flags.disable_all_passes,
+        (u32) compiler.flags.opt_level, (u32) compiler.target_output, (u32) compiler.flags.profile_generate,
+    };
+    hasher.update(ArrayRef<uint8_t>((uint8_t *) flags, sizeof flags));
+    // Objects optimized with a profile are only reused while the profile is unchanged
+    if (*compiler.profile_use_path) {
+        auto profile = MemoryBuffer::getFile(compiler.profile_use_path);
+        if (profile) hasher.update((*profile)->getBuffer());
+    }
+    return toHex(hasher.final());
+}
+
+// Uses the cached objects for key, false when any is missing
+bool llvm_cache_fetch(IRContext *self, StringRef key) {
+    TRACE(LLVM);
+    for (u32 i = 0; i < self->objects.size(); i++) {
+        SmallString<MAX_PATH> path;
+        llvm_cache_path(key, i, path);
+        if (!sys::fs::exists(path)) {
+            cache_misses++;
+            return false;
+        }
+    }
+    for (u32 i = 0; i < self->objects.size(); i++) {
+        SmallString<MAX_PATH> path;
+        llvm_cache_path(key, i, path);
+        // Pruning goes by access time, which file systems mounted relatime may not update on reads
+        int fd;
+        if (!sys::fs::openFileForWrite(path, fd, sys::fs::CD_OpenExisting, sys::fs::F_Append)) {
+            sys::fs::setLastModificationAndAccessTime(fd, std::chrono::system_clock::now());
+            sys::Process::SafelyCloseFileDescriptor(fd);
+        }
+        self->objects[i].path.assign(path.begin(), path.end());
+    }
+    verbose("Using cached object for %s", self->package->path);
+    cache_hits++;
+    return true;
+}
+
+// Writes the object's buffer to file, closing it
+bool write_object(raw_fd_ostream &file, const ObjectFile &object, StringRef path) {
+    file << StringRef(object.buffer.data(), object.buffer.size());
+    file.close();
+    if (file.has_error()) {
+        warn("Could not write object %s: %s", path.str().c_str(), file.error().message().c_str());
+        file.clear_error();
+        return true;
+    }
+    return false;
+}
+
+void llvm_cache_store(IRContext *self, StringRef key) {
+    TRACE(LLVM);
+    SmallString<MAX_PATH> dir;
+    llvm_cache_dir(dir);
+    if (sys::fs::create_directories(dir)) return;
+    for (u32 i = 0; i < self->objects.size(); i++) {
+        SmallString<MAX_PATH> path, temp;
+        llvm_cache_path(key, i, path);
+        // Written under a unique name then renamed so other builds never see a partial object
+        int fd;
+        if (sys::fs::createUniqueFile(Twine(path) + ".tmp%%%%%%", fd, temp)) return;
+        raw_fd_ostream file(fd, true);
+        if (write_object(file, self->objects[i], temp) || sys::fs::rename(temp, path)) {
+            sys::fs::remove(temp);
+            return;
+        }
+    }
+}
+
+void llvm_cache_prune() {
+    TRACE(LLVM);
+    SmallString<MAX_PATH> dir;
+    llvm_cache_dir(dir);
+    CachePruningPolicy policy;
+    policy.MaxSizeBytes = LLVM_CACHE_MAX_BYTES;
+    pruneCache(dir, policy);
+}
+
 static void addDiscriminatorsPass(const PassManagerBuilder &Builder, legacy::PassManagerBase &PM) {
     PM.add(createAddDiscriminatorsPass());
 }
 
+// Splits the optimized module into partitions code generated each on a thread of its own, the first
+// into the package's object and the rest into partition objects linked along with it
+void emit_partitions(IRContext *self, raw_pwrite_stream &dest, u32 partitions) {
+    TRACE(LLVM);
+    std::vector<std::unique_ptr<raw_svector_ostream>> buffers;
+    std::vector<raw_pwrite_stream *> streams = { &dest };
+    for (u32 i = 1; i < partitions; i++) {
+        buffers.push_back(llvm::make_unique<raw_svector_ostream>(self->objects[i].buffer));
+        streams.push_back(buffers.back().get());
+    }
+    auto target_machine = [] { return std::unique_ptr<TargetMachine>(llvm_target_machine()); };
+    std::unique_ptr<Module> module(self->module);
+    // The module is consumed unless it was left as a single partition
+    self->module = splitCodeGen(std::move(module), streams, {}, target_machine).release();
+}
+
+// Adds the passes writing the module to dest, returning true when the target can't emit objects
+bool add_output_passes(IRContext *self, legacy::PassManager &module_pm, raw_pwrite_stream &dest, u32 partitions) {
+    // ThinLTO bitcode with the module's summary, code is generated by llvm_thin_link
+    if (compiler.flags.lto == LTO_THIN) {
+        module_pm.add(createWriteThinLTOBitcodePass(dest));
+        return false;
+    }
+    // With more than 1 codegen thread module_pm only optimizes, code is generated by emit_partitions
+    if (partitions > 1) return false;
+    TargetMachine::CodeGenFileType file_type = TargetMachine::CGFT_ObjectFile; // TODO: Assembly
+    if (self->target->addPassesToEmitFile(module_pm, dest, nullptr, file_type)) {
+        errs() << "TargetMachine cannot emit a file of this type";
+        return true;
+    }
+    return false;
+}
+
 bool llvm_emit_object(Package *package) {
     TRACE(LLVM);
     IRContext *self = (IRContext *) package->userdata;
+    u32 partitions = compiler.flags.codegen_threads;
+    self->objects.resize(partitions);
 
-    char object_name[MAX_PATH];
-    package_object_path(package, object_name);
-
-    std::error_code ec;
-    raw_fd_ostream dest(object_name, ec);
-
-    if (ec) {
-        fatal("Could not open object file: %s\n", ec.message().c_str());
-        return false;
+    // Cache hits skip straight to linking, so they can't dump or emit the optimized IR. ThinLTO
+    // caches the objects generated by llvm_thin_link instead
+    bool cached = compiler.flags.cache && !compiler.flags.dump_ir && !compiler.flags.emit_ir &&
+        compiler.flags.lto == LTO_NONE;
+    std::string cache_key;
+    if (cached) {
+        cache_key = llvm_cache_key(self, partitions);
+        if (llvm_cache_fetch(self, cache_key)) return false;
     }
 
+    raw_svector_ostream dest(self->objects[0].buffer);
+
 //    if (compiler.flags.dump_ir) {
 //        std::string buf;
 //        raw_string_ostream os(buf);
@@ -2031,28 +2459,32 @@ bool llvm_emit_object(Package *package) {
         return true;
     }
 
-    pm_builder->OptLevel = self->target->getOptLevel();
-    pm_builder->SizeLevel = compiler.flags.small ? 2 : 0;
+    bool optimize = compiler.flags.opt_level != OPT_LEVEL_0;
+    pm_builder->OptLevel = compiler.flags.opt_level == OPT_LEVEL_SIZE ? 2 : compiler.flags.opt_level;
+    pm_builder->SizeLevel = compiler.flags.small ? 2 : compiler.flags.opt_level == OPT_LEVEL_SIZE ? 1 : 0;
 
     pm_builder->DisableTailCalls = compiler.flags.debug;
     pm_builder->DisableUnitAtATime = compiler.flags.debug;
     pm_builder->DisableUnrollLoops = compiler.flags.debug;
-    pm_builder->SLPVectorize = !compiler.flags.debug;
-    pm_builder->LoopVectorize = !compiler.flags.debug;
+    pm_builder->SLPVectorize = !compiler.flags.debug && pm_builder->OptLevel > 1;
+    pm_builder->LoopVectorize = !compiler.flags.debug && pm_builder->OptLevel > 1 && pm_builder->SizeLevel < 2;
     pm_builder->RerollLoops = !compiler.flags.debug;
     pm_builder->DisableGVNLoadPRE = compiler.flags.debug;
     pm_builder->VerifyInput = compiler.flags.assertions;
     pm_builder->VerifyOutput = compiler.flags.assertions;
     pm_builder->MergeFunctions = !compiler.flags.debug;
     pm_builder->PrepareForLTO = false;
-    pm_builder->PrepareForThinLTO = false;
+    pm_builder->PrepareForThinLTO = compiler.flags.lto == LTO_THIN;
     pm_builder->PerformThinLTO = false;
+    // Instrumented to write default.profraw when run, or optimized with what such a run recorded
+    pm_builder->EnablePGOInstrGen = compiler.flags.profile_generate;
+    pm_builder->PGOInstrUse = compiler.profile_use_path;
 
     Triple triple = Triple(self->module->getTargetTriple());
     TargetLibraryInfoImpl tlii(triple);
     pm_builder->LibraryInfo = &tlii;
 
-    if (compiler.flags.debug) {
+    if (compiler.flags.debug || !optimize) {
         pm_builder->Inliner = createAlwaysInlinerLegacyPass(false);
     } else {
         self->target->adjustPassManager(*pm_builder);
@@ -2065,28 +2497,23 @@ bool llvm_emit_object(Package *package) {
     pm_builder->populateFunctionPassManager(function_pm);
 
     legacy::PassManager module_pm;
-    TargetMachine::CodeGenFileType file_type = TargetMachine::CGFT_ObjectFile; // TODO: Assembly
 
     if (compiler.flags.disable_all_passes) {
-        if (self->target->addPassesToEmitFile(module_pm, dest, nullptr, file_type)) {
-            errs() << "TargetMachine cannot emit a file of this type";
-            return false;
-        }
+        if (add_output_passes(self, module_pm, dest, partitions)) return false;
         module_pm.run(*self->module);
     } else {
         pm_builder->populateModulePassManager(module_pm);
 
-        module_pm.add(createBasicAAWrapperPass());
-        module_pm.add(createInstructionCombiningPass());
-        module_pm.add(createAggressiveDCEPass());
-        module_pm.add(createReassociatePass());
-        module_pm.add(createPromoteMemoryToRegisterPass());
-
-        if (self->target->addPassesToEmitFile(module_pm, dest, nullptr, file_type)) {
-            errs() << "TargetMachine cannot emit a file of this type";
-            return false;
+        if (optimize) {
+            module_pm.add(createBasicAAWrapperPass());
+            module_pm.add(createInstructionCombiningPass());
+            module_pm.add(createAggressiveDCEPass());
+            module_pm.add(createReassociatePass());
+            module_pm.add(createPromoteMemoryToRegisterPass());
         }
 
+        if (add_output_passes(self, module_pm, dest, partitions)) return false;
+
         // run per function optimization passes
         function_pm.doInitialization();
         for (Function &function : *self->module)
@@ -2096,7 +2523,6 @@ bool llvm_emit_object(Package *package) {
 
         module_pm.run(*self->module);
     }
-    dest.flush();
 
     if (compiler.flags.dump_ir) {
         std::string buf;
@@ -2118,9 +2544,9 @@ bool llvm_emit_object(Package *package) {
         }
     }
 
-    if (true) { // TODO: compiler.flags.timing
-        TimerGroup::printAll(errs());
-    }
+    if (partitions > 1) emit_partitions(self, dest, partitions);
+
+    if (cached) llvm_cache_store(self, cache_key);
 
     return false; // no error
 }
@@ -2132,9 +2558,671 @@ bool llvm_build_module(Package *package) {
     for (int i = 0; i < arrlen(package->stmts); i++) {
         emit_stmt(context, package->stmts[i]);
     }
+    // -O0 is for compiling quickly, the module is only verified when asked to with -assertions
+    if (compiler.flags.opt_level == OPT_LEVEL_0 && !compiler.flags.assertions) return false;
     return llvm_validate(context);
 }
 
+/*
+ Packages share nothing the backend writes to while being built or emitted, their modules each have
+ an LLVMContext of their own, so every package is built and emitted on a thread of its own. Each is
+ emitted to its own object and references between packages are resolved when the objects are linked.
+*/
+bool llvm_build_modules(PackageMapEntry *packages) {
+    TRACE(EMITTING);
+    setupTarget();
+    std::atomic<bool> failure(false);
+    ThreadPool pool;
+    for (i64 i = 0; i < hmlen(packages); i++) {
+        Package *package = packages[i].value;
+        pool.async([package, &failure] {
+            Timing start;
+            if (compiler.flags.time_report) start = timing_now(true);
+            if (llvm_build_module(package)) failure = true;
+            if (compiler.flags.time_report) timing_add(&package->build_timing, start, true);
+        });
+    }
+    pool.wait();
+    return failure;
+}
+
+/*
+ With -lto=thin every package's object is first emitted as bitcode along with a summary of its module.
+ The thin link reads the summaries of all packages, deciding which functions are imported into which
+ modules and what can be internalized, then the backend optimizes and generates code for each package
+ on a thread of its own, replacing its bitcode with the native object. The backend's objects are kept
+ in the object cache, keyed by LLVM on the module, everything imported into it and the configuration.
+*/
+bool llvm_thin_link(PackageMapEntry *packages) {
+    TRACE(LLVM);
+    TargetMachine *tm = llvm_target_machine();
+    if (!tm) return true;
+
+    lto::Config config;
+    config.CPU = tm->getTargetCPU().str();
+    SubtargetFeatures features(tm->getTargetFeatureString());
+    config.MAttrs = features.getFeatures();
+    config.Options = tm->Options;
+    config.RelocModel = tm->getRelocationModel();
+    config.CGOptLevel = tm->getOptLevel();
+    config.OptLevel = compiler.flags.opt_level == OPT_LEVEL_SIZE ? 2 : compiler.flags.opt_level;
+    config.DefaultTriple = tm->getTargetTriple().str();
+    delete tm;
+
+    lto::LTO lto(std::move(config), lto::createInProcessThinBackend(heavyweight_hardware_concurrency()));
+
+    // Executables only export main, everything else may be internalized. Libraries export everything
+    bool exec = compiler.target_output == OutputType_Exec;
+    StringSet<> prevailing;
+    for (i64 i = 0; i < hmlen(packages); i++) {
+        Package *package = packages[i].value;
+        IRContext *self = (IRContext *) package->userdata;
+        SmallVectorImpl<char> &bitcode = self->objects[0].buffer;
+        auto input = lto::InputFile::create(MemoryBufferRef(StringRef(bitcode.data(), bitcode.size()), package->path));
+        if (!input) {
+            warn("Invalid bitcode for %s: %s", package->path, toString(input.takeError()).c_str());
+            return true;
+        }
+        std::vector<lto::SymbolResolution> resolutions;
+        for (const lto::InputFile::Symbol &symbol : (*input)->symbols()) {
+            lto::SymbolResolution resolution;
+            bool definition = !symbol.isUndefined();
+            resolution.Prevailing = definition && prevailing.insert(symbol.getName()).second;
+            resolution.FinalDefinitionInLinkageUnit = definition && exec;
+            resolution.VisibleToRegularObj = !exec || symbol.getName() == "main";
+            resolutions.push_back(resolution);
+        }
+        if (Error error = lto.add(std::move(*input), resolutions)) {
+            warn("ThinLTO failed to add %s: %s", package->path, toString(std::move(error)).c_str());
+            return true;
+        }
+    }
+
+    // The bitcode is read until the run ends, the native objects replace it once it has
+    std::vector<SmallVector<char, 0>> natives(hmlen(packages));
+    // ThinLTO tasks are numbered from 1 in the order their modules were added, 0 is for regular LTO
+    auto native = [&natives](unsigned task) -> SmallVectorImpl<char> & {
+        if (task == 0 || task > natives.size()) fatal("Unexpected ThinLTO task %u", task);
+        return natives[task - 1];
+    };
+    auto add_stream = [native](unsigned task) {
+        auto stream = llvm::make_unique<raw_svector_ostream>(native(task));
+        return llvm::make_unique<lto::NativeObjectStream>(std::move(stream));
+    };
+    // Called instead of add_stream with the object of a task found in the cache
+    auto add_buffer = [native](unsigned task, std::unique_ptr<MemoryBuffer> buffer) {
+        native(task).assign(buffer->getBufferStart(), buffer->getBufferEnd());
+    };
+
+    lto::NativeObjectCache cache;
+    if (compiler.flags.cache) {
+        SmallString<MAX_PATH> dir;
+        llvm_cache_dir(dir);
+        auto local = localCache(dir, add_buffer);
+        if (local) cache = std::move(*local);
+        else warn("Object cache disabled: %s", toString(local.takeError()).c_str());
+    }
+
+    if (Error error = lto.run(add_stream, cache)) {
+        warn("ThinLTO failed: %s", toString(std::move(error)).c_str());
+        return true;
+    }
+    for (i64 i = 0; i < hmlen(packages); i++) {
+        IRContext *self = (IRContext *) packages[i].value->userdata;
+        self->objects[0].buffer = std::move(natives[i]);
+    }
+    return false;
+}
+
+/*
+ Objects are emitted to memory and only written to files when something needs them as files. With
+ -no-link or -emit-obj they are the output and are written next to the sources, otherwise they are
+ written for the linker into a scratch directory removed once linked. Static libraries are archived
+ straight from memory, and objects found in the object cache are linked into the scratch directory.
+*/
+static SmallString<MAX_PATH> scratch_dir;
+
+bool llvm_write_object(Package *package) {
+    TRACE(LLVM);
+    IRContext *self = (IRContext *) package->userdata;
+    bool output = !compiler.flags.link || compiler.flags.emit_obj;
+    for (u32 i = 0; i < self->objects.size(); i++) {
+        ObjectFile &object = self->objects[i];
+        char object_name[MAX_PATH];
+        package_partition_path(package, i, object_name);
+        if (output) {
+            // The object may be a hard link into the cache, it is replaced rather than written through
+            sys::fs::remove(object_name);
+            if (!object.path.empty()) {
+                if (sys::fs::create_hard_link(object.path, object_name) &&
+                    sys::fs::copy_file(object.path, object_name)) {
+                    warn("Could not copy cached object to %s", object_name);
+                    return true;
+                }
+            } else {
+                std::error_code ec;
+                raw_fd_ostream file(object_name, ec);
+                if (ec) fatal("Could not open object file: %s\n", ec.message().c_str());
+                if (write_object(file, object, object_name)) return true;
+            }
+            object.path = object_name;
+        } else if (!object.path.empty()) {
+            SmallString<MAX_PATH> path(scratch_dir);
+            sys::path::append(path, sys::path::filename(object.path));
+            if (!sys::fs::exists(path) && sys::fs::create_hard_link(object.path, path) &&
+                sys::fs::copy_file(object.path, path)) {
+                warn("Could not copy cached object to %s", path.c_str());
+                return true;
+            }
+            object.path.assign(path.begin(), path.end());
+        } else if (compiler.target_output != OutputType_Static) {
+            SmallString<MAX_PATH> path;
+            int fd;
+            StringRef stem = sys::path::stem(object_name);
+            std::error_code ec = sys::fs::createUniqueFile(Twine(scratch_dir) + "/" + stem + "-%%%%%%.o", fd, path);
+            if (ec) fatal("Could not open object file: %s\n", ec.message().c_str());
+            raw_fd_ostream file(fd, true);
+            if (write_object(file, object, path)) return true;
+            object.path.assign(path.begin(), path.end());
+        }
+    }
+    return false;
+}
+
+void llvm_remove_scratch_dir() {
+    if (scratch_dir.empty()) return;
+    sys::fs::remove_directories(scratch_dir);
+    scratch_dir.clear();
+}
+
+// The runtime clang links for -fprofile-generate, in the resource directory of the LLVM we're built with
+const char *llvm_profile_runtime() {
+    static std::string runtime;
+    if (!runtime.empty()) return runtime.c_str();
+    Triple triple = Triple(sys::getDefaultTargetTriple());
+    SmallString<MAX_PATH> dir = StringRef(LLVM_LIBDIR);
+    sys::path::append(dir, "clang", LLVM_VERSION_STRING, "lib");
+    SmallString<MAX_PATH> candidates[2] = {dir, dir};
+    if (triple.isOSDarwin()) {
+        sys::path::append(candidates[0], "darwin", "libclang_rt.profile_osx.a");
+    } else {
+        sys::path::append(candidates[0], "linux", "libclang_rt.profile-" + triple.getArchName() + ".a");
+        sys::path::append(candidates[1], triple.str(), "libclang_rt.profile.a"); // per target runtime directories
+    }
+    for (SmallString<MAX_PATH> &candidate : candidates) {
+        if (sys::fs::is_regular_file(candidate)) {
+            runtime.assign(candidate.begin(), candidate.end());
+            return runtime.c_str();
+        }
+    }
+    return nullptr;
+}
+
+// Paths of the objects written or cached for the linker, owned by the packages' contexts
+const char **llvm_object_paths(PackageMapEntry *packages) {
+    const char **paths = NULL;
+    for (i64 i = 0; i < hmlen(packages); i++) {
+        IRContext *self = (IRContext *) packages[i].value->userdata;
+        for (ObjectFile &object : self->objects)
+            if (!object.path.empty()) arrput(paths, object.path.c_str());
+    }
+    return paths;
+}
+
+bool llvm_emit_objects(PackageMapEntry *packages) {
+    TRACE(LLVM);
+    // Equivalent to LLVM's -time-passes, every pass is timed and reported with the stages
+    TimePassesIsEnabled = compiler.flags.time_report;
+    std::atomic<bool> failure(false);
+    ThreadPool pool;
+    for (i64 i = 0; i < hmlen(packages); i++) {
+        Package *package = packages[i].value;
+        pool.async([package, &failure] {
+            Timing start;
+            if (compiler.flags.time_report) start = timing_now(true);
+            if (llvm_emit_object(package)) failure = true;
+            if (compiler.flags.time_report) timing_add(&package->emit_timing, start, true);
+        });
+    }
+    pool.wait();
+
+    if (!failure && compiler.flags.lto == LTO_THIN && llvm_thin_link(packages)) failure = true;
+
+    bool scratch = compiler.flags.link && !compiler.flags.emit_obj;
+    if (!failure && scratch && scratch_dir.empty()) {
+        if (std::error_code ec = sys::fs::createUniqueDirectory("kai", scratch_dir))
+            fatal("Could not create scratch directory: %s\n", ec.message().c_str());
+        verbose("Scratch directory: %s", scratch_dir.c_str());
+    }
+    for (i64 i = 0; i < hmlen(packages) && !failure; i++)
+        if (llvm_write_object(packages[i].value)) failure = true;
+
+    if (compiler.flags.cache) {
+        // Otherwise the cache is pruned once the objects are linked, see compiler_link_objects
+        if (!compiler.flags.link) llvm_cache_prune();
+        verbose("Object cache: %u hits, %u misses", cache_hits.load(), cache_misses.load());
+    }
+
+    if (compiler.flags.time_report) TimerGroup::printAll(errs());
+    return failure;
+}
+
+// Loads a library named by #library into the process, resolved by library_open as the VM does
+bool llvm_load_library(const char *name) {
+    void *library = library_open(name, compiler.library_search_paths, compiler.num_library_search_paths);
+    return library && sys::DynamicLibrary::addPermanentLibrary(library).isValid();
+}
+
+bool llvm_load_framework(const char *name) {
+    char path[MAX_PATH];
+    for (int i = 0; i < compiler.num_framework_search_paths; i++) {
+        snprintf(path, sizeof path, "%s/%s.framework/%s", compiler.framework_search_paths[i], name, name);
+        if (file_mode(path) == FILE_REGULAR) return !sys::DynamicLibrary::LoadLibraryPermanently(path);
+    }
+    snprintf(path, sizeof path, "/System/Library/Frameworks/%s.framework/%s", name, name);
+    return !sys::DynamicLibrary::LoadLibraryPermanently(path);
+}
+
+/*
+ kai run: rather than emitting objects and linking them the modules of all packages are added to an
+ LLJIT session, where references between packages resolve as they would once linked and everything
+ else resolves against the process and the libraries named by #library loaded into it. main is then
+ called directly, with the arguments following the input, and what it returns is the exit code.
+ The modules are only code generated, at the level given by -O, the IR isn't optimized further.
+*/
+bool llvm_run_modules(PackageMapEntry *packages, int argc, const char **argv, int *exit_code) {
+    TRACE(LLVM);
+    setupTarget();
+
+    auto builder = orc::JITTargetMachineBuilder::detectHost();
+    if (!builder) {
+        logAllUnhandledErrors(builder.takeError(), errs(), "Failed to create the JIT: ");
+        return true;
+    }
+    builder->setCodeGenOptLevel(llvm_codegen_level());
+    auto layout = builder->getDefaultDataLayoutForTarget();
+    if (!layout) {
+        logAllUnhandledErrors(layout.takeError(), errs(), "Failed to create the JIT: ");
+        return true;
+    }
+    auto created = orc::LLJIT::Create(std::move(*builder), std::move(*layout));
+    if (!created) {
+        logAllUnhandledErrors(created.takeError(), errs(), "Failed to create the JIT: ");
+        return true;
+    }
+    std::unique_ptr<orc::LLJIT> jit = std::move(*created);
+
+    for (i64 i = 0; i < arrlen(compiler.libraries); i++)
+        if (!llvm_load_library(compiler.libraries[i]))
+            warn("Failed to load library %s", compiler.libraries[i]);
+    for (i64 i = 0; i < arrlen(compiler.frameworks); i++)
+        if (!llvm_load_framework(compiler.frameworks[i]))
+            warn("Failed to load framework %s", compiler.frameworks[i]);
+    auto generator = orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(jit->getDataLayout());
+    if (!generator) {
+        logAllUnhandledErrors(generator.takeError(), errs(), "Failed to create the JIT: ");
+        return true;
+    }
+    jit->getMainJITDylib().setGenerator(std::move(*generator));
+
+    // main may take argc and argv and may return the exit code, the module isn't ours once added
+    bool found_main = false, main_args = false, main_result = false;
+    for (i64 i = 0; i < hmlen(packages); i++) {
+        IRContext *self = (IRContext *) packages[i].value->userdata;
+        std::unique_ptr<Module> module(self->module);
+        self->module = nullptr;
+        Function *main = module->getFunction("main");
+        if (main && !main->isDeclaration()) {
+            found_main = true;
+            main_args = main->arg_size() >= 2;
+            main_result = main->getReturnType()->isIntegerTy();
+        }
+        orc::ThreadSafeContext context(std::unique_ptr<LLVMContext>(&self->context));
+        if (Error error = jit->addIRModule(orc::ThreadSafeModule(std::move(module), context))) {
+            logAllUnhandledErrors(std::move(error), errs(), "Failed to add module: ");
+            return true;
+        }
+    }
+    if (!found_main) {
+        warn("No main function to run");
+        return true;
+    }
+
+    auto symbol = jit->lookup("main");
+    if (!symbol) {
+        logAllUnhandledErrors(symbol.takeError(), errs(), "Failed to compile main: ");
+        return true;
+    }
+    if (Error error = jit->runConstructors()) {
+        logAllUnhandledErrors(std::move(error), errs(), "Failed to run constructors: ");
+        return true;
+    }
+    JITTargetAddress address = symbol->getAddress();
+    if (main_args) {
+        *exit_code = ((int (*)(int, char **)) address)(argc, (char **) argv);
+    } else if (main_result) {
+        *exit_code = ((int (*)(void)) address)();
+    } else {
+        ((void (*)(void)) address)();
+        *exit_code = 0;
+    }
+    if (Error error = jit->runDestructors()) {
+        logAllUnhandledErrors(std::move(error), errs(), "Failed to run destructors: ");
+        return true;
+    }
+    return false;
+}
+
+bool llvm_link_elf(const char **args, int num_args) {
+    TRACE(LINKING);
+    return !lld::elf::link(ArrayRef<const char *>(args, num_args), false, errs());
+}
+
+// Archives the objects of a static library, with a symbol table so it needn't be ranlib'd
+bool llvm_archive(const char *output, PackageMapEntry *packages) {
+    TRACE(LINKING);
+    BumpPtrAllocator allocator;
+    StringSaver names(allocator); // of members from memory, which only reference their names
+    std::vector<NewArchiveMember> members;
+    for (i64 i = 0; i < hmlen(packages); i++) {
+        Package *package = packages[i].value;
+        IRContext *self = (IRContext *) package->userdata;
+        for (u32 partition = 0; partition < self->objects.size(); partition++) {
+            ObjectFile &object = self->objects[partition];
+            if (object.path.empty()) {
+                char object_name[MAX_PATH];
+                package_partition_path(package, partition, object_name);
+                StringRef name = names.save(sys::path::filename(object_name));
+                StringRef buffer(object.buffer.data(), object.buffer.size());
+                members.push_back(NewArchiveMember(MemoryBufferRef(buffer, name)));
+                continue;
+            }
+            auto member = NewArchiveMember::getFile(object.path, true);
+            if (!member) {
+                logAllUnhandledErrors(member.takeError(), errs(), "Failed to archive object: ");
+                return true;
+            }
+            members.push_back(std::move(*member));
+        }
+    }
+    bool darwin = Triple(sys::getProcessTriple()).isOSDarwin();
+    object::Archive::Kind kind = darwin ? object::Archive::K_DARWIN : object::Archive::K_GNU;
+    if (Error error = writeArchive(output, members, true, kind, true, false)) {
+        logAllUnhandledErrors(std::move(error), errs(), "Failed to write archive: ");
+        return true;
+    }
+    return false;
+}
+
+/*
+ Native code for hot bytecode, see vm_tier_region. Every region is translated into a function of its
+ own module added to a single LLJIT session which lives as long as the compiler. The function
+ accesses registers through the window pointer just as the interpreter does, so memory addressed
+ through pointers into the VM stack stays coherent, and returns the index of the instruction to
+ resume interpreting at.
+ */
+
+static orc::LLJIT *bytecode_jit;
+static orc::ThreadSafeContext *bytecode_jit_context;
+
+orc::LLJIT *llvm_bytecode_jit() {
+    static bool initialized;
+    if (initialized) return bytecode_jit;
+    initialized = true;
+    setupTarget();
+
+    auto builder = orc::JITTargetMachineBuilder::detectHost();
+    if (!builder) {
+        logAllUnhandledErrors(builder.takeError(), errs(), "Failed to create the bytecode JIT: ");
+        return nullptr;
+    }
+    auto layout = builder->getDefaultDataLayoutForTarget();
+    if (!layout) {
+        logAllUnhandledErrors(layout.takeError(), errs(), "Failed to create the bytecode JIT: ");
+        return nullptr;
+    }
+    auto jit = orc::LLJIT::Create(std::move(*builder), std::move(*layout));
+    if (!jit) {
+        logAllUnhandledErrors(jit.takeError(), errs(), "Failed to create the bytecode JIT: ");
+        return nullptr;
+    }
+    bytecode_jit = jit->release();
+    bytecode_jit_context = new orc::ThreadSafeContext(llvm::make_unique<LLVMContext>());
+    return bytecode_jit;
+}
+
+struct BCTranslation {
+    IRBuilder<> builder;
+    Value *r;           // the register window
+    Value *vm;
+    Value *flgs_out;
+    AllocaInst *flgs;
+    BasicBlock **blocks; // indexed by instruction
+    VMTierInst **insts;  // indexed by instruction, NULL for those outside of the region
+
+    BCTranslation(LLVMContext &context) : builder(context) {}
+};
+
+Value *bc_jit_reg(BCTranslation *t, u64 reg) {
+    return t->builder.CreateGEP(t->r, t->builder.getInt64(reg));
+}
+
+Value *bc_jit_operand(BCTranslation *t, VMTierInst *inst, Val val, u8 mask) {
+    if (inst->regs & mask) return t->builder.CreateLoad(bc_jit_reg(t, val.u));
+    return t->builder.getInt64(val.u);
+}
+
+Value *bc_jit_f64(BCTranslation *t, Value *val) {
+    return t->builder.CreateBitCast(val, t->builder.getDoubleTy());
+}
+
+Value *bc_jit_u64(BCTranslation *t, Value *val) {
+    return t->builder.CreateBitCast(val, t->builder.getInt64Ty());
+}
+
+void bc_jit_exit(BCTranslation *t, u32 index) {
+    t->builder.CreateStore(t->builder.CreateLoad(t->flgs), t->flgs_out);
+    t->builder.CreateRet(t->builder.getInt32(index));
+}
+
+// Branches to next when cond holds and exits to the interpreter at inst otherwise
+void bc_jit_check(BCTranslation *t, VMTierInst *inst, Value *cond, BasicBlock *next) {
+    BasicBlock *current = t->builder.GetInsertBlock();
+    BasicBlock *fail = BasicBlock::Create(t->builder.getContext(), "exit", current->getParent());
+    t->builder.CreateCondBr(cond, next, fail);
+    t->builder.SetInsertPoint(fail);
+    bc_jit_exit(t, inst->index);
+}
+
+Value *bc_jit_address(BCTranslation *t, VMTierInst *inst) {
+    IRBuilder<> &b = t->builder;
+    if (bc_addresses_xy((u8) inst->opcode)) {
+        return b.CreateAdd(b.CreateLoad(bc_jit_reg(t, inst->x)), bc_jit_operand(t, inst, inst->y, 0x2));
+    }
+    return b.CreateAdd(bc_jit_operand(t, inst, inst->y, 0x2), bc_jit_operand(t, inst, inst->z, 0x4));
+}
+
+void bc_jit_inst(BCTranslation *t, VMTierInst *inst) {
+    IRBuilder<> &b = t->builder;
+    b.SetInsertPoint(t->blocks[inst->index]);
+    if (inst->exit) {
+        bc_jit_exit(t, inst->index);
+        return;
+    }
+    BasicBlock *next = t->blocks[inst->index + 1];
+    if (inst->opcode < 0) { // guard
+        VMTierInst *access = t->insts[inst->index + 1];
+        u8 opcode = (u8) access->opcode;
+        FunctionType *type = FunctionType::get(b.getInt8Ty(), {b.getInt8PtrTy(), b.getInt64Ty(), b.getInt64Ty(), b.getInt32Ty()}, false);
+        Value *contains = b.CreateIntToPtr(b.getInt64((u64) (uintptr_t) &vm_region_contains), type->getPointerTo());
+        Value *args[] = { t->vm, bc_jit_address(t, access), b.getInt64(bc_access_size(opcode)), b.getInt32(bc_is_store(opcode)) };
+        Value *ok = b.CreateICmpNE(b.CreateCall(type, contains, args), b.getInt8(0));
+        bc_jit_check(t, inst, ok, next);
+        return;
+    }
+
+    Value *x = bc_jit_reg(t, inst->x);
+    Value *y = NULL, *z = NULL;
+    switch (inst->opcode) {
+        case JMP: case JE: case JNE: case JL: case JLE: case JG: case JGE: case NOP:
+            break;
+        case CMPJE: case CMPJNE: case CMPJL: case CMPJLE: case CMPJG: case CMPJGE:
+        case ST1: case ST2: case ST4: case ST8: case CMP:
+            y = bc_jit_operand(t, inst, inst->y, 0x2);
+            z = bc_jit_operand(t, inst, inst->z, 0x4);
+            break;
+        case MOV: case FTOI: case ITOF: case ADDI:
+            z = bc_jit_operand(t, inst, inst->z, 0x4);
+            break;
+        default:
+            y = bc_jit_operand(t, inst, inst->y, 0x2);
+            z = bc_jit_operand(t, inst, inst->z, 0x4);
+            break;
+    }
+
+    Value *result = NULL;
+    switch (inst->opcode) {
+        case ADD: result = b.CreateAdd(y, z); break;
+        case SUB: result = b.CreateSub(y, z); break;
+        case MUL: result = b.CreateMul(y, z); break;
+        case XOR: result = b.CreateXor(y, z); break;
+        case AND: result = b.CreateAnd(y, z); break;
+        case OR:  result = b.CreateOr(y, z);  break;
+        // Like the interpreter's, shifts only use the low 6 bits of the count
+        case SHL: result = b.CreateShl(y, b.CreateAnd(z, 63));  break;
+        case SHR: result = b.CreateLShr(y, b.CreateAnd(z, 63)); break;
+        case ADDF: result = bc_jit_u64(t, b.CreateFAdd(bc_jit_f64(t, y), bc_jit_f64(t, z))); break;
+        case SUBF: result = bc_jit_u64(t, b.CreateFSub(bc_jit_f64(t, y), bc_jit_f64(t, z))); break;
+        case MULF: result = bc_jit_u64(t, b.CreateFMul(bc_jit_f64(t, y), bc_jit_f64(t, z))); break;
+        case DIVF: result = bc_jit_u64(t, b.CreateFDiv(bc_jit_f64(t, y), bc_jit_f64(t, z))); break;
+        case DIV: case MOD: {
+            // Dividing by zero faults so it is left for the interpreter
+            BasicBlock *divide = BasicBlock::Create(b.getContext(), "divide", b.GetInsertBlock()->getParent());
+            bc_jit_check(t, inst, b.CreateICmpNE(z, b.getInt64(0)), divide);
+            b.SetInsertPoint(divide);
+            result = inst->opcode == DIV ? b.CreateUDiv(y, z) : b.CreateURem(y, z);
+            break;
+        }
+        case LD1: case LD2: case LD4: case LD8: case LD8ADD: {
+            Type *type = b.getIntNTy(8 * (u32) bc_access_size((u8) inst->opcode));
+            Value *ptr = b.CreateIntToPtr(b.CreateAdd(y, z), type->getPointerTo());
+            result = b.CreateZExt(b.CreateAlignedLoad(ptr, 1), b.getInt64Ty());
+            if (inst->opcode == LD8ADD) result = b.CreateAdd(b.CreateLoad(x), result);
+            break;
+        }
+        case ST1: case ST2: case ST4: case ST8: {
+            Type *type = b.getIntNTy(8 * (u32) bc_access_size((u8) inst->opcode));
+            Value *ptr = b.CreateIntToPtr(b.CreateAdd(b.CreateLoad(x), y), type->getPointerTo());
+            b.CreateAlignedStore(b.CreateTrunc(z, type), ptr, 1);
+            break;
+        }
+        case ADDI: result = b.CreateAdd(b.CreateLoad(x), z); break;
+        case MOV:  result = z; break;
+        case ITOF: result = bc_jit_u64(t, b.CreateSIToFP(z, b.getDoubleTy())); break;
+        case FTOI: {
+            // Out of range conversions give the host's (x86-64) indefinite integer as they do interpreted
+            Value *f = bc_jit_f64(t, z);
+            Value *in_range = b.CreateAnd(b.CreateFCmpOGE(f, ConstantFP::get(b.getDoubleTy(), -9223372036854775808.0)),
+                                          b.CreateFCmpOLT(f, ConstantFP::get(b.getDoubleTy(), 9223372036854775808.0)));
+            result = b.CreateSelect(in_range, b.CreateFPToSI(f, b.getInt64Ty()), b.getInt64(INT64_MIN));
+            break;
+        }
+        case CMP:
+        case CMPJE: case CMPJNE: case CMPJL: case CMPJLE: case CMPJG: case CMPJGE:
+            b.CreateStore(b.CreateSub(y, z), t->flgs);
+            break;
+        default:
+            break;
+    }
+    if (result) b.CreateStore(result, x);
+
+    Value *flgs = NULL;
+    CmpInst::Predicate predicate = CmpInst::ICMP_EQ;
+    BasicBlock *target = NULL;
+    switch (inst->opcode) {
+        case JMP: b.CreateBr(t->blocks[inst->z.u]); return;
+        case JE:  case CMPJE:  predicate = CmpInst::ICMP_EQ;  break;
+        case JNE: case CMPJNE: predicate = CmpInst::ICMP_NE;  break;
+        case JL:  case CMPJL:  predicate = CmpInst::ICMP_SLT; break;
+        case JLE: case CMPJLE: predicate = CmpInst::ICMP_SLE; break;
+        case JG:  case CMPJG:  predicate = CmpInst::ICMP_SGT; break;
+        case JGE: case CMPJGE: predicate = CmpInst::ICMP_SGE; break;
+        default:
+            b.CreateBr(next);
+            return;
+    }
+    target = t->blocks[inst->opcode >= CMPJE ? inst->x : inst->z.u];
+    flgs = b.CreateLoad(t->flgs);
+    b.CreateCondBr(b.CreateICmp(predicate, flgs, b.getInt64(0)), target, next);
+}
+
+VMNative llvm_jit_bytecode(VM *vm, u32 entry) {
+    TRACE(LLVM);
+    orc::LLJIT *jit = llvm_bytecode_jit();
+    if (!jit) return NULL;
+
+    static u32 num_regions;
+    char name[64];
+    snprintf(name, sizeof name, "bytecode.%u.%u", num_regions++, entry);
+
+    LLVMContext &context = *bytecode_jit_context->getContext();
+    std::unique_ptr<Module> module = llvm::make_unique<Module>(name, context);
+    module->setDataLayout(jit->getDataLayout());
+
+    BCTranslation translation(context);
+    BCTranslation *t = &translation;
+    IRBuilder<> &b = t->builder;
+    Type *i64_ptr = b.getInt64Ty()->getPointerTo();
+    FunctionType *type = FunctionType::get(b.getInt32Ty(), {i64_ptr, i64_ptr, b.getInt8PtrTy()}, false);
+    Function *function = Function::Create(type, Function::ExternalLinkage, name, module.get());
+    Function::arg_iterator args = function->arg_begin();
+    t->r = &*args++;
+    t->flgs_out = &*args++;
+    t->vm = &*args;
+
+    u64 num_insts = arrlen(vm->insts);
+    VMTierInst *region = vm_tier_region(vm, entry);
+    t->blocks = (BasicBlock **) xcalloc(num_insts * sizeof *t->blocks);
+    t->insts = (VMTierInst **) xcalloc(num_insts * sizeof *t->insts);
+
+    b.SetInsertPoint(BasicBlock::Create(context, "entry", function));
+    t->flgs = b.CreateAlloca(b.getInt64Ty(), nullptr, "flgs");
+    b.CreateStore(b.CreateLoad(t->flgs_out), t->flgs);
+    for (i64 i = 0; i < arrlen(region); i++) {
+        t->blocks[region[i].index] = BasicBlock::Create(context, "", function);
+        t->insts[region[i].index] = &region[i];
+    }
+    b.CreateBr(t->blocks[entry]);
+    for (i64 i = 0; i < arrlen(region); i++) bc_jit_inst(t, &region[i]);
+
+    free(t->insts);
+    free(t->blocks);
+    arrfree(region);
+
+    if (verifyFunction(*function, &errs())) return NULL;
+
+    legacy::FunctionPassManager function_pm(module.get());
+    PassManagerBuilder pm_builder;
+    pm_builder.OptLevel = 2;
+    pm_builder.populateFunctionPassManager(function_pm);
+    function_pm.doInitialization();
+    function_pm.run(*function);
+    function_pm.doFinalization();
+
+    if (compiler.flags.dump_ir) module->print(outs(), nullptr);
+
+    if (Error error = jit->addIRModule(orc::ThreadSafeModule(std::move(module), *bytecode_jit_context))) {
+        logAllUnhandledErrors(std::move(error), errs(), "Failed to compile bytecode: ");
+        return NULL;
+    }
+    auto symbol = jit->lookup(name);
+    if (!symbol) {
+        logAllUnhandledErrors(symbol.takeError(), errs(), "Failed to compile bytecode: ");
+        return NULL;
+    }
+    return (VMNative) symbol->getAddress();
+}
+
 #if DEBUG
 void print(Value *val) {
     std::string buf;
@@ -1,9 +1,10 @@
 #pragma once
 
-// requires none
+// requires bytecode.h
 
 // package.h
 typedef struct Package Package;
+typedef struct PackageMapEntry PackageMapEntry;
 
 #ifdef __cplusplus
 extern "C" {
@@ -11,6 +12,16 @@ extern "C" {
 
 bool llvm_build_module(Package *package);
 bool llvm_emit_object(Package *package);
+bool llvm_build_modules(PackageMapEntry *packages); // hm, each package built on a thread of its own
+bool llvm_emit_objects(PackageMapEntry *packages);  // hm, each package emitted on a thread of its own
+VMNative llvm_jit_bytecode(VM *vm, u32 entry);
+bool llvm_run_modules(PackageMapEntry *packages, int argc, const char **argv, int *exit_code);
+bool llvm_link_elf(const char **args, int num_args); // in process with lld, args as given to ld.lld
+bool llvm_archive(const char *output, PackageMapEntry *packages); // hm, archived from memory
+const char **llvm_object_paths(PackageMapEntry *packages); // arr, of the objects the linker reads
+void llvm_remove_scratch_dir(void);
+void llvm_cache_prune(void);
+const char *llvm_profile_runtime(void); // of the LLVM install for the target, NULL when not found
 
 #ifdef __cplusplus
 } // extern "C"
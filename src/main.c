@@ -24,7 +24,7 @@ u64 source_memory_usage = 0;
 #define hmsize(hm) hmlenu(hm) * sizeof *hm + sizeof *hm + sizeof(stbds_array_header)
 #define arrsize(arr) arrlenu(arr) * sizeof *arr + sizeof(stbds_array_header)
 
-#if !TEST
+#if !TEST && !BENCH
 int main(int argc, const char **argv) {
     profiler_init();
     compiler_init(&compiler, argc, argv);
@@ -33,6 +33,7 @@ int main(int argc, const char **argv) {
         const char *stage = compiler_stage_name(compiler.failure_stage);
         printf("error: Compilation failed during %s\n", stage);
     }
+    if (compiler.flags.time_report) compiler_report_timings(&compiler);
     profiler_output();
 
     u64 total_memory_usage = source_memory_usage;
@@ -45,6 +46,6 @@ int main(int argc, const char **argv) {
     }
     verbose("Processed %.2fKB of source files", (f64) source_memory_usage / 1024.f);
     verbose("Memory usage: %.2fKB\n", (f64) total_memory_usage / 1024.f);
-    return 0;
+    return success ? compiler.exit_code : 1;
 }
 #endif
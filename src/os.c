@@ -101,7 +101,37 @@ void InitDetailsForCurrentSystem(void) {
 
 }
 
+// Allocations are only counted by the thread making them, sharing a count would cost every allocation
+// an atomic, work done on other threads is summed from what they record themselves
+static _Thread_local u64 thread_allocations, thread_allocated;
+
+void count_allocation(size_t num_bytes) {
+    thread_allocations++;
+    thread_allocated += num_bytes;
+}
+
+// The clocks of the calling thread or the whole process, along with the calling thread's allocations
+Timing timing_now(bool thread) {
+    Timing timing = {
+        .wall = time_nanoseconds(),
+        .cpu = cpu_time_nanoseconds(thread),
+        .allocations = thread_allocations,
+        .allocated = thread_allocated,
+    };
+    return timing;
+}
+
+// Adds what has elapsed and been allocated since start was taken by timing_now to total
+void timing_add(Timing *total, Timing start, bool thread) {
+    Timing end = timing_now(thread);
+    total->wall += end.wall - start.wall;
+    total->cpu += end.cpu - start.cpu;
+    total->allocations += end.allocations - start.allocations;
+    total->allocated += end.allocated - start.allocated;
+}
+
 void *xcalloc(size_t num_bytes) {
+    count_allocation(num_bytes);
     void *ptr = calloc(num_bytes, 1);
     if (!ptr) {
         perror("calloc failed");
@@ -111,6 +141,7 @@ void *xcalloc(size_t num_bytes) {
 }
 
 void *xrealloc(void *ptr, size_t num_bytes) {
+    count_allocation(num_bytes);
     ptr = realloc(ptr, num_bytes);
     if (!ptr) {
         perror("realloc failed");
@@ -120,6 +151,7 @@ void *xrealloc(void *ptr, size_t num_bytes) {
 }
 
 void *xmalloc(size_t num_bytes) {
+    count_allocation(num_bytes);
     void *ptr = malloc(num_bytes);
     if (!ptr) {
         perror("malloc failed");
@@ -24,13 +24,31 @@ typedef enum FileMode {
     FILE_OTHER,
 } FileMode;
 
+typedef struct Timing Timing;
+struct Timing {
+    u64 wall;        // nanoseconds
+    u64 cpu;         // nanoseconds, across every core
+    u64 allocations;
+    u64 allocated;   // bytes
+};
+
 void *xmalloc(size_t num_bytes);
 void *xcalloc(size_t num_bytes);
 void *xrealloc(void *ptr, size_t num_bytes);
+void count_allocation(size_t num_bytes);
+Timing timing_now(bool thread);
+void timing_add(Timing *total, Timing start, bool thread);
 
 void InitDetailsForCurrentSystem(void);
 SysInfo get_current_sysinfo(void);
 const char *ReadEntireFile(const char *path, u64 *len);
+void *MapEntireFile(const char *path, void *address, u64 *len);
+void UnmapFile(void *ptr, u64 len);
+u64 time_nanoseconds(void);
+u64 cpu_time_nanoseconds(bool thread);
+void *MapExecutable(const void *code, u64 len);
+void *library_open(const char *name, const char **search_paths, int num_search_paths);
+void *library_symbol(void *library, const char *name);
 const char *path_ext(const char path[MAX_PATH]);
 char *path_file(char path[MAX_PATH]);
 void path_join(char path[MAX_PATH], const char *src);
@@ -95,6 +95,96 @@ const char *ReadEntireFile(const char *path, u64 *len) {
     return ptr;
 }
 
+// Maps the file privately so it may be written to without changing the file. The file is mapped at
+// address when that is free, callers should check for this.
+void *MapEntireFile(const char *path, void *address, u64 *len) {
+    i32 fd = open(path, O_RDONLY);
+    if (fd == -1) return NULL;
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size <= 0) {
+        close(fd);
+        return NULL;
+    }
+    int flags = MAP_PRIVATE;
+#ifdef MAP_FIXED_NOREPLACE
+    if (address) flags |= MAP_FIXED_NOREPLACE;
+#endif
+    void *ptr = mmap(address, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+    if (ptr == MAP_FAILED && address) {
+        ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    if (close(fd) == -1) perror("close was interupted");
+    if (ptr == MAP_FAILED) return NULL;
+    if (len) *len = size;
+    return ptr;
+}
+
+void UnmapFile(void *ptr, u64 len) {
+    if (munmap(ptr, len) == -1) perror("munmap failed");
+}
+
+// Copies code into memory of its own which is then made executable, it is never unmapped
+void *MapExecutable(const void *code, u64 len) {
+    void *ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) return NULL;
+    memcpy(ptr, code, len);
+    if (mprotect(ptr, len, PROT_READ | PROT_EXEC) == -1) {
+        perror("mprotect failed");
+        munmap(ptr, len);
+        return NULL;
+    }
+    return ptr;
+}
+
+/*
+ Opens a shared library by name, as in #library "glfw", or the running executable when name is NULL.
+ lib<name> is looked for in the library search paths, then by the loader, then under its versioned
+ sonames as glibc installs libm.so as a linker script dlopen can't load. Libraries are opened globally
+ so the JIT resolves their symbols through the process just as the VM does through the handle.
+*/
+void *library_open(const char *name, const char **search_paths, int num_search_paths) {
+    if (!name) return dlopen(NULL, RTLD_NOW);
+#if defined(__APPLE__)
+    const char *ext = ".dylib";
+#else
+    const char *ext = ".so";
+#endif
+    char path[MAX_PATH];
+    for (int i = 0; i < num_search_paths; i++) {
+        snprintf(path, sizeof path, "%s/lib%s%s", search_paths[i], name, ext);
+        void *library = file_mode(path) == FILE_REGULAR ? dlopen(path, RTLD_NOW | RTLD_GLOBAL) : NULL;
+        if (library) return library;
+    }
+    snprintf(path, sizeof path, "lib%s%s", name, ext);
+    void *library = dlopen(path, RTLD_NOW | RTLD_GLOBAL);
+#if !defined(__APPLE__)
+    for (int version = 9; !library && version >= 0; version--) {
+        snprintf(path, sizeof path, "lib%s%s.%d", name, ext, version);
+        library = dlopen(path, RTLD_NOW | RTLD_GLOBAL);
+    }
+#endif
+    if (!library) library = dlopen(name, RTLD_NOW | RTLD_GLOBAL);
+    return library;
+}
+
+void *library_symbol(void *library, const char *name) {
+    return dlsym(library, name);
+}
+
+// Monotonic time for measuring intervals, unrelated to the wall clock
+u64 time_nanoseconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Time spent running on any core by the calling thread or by all threads of the process
+u64 cpu_time_nanoseconds(bool thread) {
+    struct timespec ts;
+    clock_gettime(thread ? CLOCK_THREAD_CPUTIME_ID : CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (u64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 SysInfo get_current_sysinfo(void) {
     struct utsname *uts = xmalloc(sizeof(struct utsname));
     int res = uname(uts);
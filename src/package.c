@@ -243,6 +243,14 @@ void package_object_path(Package *package, char object_name[MAX_PATH]) {
     }
 }
 
+// Partitions of a package code generated apart are written next to its object, 0 being the object
+void package_partition_path(Package *package, u32 partition, char object_name[MAX_PATH]) {
+    package_object_path(package, object_name);
+    if (!partition) return;
+    char *ext = strrchr(object_name, '.');
+    snprintf(ext, MAX_PATH - (ext - object_name), ".%u.o", partition);
+}
+
 void output_error(Package *package, SourceError error) {
     PosInfo location = error.location;
     char filepath[MAX_PATH];
@@ -1,7 +1,7 @@
 #pragma once
 
 // requires
-// arena.h
+// os.h arena.h
 
 // checker.h
 typedef struct Scope Scope;
@@ -86,6 +86,12 @@ struct Package {
     void *userdata;
 
     Source *most_recent_source;
+
+    // Spent on the package by the thread working on it in each stage, only sampled with -time-report
+    Timing parse_timing;
+    Timing check_timing;
+    Timing build_timing;
+    Timing emit_timing;
 };
 
 typedef struct PackageMapEntry PackageMapEntry;
@@ -103,3 +109,4 @@ Source *package_source(Package *package, u32 pos);
 PosInfo package_posinfo(Package *package, u32 pos);
 char *package_highlighted_range(Package *package, Range range);
 void package_object_path(Package *package, char object_name[MAX_PATH]);
+void package_partition_path(Package *package, u32 partition, char object_name[MAX_PATH]);
@@ -5,7 +5,7 @@
 
 #if TEST
 #define SETUP() \
-VM vm; \
+VM vm = {0}; \
 BCBlock block = {0}; \
 BCBuilder builder = {&block}; \
 
@@ -55,10 +55,10 @@ void test_bytecode_floating_point_arithmetic() {
 void test_bytecode_load_and_stores_move() {
     SETUP();
 
-    u64 mem;
-    u64 mem2;
-    u64 mem4;
-    u64 mem8;
+    u64 mem  = 0;
+    u64 mem2 = 0;
+    u64 mem4 = 0;
+    u64 mem8 = 0;
 
     e_st1(&builder, 0, imm((u64) &mem),  imm(8));
     e_st2(&builder, 0, imm((u64) &mem2), imm(8));
@@ -106,7 +106,695 @@ void test_bytecode_conversions() {
 }
 
 void test_bytecode_cmp() {
+    SETUP();
+
+    e_mov(&builder, 4, imm(0));
+    i64 loop = arrlen(block.code);
+    e_add(&builder, 4, reg(4), imm(1)); // r4 = r4 + 1
+    e_cmp(&builder, reg(4), imm(10));
+    e_jl (&builder, imm(loop - (arrlen(block.code) + 10))); // jl with a negative imm is 10 bytes
+    e_cmp(&builder, reg(4), imm(10));
+    e_jge(&builder, imm(4));            // skip the 4 byte mov
+    e_mov(&builder, 5, imm(1));
+    e_cmp(&builder, reg(4), imm(11));
+    e_jg (&builder, imm(4));            // not taken
+    e_mov(&builder, 6, imm(1));
+    e_hlt(&builder);
+
+    vm_init(&vm, block.code, 6);
+    vm_interp(&vm);
+
+    ASSERT(vm.registers[4].u == 10);
+    ASSERT(vm.registers[5].u == 0);
+    ASSERT(vm.registers[6].u == 1);
+    ASSERT(vm.registers[RIP].u == arrlen(block.code));
+    arrsetlen(block.code, 0);
+
+    // Comparisons wrap like the JIT's, INT64_MAX - -1 is negative
+    e_mov(&builder, 4, imm(INT64_MAX));
+    e_cmp(&builder, reg(4), imm(-1));
+    e_jl (&builder, imm(4));            // taken
+    e_mov(&builder, 5, imm(1));
+    e_shl(&builder, 6, imm(1), imm(65)); // counts only use their low 6 bits
+    e_shr(&builder, 7, imm(4), imm(66));
+    e_hlt(&builder);
+
+    vm_init(&vm, block.code, 7);
+    vm_interp(&vm);
+
+    ASSERT(vm.registers[5].u == 0);
+    ASSERT(vm.registers[6].u == 2);
+    ASSERT(vm.registers[7].u == 1);
+    arrsetlen(block.code, 0);
+}
+void test_bytecode_verified() {
+    SETUP();
+
+    u64 mem[4] = {0};
+    vm_add_region(&vm, mem, sizeof mem, true);
+
+    e_mov(&builder, 4, imm((u64) mem));
+    e_mov(&builder, 5, imm(0));
+    i64 loop = arrlen(block.code);
+    e_st8(&builder, 4, reg(5), imm(7)); // mem[r5 / 8] = 7, guarded at runtime
+    e_add(&builder, 5, reg(5), imm(8));
+    e_cmp(&builder, reg(5), imm(sizeof mem));
+    e_jl (&builder, imm(loop - (arrlen(block.code) + 10)));
+    e_ld8(&builder, 6, imm((u64) &mem[3]), RZ0);
+    e_hlt(&builder);
+
+    vm_init(&vm, block.code, 6);
+    ASSERT(vm_verify(&vm));
+    ASSERT(vm_interp(&vm));
+
+    ASSERT(mem[0] == 7 && mem[3] == 7);
+    ASSERT(vm.registers[6].u == 7);
+    arrsetlen(block.code, 0);
+}
+
+void test_bytecode_verifier_rejects() {
+    SETUP();
+
+    // Register outside of the register file
+    e_mov(&builder, 200, imm(1));
+    e_hlt(&builder);
+    vm_init(&vm, block.code, 4);
+    ASSERT(!vm_verify(&vm));
+    ASSERT(!vm_interp(&vm));
+    arrsetlen(block.code, 0);
+
+    // Branch into the middle of an instruction
+    e_jmp(&builder, imm(1));
+    e_mov(&builder, 4, imm(1));
+    e_hlt(&builder);
+    vm_init(&vm, block.code, 4);
+    ASSERT(!vm_verify(&vm));
+    arrsetlen(block.code, 0);
+
+    // Store to read only memory
+    u64 mem = 0;
+    vm_add_region(&vm, &mem, sizeof mem, false);
+    e_st8(&builder, 0, imm((u64) &mem), imm(1));
+    e_hlt(&builder);
+    vm_init(&vm, block.code, 4);
+    ASSERT(!vm_verify(&vm));
+    ASSERT(mem == 0);
+    arrsetlen(block.code, 0);
+    arrsetlen(vm.regions, 0);
+}
+
+void test_bytecode_guard_faults() {
+    SETUP();
+
+    u64 mem[2] = {0};
+    vm_add_region(&vm, mem, sizeof mem, true);
+
+    e_mov(&builder, 4, imm((u64) mem));
+    e_st8(&builder, 4, imm(8),  imm(1)); // in bounds
+    e_st8(&builder, 4, imm(16), imm(1)); // one past the end of the region
+    e_hlt(&builder);
+
+    vm_init(&vm, block.code, 4);
+    ASSERT(vm_verify(&vm));
+    ASSERT(!vm_interp(&vm));
+    ASSERT(mem[1] == 1);
+    arrsetlen(block.code, 0);
+
+    e_mov(&builder, 4, imm(1));
+    e_ast(&builder, reg(4));
+    e_ast(&builder, imm(1));
+    e_mov(&builder, 5, imm(0));
+    e_ast(&builder, reg(5));
+    e_mov(&builder, 4, imm(2));
+    e_hlt(&builder);
+
+    vm_init(&vm, block.code, 4);
+    ASSERT(vm_verify(&vm));
+    ASSERT(!vm_interp(&vm));
+    ASSERT(vm.registers[4].u == 1);
+    arrsetlen(block.code, 0);
+}
+
+// Emits fib(n) taking n in r4 and returning in r4 then code calling it for n = 20, the code is
+// started by a jump to the call
+void emit_fib(BCBuilder *builder) {
+    BCBlock body = {0};
+    BCBuilder b = {&body};
+    i64 base = arrlen(body.code);
+    e_ret(&b);
+    i64 fib = arrlen(body.code);
+    e_cmp(&b, reg(4), imm(2));
+    e_jl (&b, imm(base - (arrlen(body.code) + 10)));
+    e_mov(&b, 5, reg(4));
+    e_sub(&b, 12, reg(4), imm(1));
+    e_call(&b, 8, imm(fib - (arrlen(body.code) + 11)));
+    e_mov(&b, 6, reg(12));
+    e_sub(&b, 12, reg(5), imm(2));
+    e_call(&b, 8, imm(fib - (arrlen(body.code) + 11)));
+    e_add(&b, 4, reg(6), reg(12));
+    e_ret(&b);
+    i64 main = arrlen(body.code);
+    e_mov(&b, 12, imm(20));
+    e_call(&b, 8, imm(fib - (arrlen(body.code) + 11)));
+    e_mov(&b, 4, reg(12));
+    e_hlt(&b);
+
+    e_jmp(builder, imm(main));
+    arraddn(builder->block->code, arrlen(body.code));
+    memcpy(builder->block->code + arrlen(builder->block->code) - arrlen(body.code), body.code, arrlen(body.code));
+    arrfree(body.code);
+}
+
+void test_bytecode_calls() {
+    SETUP();
+
+    emit_fib(&builder);
+    vm_init(&vm, block.code, 12);
+    ASSERT(vm_interp(&vm));
+    ASSERT(vm.registers[4].u == 6765);
+    ASSERT(vm.registers[RIP].u == arrlen(block.code));
+
+    vm_init(&vm, block.code, 12);
+    ASSERT(vm_verify(&vm));
+    ASSERT(vm_interp(&vm));
+    ASSERT(vm.registers[4].u == 6765);
+
+    // Values pushed by a callee may be popped by its caller
+    arrsetlen(block.code, 0);
+    e_call(&builder, 8, imm(1));
+    e_hlt(&builder);
+    e_push(&builder, imm(42));
+    e_ret(&builder);
+    vm_init(&vm, block.code, 12);
+    ASSERT(vm_interp(&vm));
+    ASSERT(vm.sp == VM_STACK_SIZE - 1 && vm.stack[vm.sp].u == 42);
+
+    free(vm.stack);
+    arrsetlen(block.code, 0);
+}
+
+void test_bytecode_call_limits() {
+    SETUP();
+
+    emit_fib(&builder);
+    vm_init(&vm, block.code, 12);
+    vm.max_depth = 10;
+    ASSERT(!vm_interp(&vm));
+    arrsetlen(block.code, 0);
+
+    // Unbounded recursion runs out of stack before the depth limit
+    e_call(&builder, 8, imm((u64) -11)); // itself
+    vm_init(&vm, block.code, 12);
+    vm.max_depth = UINT32_MAX;
+    ASSERT(!vm_interp(&vm));
+    vm.max_depth = 0;
+    arrsetlen(block.code, 0);
+
+    // The callee's window would overlap the caller's link registers
+    e_call(&builder, RFP, imm(0));
+    e_hlt(&builder);
+    vm_init(&vm, block.code, 12);
+    ASSERT(!vm_verify(&vm));
+    ASSERT(!vm_interp(&vm));
+
+    free(vm.stack);
+    arrsetlen(block.code, 0);
+}
+
+f64 foreign_mixed(i64 a, f64 b, i64 c, f32 d, i64 e, f64 f, i64 g, f64 h,
+                  i64 i, f32 j, i64 k, f64 l, i64 m, f64 n, f64 o, f32 p) {
+    return a + 2*b + 3*c + 4*d + 5*e + 6*f + 7*g + 8*h + 9*i + 10*j + 11*k + 12*l + 13*m + 14*n + 15*o + 16*p;
+}
+
+i32 foreign_negative(i32 x) {
+    return -x;
+}
+
+void test_bytecode_foreign_calls() {
+    SETUP();
+
+    BCSignature strlen_signature = { 1, { BC_ARG_I64 }, BC_ARG_I64 };
+    ASSERT(vm_add_foreign(&vm, "strlen", bc_foreign_address("strlen", NULL), strlen_signature) == 0);
+    BCSignature sqrtf_signature = { 1, { BC_ARG_F32 }, BC_ARG_F32 };
+    ASSERT(vm_add_foreign(&vm, "sqrtf", bc_foreign_address("llvm.sqrt.f32", NULL), sqrtf_signature) == 1);
+    BCSignature negative_signature = { 1, { BC_ARG_I32 }, BC_ARG_I32 };
+    ASSERT(vm_add_foreign(&vm, "negative", foreign_negative, negative_signature) == 2);
+    BCSignature mixed_signature = { 16, {
+        BC_ARG_I64, BC_ARG_F64, BC_ARG_I64, BC_ARG_F32, BC_ARG_I64, BC_ARG_F64, BC_ARG_I64, BC_ARG_F64,
+        BC_ARG_I64, BC_ARG_F32, BC_ARG_I64, BC_ARG_F64, BC_ARG_I64, BC_ARG_F64, BC_ARG_F64, BC_ARG_F32,
+    }, BC_ARG_F64 };
+    ASSERT(vm_add_foreign(&vm, "mixed", foreign_mixed, mixed_signature) == 3);
+    ASSERT(vm.foreigns[0].trampoline != vm.foreigns[1].trampoline);
+    ASSERT(bc_foreign_library("m")); // a linker script on glibc, opened by its soname
+
+    e_mov(&builder, 12, imm((u64) "hello"));
+    e_callf(&builder, 8, 0);
+    e_mov(&builder, 4, reg(12));
+    Val nine = { .f = 9.0 };
+    e_mov(&builder, 12, imm(nine.u));
+    e_callf(&builder, 8, 1);
+    e_mov(&builder, 5, reg(12));
+    e_mov(&builder, 12, imm(7));
+    e_callf(&builder, 8, 2);
+    e_mov(&builder, 6, reg(12));
+    for (u32 i = 0; i < 16; i++) {
+        u8 kind = mixed_signature.args[i];
+        Val arg = { .u = i + 1 };
+        if (kind == BC_ARG_F32 || kind == BC_ARG_F64) arg.f = i + 1;
+        e_mov(&builder, 12 + i, imm(arg.u));
+    }
+    e_callf(&builder, 8, 3);
+    e_mov(&builder, 7, reg(12));
+    e_hlt(&builder);
+
+    for (i32 verified = 0; verified < 2; verified++) {
+        vm_init(&vm, block.code, 28);
+        ASSERT(!verified || vm_verify(&vm));
+        ASSERT(vm_interp(&vm));
+        ASSERT(vm.registers[4].u == 5);
+        ASSERT(vm.registers[5].f == 3.0);
+        ASSERT(vm.registers[6].i == -7);
+        ASSERT(vm.registers[7].f == 1496.0); // the sum of i * i for 1 to 16
+    }
+
+    // Calls to functions that weren't added are rejected
+    arrsetlen(block.code, 0);
+    e_callf(&builder, 8, 4);
+    e_hlt(&builder);
+    vm_init(&vm, block.code, 28);
+    ASSERT(!vm_verify(&vm));
+    ASSERT(!vm_interp(&vm));
+
+    free(vm.stack);
+    arrfree(vm.foreigns);
+    arrsetlen(block.code, 0);
+}
+
+void test_bytecode_vectors() {
+    SETUP();
+
+    f32 a[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    f32 b[8] = { 8, 7, 6, 5, 4, 3, 2, 1 };
+    f32 sum[8] = {0};
+    f32 product[4] = {0};
+    u32 shuffled[8] = {0};
+    u64 wide[4] = {0};
+    vm_add_region(&vm, a, sizeof a, false);
+    vm_add_region(&vm, b, sizeof b, false);
+    vm_add_region(&vm, sum, sizeof sum, true);
+    vm_add_region(&vm, product, sizeof product, true);
+    vm_add_region(&vm, shuffled, sizeof shuffled, true);
+    vm_add_region(&vm, wide, sizeof wide, true);
+
+    e_vld32(&builder, 0, imm((u64) a), RZ0);
+    e_mov(&builder, 4, imm((u64) b));
+    e_vld32(&builder, 1, reg(4), RZ0);
+    e_vaddf32(&builder, 2, 0, 1);
+    e_vst32(&builder, 2, imm((u64) sum), RZ0);
+    e_vld16(&builder, 3, reg(4), imm(16)); // the low half only, { 4, 3, 2, 1, 0... }
+    e_vmulf32(&builder, 3, 3, 0);
+    e_vst16(&builder, 3, imm((u64) product), RZ0);
+    e_vshuf(&builder, 4, 0, VM_SHUFFLE(7, 6, 5, 4, 3, 2, 1, 0));
+    e_vst32(&builder, 4, imm((u64) shuffled), RZ0);
+    e_vaddi64(&builder, 5, 0, 1); // lane-wise on the bits of the floats
+    e_vsubi64(&builder, 5, 5, 1);
+    e_vst32(&builder, 5, imm((u64) wide), RZ0);
+    e_hlt(&builder);
+
+    for (i32 verified = 0; verified < 2; verified++) {
+        memset(sum, 0, sizeof sum);
+        memset(vm.vregs, 0, sizeof vm.vregs);
+        vm_init(&vm, block.code, 4);
+        ASSERT(!verified || vm_verify(&vm));
+        ASSERT(vm_interp(&vm));
+        for (i32 i = 0; i < 8; i++) ASSERT(sum[i] == 9);
+        ASSERT(product[0] == 4 && product[1] == 6 && product[2] == 6 && product[3] == 4);
+        for (i32 i = 4; i < 8; i++) ASSERT(vm.vregs[3].f32s[i] == 0);
+        for (i32 i = 0; i < 8; i++) ASSERT(shuffled[i] == ((u32 *) a)[7 - i]);
+        ASSERT(memcmp(wide, a, sizeof a) == 0);
+    }
+
+    e_vmuli32(&builder, 6, 0, 0);
+    e_vdivf64(&builder, 7, 6, 6);
+    vm_init(&vm, block.code, 4);
+    ASSERT(vm_verify(&vm));
+    arrsetlen(block.code, 0);
 
+    // Vector registers outside of vregs and stores out of bounds
+    e_vaddf32(&builder, VM_NUM_VREGS, 0, 1);
+    e_hlt(&builder);
+    vm_init(&vm, block.code, 4);
+    ASSERT(!vm_verify(&vm));
+    ASSERT(!vm_interp(&vm));
+    arrsetlen(block.code, 0);
+
+    e_mov(&builder, 4, imm((u64) product));
+    e_vst32(&builder, 0, reg(4), RZ0);
+    e_hlt(&builder);
+    vm_init(&vm, block.code, 4);
+    ASSERT(vm_verify(&vm));
+    ASSERT(!vm_interp(&vm));
+    ASSERT(product[0] == 4);
+
+    free(vm.stack);
+    arrfree(vm.regions);
+    arrsetlen(block.code, 0);
+}
+
+#define TIER_LOOP_COUNT 100000
+
+u32 tier_compiles;
+u32 tier_entry;
+u32 tier_exit;
+
+// Native code for the loop test_bytecode_tiering emits, as a compiler would produce from its region
+u32 tier_loop_native(Val *r, i64 *flgs, VM *vm) {
+    do {
+        r[4].u += r[5].u;
+        r[5].u += 1;
+        *flgs = r[5].i - TIER_LOOP_COUNT;
+    } while (*flgs < 0);
+    return tier_exit;
+}
+
+VMNative tier_compile_loop(VM *vm, u32 entry) {
+    tier_compiles++;
+    tier_entry = entry;
+    VMTierInst *region = vm_tier_region(vm, entry);
+    i32 handled = 0;
+    for (i64 i = 0; i < arrlen(region); i++) {
+        if (region[i].exit) tier_exit = region[i].index;
+        else handled++;
+    }
+    bool loop_only = arrlen(region) == 5 && handled == 4;
+    arrfree(region);
+    return loop_only ? tier_loop_native : NULL;
+}
+
+VMNative tier_compile_nothing(VM *vm, u32 entry) {
+    tier_compiles++;
+    return NULL;
+}
+
+void test_bytecode_tiering() {
+    SETUP();
+
+    e_mov(&builder, 4, imm(0));
+    e_mov(&builder, 5, imm(0));
+    i64 loop = arrlen(block.code);
+    e_add(&builder, 4, reg(4), reg(5));
+    e_add(&builder, 5, reg(5), imm(1));
+    e_cmp(&builder, reg(5), imm(TIER_LOOP_COUNT));
+    e_jl (&builder, imm(loop - (arrlen(block.code) + 10)));
+    e_hlt(&builder);
+
+    vm_init(&vm, block.code, 5);
+    ASSERT(vm_verify(&vm));
+    ASSERT(vm_interp(&vm));
+    u64 sum = vm.registers[4].u;
+    ASSERT(sum == (u64) TIER_LOOP_COUNT * (TIER_LOOP_COUNT - 1) / 2);
+
+    // Hot loops are compiled once and run natively until the code they don't handle
+    vm.compile = tier_compile_loop;
+    vm.tier_threshold = 10;
+    vm_init(&vm, block.code, 5);
+    ASSERT(vm_verify(&vm));
+    ASSERT(vm_interp(&vm));
+    ASSERT(tier_compiles == 1);
+    ASSERT(tier_entry == 2);
+    ASSERT(vm.registers[4].u == sum && vm.registers[5].u == TIER_LOOP_COUNT);
+    ASSERT(vm.natives[tier_entry] == tier_loop_native);
+
+    // Code that can't be compiled carries on being interpreted
+    tier_compiles = 0;
+    vm.compile = tier_compile_nothing;
+    vm_init(&vm, block.code, 5);
+    ASSERT(vm_verify(&vm));
+    ASSERT(vm_interp(&vm));
+    ASSERT(tier_compiles == 1);
+    ASSERT(vm.registers[4].u == sum);
+
+    // Calls and returns are entry points too
+    arrsetlen(block.code, 0);
+    tier_compiles = 0;
+    emit_fib(&builder);
+    vm_init(&vm, block.code, 12);
+    ASSERT(vm_verify(&vm));
+    ASSERT(vm_interp(&vm));
+    ASSERT(vm.registers[4].u == 6765);
+    ASSERT(tier_compiles == 4); // fib, the return sites of its calls and the ret its base case jumps back to
+
+    free(vm.stack);
+    arrfree(vm.natives);
+    arrfree(vm.heat);
+    arrsetlen(block.code, 0);
+}
+
+void test_bytecode_optimize() {
+    SETUP();
+
+    u64 mem[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+
+    e_mov(&builder, 4, imm(0));               // i
+    e_mov(&builder, 5, imm(0));               // sum
+    e_mov(&builder, 9, imm((u64) mem));
+    i64 loop = arrlen(block.code);
+    e_mov(&builder, 6, reg(9));               // copy propagated then dead
+    e_mul(&builder, 7, reg(4), imm(8));
+    e_ld8(&builder, 8, reg(6), reg(7));       // fused with the add into ld8add
+    e_add(&builder, 5, reg(5), reg(8));
+    e_add(&builder, 4, reg(4), imm(1));       // addi
+    e_cmp(&builder, reg(4), imm(8));          // fused with the jl into cmpjl
+    e_jl (&builder, imm(loop - (arrlen(block.code) + 10)));
+    e_mov(&builder, 8, imm(0));
+    e_hlt(&builder);
+
+    i64 len = arrlen(block.code);
+    ASSERT(bc_optimize(&block, NULL));
+    ASSERT(arrlen(block.code) < len);
+
+    vm_init(&vm, block.code, 9);
+    ASSERT(vm_interp(&vm));
+    ASSERT(vm.registers[4].u == 8);
+    ASSERT(vm.registers[5].u == 36);
+    ASSERT(vm.registers[8].u == 0);
+    ASSERT(vm.registers[9].u == (u64) mem);
+    ASSERT(vm.registers[RIP].u == arrlen(block.code));
+
+    bool has[256] = {0};
+    for (i64 i = 0; i < arrlen(vm.offsets) - 1; i++) has[block.code[vm.offsets[i]]] = true;
+    ASSERT(has[LD8ADD] && has[ADDI] && has[CMPJL]);
+    ASSERT(!has[LD8] && !has[CMP] && !has[JL]);
+    arrsetlen(block.code, 0);
+}
+
+void test_bytecode_pair_counts() {
+    SETUP();
+
+    BCPairCounts *pairs = calloc(1, sizeof *pairs);
+    vm.pairs = pairs;
+
+    e_mov(&builder, 4, imm(0));
+    e_mov(&builder, 5, imm(0));
+    i64 loop = arrlen(block.code);
+    e_add(&builder, 4, reg(4), imm(1));
+    e_cmp(&builder, reg(4), imm(100));
+    e_jl (&builder, imm(loop - (arrlen(block.code) + 10)));
+    e_cmp(&builder, reg(4), imm(0));
+    e_je (&builder, imm(4));                  // rarely executed, not fused
+    e_mov(&builder, 5, imm(1));
+    e_hlt(&builder);
+
+    vm_init(&vm, block.code, 5);
+    ASSERT(vm_interp(&vm));
+    ASSERT(pairs->counts[CMP][JL] == 100);
+    ASSERT(pairs->counts[JL][ADD] == 99);
+    ASSERT(pairs->counts[CMP][JE] == 1);
+
+    ASSERT(bc_optimize(&block, pairs));
+    memset(pairs, 0, sizeof *pairs);
+    vm_init(&vm, block.code, 5);
+    ASSERT(vm_interp(&vm));
+    ASSERT(vm.registers[4].u == 100);
+    ASSERT(vm.registers[5].u == 1);
+    ASSERT(pairs->counts[ADDI][CMPJL] == 100);
+    ASSERT(pairs->counts[CMP][JE] == 1);
+
+    free(pairs);
+    arrsetlen(block.code, 0);
+}
+
+void test_bytecode_profile() {
+    SETUP();
+
+    VMProfile profile = {0};
+    vm.profile = &profile;
+
+    e_mov(&builder, 4, imm(0));
+    i64 loop = arrlen(block.code);
+    e_add(&builder, 4, reg(4), imm(1));
+    e_cmp(&builder, reg(4), imm(10));
+    e_jl (&builder, imm(loop - (arrlen(block.code) + 10)));
+    e_hlt(&builder);
+
+    vm_init(&vm, block.code, 5);
+    ASSERT(vm_interp(&vm));
+    ASSERT(vm.registers[4].u == 10);
+    ASSERT(profile.total == 1 + 10 * 3 + 1);
+    ASSERT(profile.counts[0] == 1);
+    ASSERT(profile.counts[1] == 10);
+    ASSERT(profile.counts[3] == 10);
+    ASSERT(profile.taken[3] == 9);
+    ASSERT(profile.frame_calls[0] == 1);
+
+    // Profiles accumulate over runs of the same code
+    vm_init(&vm, block.code, 5);
+    ASSERT(vm_interp(&vm));
+    ASSERT(profile.counts[1] == 20);
+    ASSERT(profile.taken[3] == 18);
+    ASSERT(profile.frame_calls[0] == 2);
+    ASSERT(arrlen(profile.open_frames) == 0);
+
+    vm_free_profile(&profile);
+    arrsetlen(block.code, 0);
+}
+
+void test_bytecode_program_file() {
+    SETUP();
+
+    BytecodeProgram program = {0};
+    u64 values[4] = { 10, 20, 30, 40 };
+    u64 table = bc_add_data(&program, BC_SECTION_RODATA, values, sizeof values, 8);
+    u64 zero = 0;
+    u64 result = bc_add_data(&program, BC_SECTION_DATA, &zero, sizeof zero, 8);
+    u64 pointer = bc_add_data(&program, BC_SECTION_DATA, &zero, sizeof zero, 8);
+    bc_add_pointer(&program, BC_SECTION_DATA, pointer, BC_SECTION_RODATA, table + 8);
+    u64 constant = bc_add_constant(&program, (Val){ .u = 2 });
+
+    e_ld8(&builder, 4, bc_address(BC_SECTION_RODATA, table + 24), RZ0); // r4 = 40
+    e_ld8(&builder, 5, bc_address(BC_SECTION_DATA, pointer), RZ0);
+    e_ld8(&builder, 5, reg(5), RZ0);                                    // r5 = *pointer = 20
+    e_ld8(&builder, 6, bc_address(BC_SECTION_CONSTANTS, constant), RZ0); // r6 = 2
+    e_mul(&builder, 4, reg(4), reg(6));
+    e_add(&builder, 4, reg(4), reg(5));
+    e_st8(&builder, 0, bc_address(BC_SECTION_DATA, result), reg(4));    // result = 100
+    e_mov(&builder, 7, imm(0xBC02000000000010)); // looks like an address but isn't one
+    e_hlt(&builder);
+    ASSERT(bc_optimize(&block, NULL)); // moves the address immediates along with their insts
+    program.code = block.code;
+    program.code_sites = block.address_sites;
+    bc_add_symbol(&program, "main", BC_SECTION_CODE, 0, arrlen(program.code));
+    bc_add_symbol(&program, "result", BC_SECTION_DATA, result, sizeof zero);
+
+    const char *path = "test_bytecode_program_file.kbc";
+    ASSERT(bc_write_program(&program, path));
+
+    BCImage images[2];
+    ASSERT(bc_load_program(path, &images[0]));
+    ASSERT(bc_load_program(path, &images[1]));
+    ASSERT(images[1].relocated); // the preferred address was already taken
+    remove(path);
+
+    for (int i = 0; i < 2; i++) {
+        BCImage *image = &images[i];
+        BCSymbol *symbol = bc_find_symbol(image, "result");
+        ASSERT(symbol && symbol->section == BC_SECTION_DATA);
+        ASSERT(!bc_find_symbol(image, "missing"));
+
+        VM vm = {0};
+        vm_init_image(&vm, image);
+        ASSERT(vm_verify(&vm));
+        ASSERT(vm_interp(&vm));
+        u64 value;
+        memcpy(&value, image->sections[BC_SECTION_DATA] + symbol->offset, sizeof value);
+        ASSERT(value == 100);
+        ASSERT(vm.registers[5].u == 20);
+        ASSERT(vm.registers[7].u == 0xBC02000000000010);
+    }
+    bc_unload_program(&images[0]);
+    bc_unload_program(&images[1]);
+    arrsetlen(block.code, 0);
+    arrfree(block.address_sites);
+}
+void test_bytecode_register_allocation() {
+    SETUP();
+
+    // Every temporary is given a fresh virtual register, only a few are live at once
+    Reg next = 1000;
+    Reg sum = next++;
+    Reg i = next++;
+    e_mov(&builder, sum, imm(0));
+    e_mov(&builder, i, imm(0));
+    i64 loop = arrlen(block.code);
+    for (int j = 0; j < 50; j++) {
+        Reg a = next++;
+        Reg b = next++;
+        e_mul(&builder, a, reg(i), imm(j));
+        e_add(&builder, b, reg(a), imm(1));
+        e_add(&builder, sum, reg(sum), reg(b));
+    }
+    e_add(&builder, i, reg(i), imm(1));
+    e_cmp(&builder, reg(i), imm(10));
+    e_jl (&builder, imm(loop - (arrlen(block.code) + 10)));
+    e_mov(&builder, 4, reg(sum));
+    e_hlt(&builder);
+
+    i64 len = arrlen(block.code);
+    u32 highest;
+    ASSERT(bc_allocate_registers(&block, 5, &highest));
+    ASSERT(highest == 4 + 3); // sum, i, and a sharing with the b it is last read by
+    ASSERT(arrlen(block.code) < len); // every register fits in a byte
+
+    vm_init(&vm, block.code, highest);
+    ASSERT(vm_verify(&vm));
+    ASSERT(vm_interp(&vm));
+    // sum over i < 10 and j < 50 of i * j + 1
+    ASSERT(vm.registers[4].u == 45 * 1225 + 500);
+    arrsetlen(block.code, 0);
+
+    // A value written by the instruction its operand dies at reuses the operand's register
+    e_mov(&builder, 5, imm(3));
+    e_add(&builder, 6, reg(5), imm(1));
+    e_add(&builder, 7, reg(6), imm(1));
+    e_mov(&builder, 4, reg(7));
+    e_hlt(&builder);
+    ASSERT(bc_allocate_registers(&block, 5, &highest));
+    ASSERT(highest == 5);
+    vm_init(&vm, block.code, highest);
+    ASSERT(vm_interp(&vm));
+    ASSERT(vm.registers[4].u == 5);
+    arrsetlen(block.code, 0);
+}
+
+void test_bytecode_register_allocation_hot_values() {
+    SETUP();
+
+    // More values are live at once than fit in a byte, the loop counter should still get one
+    Reg cold = 10000;
+    for (Reg r = cold; r < cold + 300; r++) e_mov(&builder, r, imm(r));
+    Reg i = 20000;
+    e_mov(&builder, i, imm(0));
+    i64 loop = arrlen(block.code);
+    e_add(&builder, i, reg(i), imm(1));
+    e_cmp(&builder, reg(i), imm(100));
+    e_jl (&builder, imm(loop - (arrlen(block.code) + 10)));
+    e_mov(&builder, 4, reg(i));
+    e_mov(&builder, 5, RZ0);
+    for (Reg r = cold; r < cold + 300; r++) e_add(&builder, 5, reg(5), reg(r));
+    e_hlt(&builder);
+
+    u32 highest;
+    ASSERT(bc_allocate_registers(&block, 6, &highest));
+    ASSERT(highest > UINT8_MAX);
+
+    vm_init(&vm, block.code, highest);
+    ASSERT(vm_interp(&vm));
+    ASSERT(vm.registers[4].u == 100);
+    ASSERT(vm.registers[5].u == 300 * cold + 299 * 150);
+    for (i64 j = 0; j < arrlen(vm.insts); j++) {
+        if (vm.insts[j].op == VM_ADD_RI) ASSERT(vm.insts[j].x <= UINT8_MAX);
+    }
+    arrsetlen(block.code, 0);
 }
 #undef SETUP
 #endif